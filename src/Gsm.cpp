@@ -12,15 +12,27 @@
 #include "freertos/task.h"
 #include <esp_task_wdt.h>
 #include "async_server.h"
-
-// Define the broker and port as macros
-#define BROKER "iot.thingsty.com"
-#define PORT 8883
-#define CLIENT_ID "625fdecb95fe84dd1ac9"
-#define MQTT_TOPIC "625fdecb95fe8/pub/l/4dd1ac9"
+#include "gsm_retry.h"
+#include "gsm_link.h"
+#include "gsm_apn.h"
+#include "at_parser.h"
+#include "gsm_uart.h"
+#include "config_store.h"
+#include "duty_cycle.h"
+#include "gsm_power.h"
+#include "sensor.h"
+#include "boot.h"
+#include "gsm_ota.h"
+#include "tsdb.h"
+
+// Broker, client id, topic and APN come from the config store (config_store.cpp),
+// this APN is only the last resort for operators missing from the APN table; a build
+// for another network sets its own, e.g. -DSIM_APN='"internet"'
+#ifndef SIM_APN
 #define SIM_APN "wap.mobilinkworld.com"
+#endif
 
-SoftwareSerial GSM(19, 18);
+HardwareSerial GSM(2); // UART2, pins set up by gsmUartBegin()
 
 // **************************************************************************************
 //
@@ -31,28 +43,64 @@ SoftwareSerial GSM(19, 18);
 
 String _buffer;
 static char rx_buf[MAX_RX_CAHRS];
+static atResponse_t rx_records; // rx_buf parsed into typed records, points into rx_buf
 static bool mqttAlreadyOpen = false;
 static bool mqtt = false;
 static bool simInserted = false;
 static bool dataPublished = false;
-static char jsonBuffer[30]; // Ensure the buffer is large enough to hold the JSON string
-static unsigned char errorretry = 0;
+static bool clockSynced = false; // network time handed to the history once per wake
+static char jsonBuffer[256]; // Ensure the buffer is large enough to hold the JSON string
+static sensorSample_t pendingSamples[LINK_BATCH_MAX]; // readings held back by the link scheduler
+static bool linkCleared = false; // the scheduler let this bring-up go ahead, until the next publish
+static uint8_t pendingCount = 0;
+static volatile uint8_t configPending = 0; // CONFIG_CHANGED_* not yet applied to the modem
+static portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED;
 // bool needToOpenMqttAgain = false;
-bool takeSensorReadings = false;
 bool gsmError = false;
 
 unsigned long errorStateStartTime = 0;
 const unsigned long errorStateDuration = 1 * 60 * 1000; // 5 minutes in milliseconds
 
+// Snapshot of the last known-good modem session, kept in RTC slow memory so it
+// survives ESP32 deep sleep (the M95 stays powered, only its DTR is dropped)
+#define SESSION_MAGIC 0x4D393553UL
+#define SESSION_REGISTERED 0x01
+#define SESSION_SSL_LOADED 0x02
+#define SESSION_PDP_ACTIVE 0x04
+#define SESSION_MQTT_OPEN 0x08
+
+// longest chained command line sent in one go, well inside the M95 input buffer
+#define AT_BATCH_LINE_MAX 160
+
+#define RETRY_SLEEP_US (15ULL * 60ULL * 1000000ULL) // back off 15 minutes when a cycle gives up
+
 // **************************************************************************************
 //
 //      Data structures
 //
 //
 // **************************************************************************************
+typedef struct
+{
+    uint32_t magic;
+    uint8_t flags;
+} gsmSession_t;
+
+RTC_DATA_ATTR static gsmSession_t gsmSession = {0, 0};
+
+// one command of a chained "AT<cmd>;<cmd>;..." line, results are filled in by sendBatch()
+typedef struct
+{
+    const char *command; // without the "AT" prefix, e.g. "+CFUN=1" or "E0"
+    atRecordType expect; // intermediate record the command answers with, AT_REC_OK for none
+    bool ok;
+    int32_t value; // first numeric argument of the expected record
+} atBatchCmd_t;
+
 enum gsmState
 {
-    checkGsmResponse = 1,
+    resumeSession = 0,
+    checkGsmResponse,
     checkSimPresense,
     storeCertAndConfigSSL,
     registerNetwork,
@@ -62,7 +110,7 @@ enum gsmState
     errorState
 };
 
-enum gsmState gsmStateRun = checkGsmResponse;
+enum gsmState gsmStateRun = resumeSession;
 
 // **************************************************************************************
 //
@@ -72,24 +120,38 @@ enum gsmState gsmStateRun = checkGsmResponse;
 // **************************************************************************************
 
 static void readGSMResponse();
-static bool waitForResponse(const char *response, unsigned long timeout);
+static const atRecord_t *waitForResponse(atRecordType response, unsigned long timeout);
 static bool checkModuleResponse();
-static void processResponseCCID(const char *response);
+static void processResponseCCID();
 static bool checkGSMRegistration();
 static bool checkGPRS();
 static bool openMqtt();
 static bool openMqttConnection();
-static void isDataPublished(const char *response);
+static void isDataPublished();
+static uint8_t sendBatch(atBatchCmd_t *cmds, uint8_t count);
 static void checkResponse();
 static void checkSim();
 static void networkReg();
 static void configSSL();
 static void gprsOpen();
 static void mqttOpen();
-static void createJSON(uint16_t readInMM);
+static void createJSON(const sensorSample_t *samples, uint8_t count);
+static void collectSamples();
+static bool linkGate();
+static void idleRound();
 static void publishData();
 static void enterDeepSleep();
 static void restartGSM();
+static void sessionMark(uint8_t flags);
+static void sessionClear();
+static void sessionDrop(uint8_t flags);
+static const atRecord_t *sessionProbe(const char *command, atRecordType response);
+static bool localIpProbe();
+static void sessionResume();
+static void configChanged(uint8_t changed);
+static void applyConfigChanges();
+static uint32_t modemTime(const atRecord_t *record);
+static void syncClock();
 
 // **************************************************************************************
 //
@@ -125,13 +187,18 @@ static void readGSMResponse()
         }
     }
     Serial.println(rx_buf);
+    (void)atParse(rx_buf, strlen(rx_buf), &rx_records);
+    if (rx_records.dropped != 0)
+    {
+        printf("AT parser: %u lines past the %u record limit not parsed\n", rx_records.dropped, AT_MAX_RECORDS);
+    }
 }
 
-static bool waitForResponse(const char *response, unsigned long timeout)
+// returns the expected record, or NULL on ERROR / +CME ERROR / timeout
+static const atRecord_t *waitForResponse(atRecordType response, unsigned long timeout)
 {
     unsigned long startTime = millis();
-    uint8_t *searchString = 0;
-    bool ret = 0;
+    const atRecord_t *record = NULL;
 
     while (millis() - startTime < timeout)
     {
@@ -139,81 +206,49 @@ static bool waitForResponse(const char *response, unsigned long timeout)
         readGSMResponse();
         esp_task_wdt_reset();
         Serial.println(millis() - startTime);
-        searchString = (uint8_t *)strstr(rx_buf, response);
-        if (searchString != NULL)
+        record = atFind(&rx_records, response);
+        if (record != NULL)
         {
-            ret = true;
             break;
         }
-        searchString = (uint8_t *)strstr(rx_buf, "ERROR");
-        if (searchString != NULL)
+        if (atFind(&rx_records, AT_REC_ERROR) || atFind(&rx_records, AT_REC_CME_ERROR))
         {
-            ret = false;
             break;
         }
-        searchString = (uint8_t *)strstr(rx_buf, "+CME ERROR:");
-        if (searchString != NULL)
-        {
-            ret = false;
-            break;
-        }
-    }
-    return ret; // Timed out waiting for the response
-}
-
-uint8_t ProcessCopsCommand(const char *response)
-{
-    uint8_t ret = 0;
-    if (strstr(response, "Telenor"))
-    {
-        ret = 1; // carrier telenor
-        Serial.println("Network is Telenor");
-    }
-    else if (strstr(response, "Mobilink"))
-    {
-        ret = 2; // carrier Mobilink Jazz
-        Serial.println("Network is JAZZ");
     }
-    return ret;
+    return record; // Timed out waiting for the response
 }
 
 static bool checkModuleResponse()
 {
     bool ret = false;
-    char retries = 0;
-    uint8_t *responseString = 0;
     do
     {
         esp_task_wdt_reset();
         GSM.print(F("AT\r\n"));
         readGSMResponse();
-        responseString = (uint8_t *)strstr(rx_buf, "OK");
-        if (responseString != 0)
+        if (atFind(&rx_records, AT_REC_OK) != NULL)
         {
-            printf("ATString: %s\n", responseString);
+            printf("AT OK\n");
             ret = true; // modem detected and responsed
         }
         else
         {
             printf("AT not found, Module not responded\n");
             ret = false; // modem not detected
-            retries++;
         }
-        vTaskDelay(pdMS_TO_TICKS(10));
-    } while ((ret == false) && (retries < 15));
+    } while ((ret == false) && retryStageNext(STAGE_MODEM));
     return ret;
 }
 
-static void processResponseCCID(const char *response)
+static void processResponseCCID()
 {
-    uint8_t *CCIDString = 0;
-    CCIDString = (uint8_t *)strstr(response, "+CCID");
-    if (CCIDString != 0)
+    const atRecord_t *ccid = atFind(&rx_records, AT_REC_CCID);
+    const atRecord_t *error = atFind(&rx_records, AT_REC_CME_ERROR);
+
+    if ((ccid != NULL) && (ccid->text != NULL))
     {
-        // Increment the pointer to skip "+COPS:"
-        CCIDString += 6;
-        // Print the resulting copsString
-        printf("CCIDString: %s\n", CCIDString);
+        printf("CCIDString: %.*s\n", ccid->textLen, ccid->text);
         simInserted = true;
     }
     else
@@ -221,8 +256,10 @@ static void processResponseCCID(const char *response)
         printf("CCID not found in the response.\n");
     }
 
-    // Check if the response contains "+CREG: 0,1" or "+CREG: 0,5"
-    if (strstr(response, "+CME ERROR: SIM not inserted"))
+    // "+CME ERROR: SIM not inserted" (verbose) or code 10 (numeric)
+    if ((error != NULL) && ((atArg(error, 0, -1) == 10) ||
+                            ((error->text != NULL) && (error->textLen == strlen("SIM not inserted")) &&
+                             (strncmp(error->text, "SIM not inserted", error->textLen) == 0))))
     {
         printf("Sim not present in module.\n");
         simInserted = false;
@@ -251,21 +288,21 @@ static void processResponseCCID(const char *response)
 static bool checkGSMRegistration()
 {
     bool ret = false;
-    char retries = 0;
+    int32_t stat;
     do
     {
         esp_task_wdt_reset();
         GSM.print(F("AT+CREG?\r\n"));
         readGSMResponse();
+        stat = atArg(atFind(&rx_records, AT_REC_CREG), 1, -1);
+        linkSampleCREG(stat);
 
-        if (strstr(rx_buf, "+CREG: 0,1") || strstr(rx_buf, "+CREG: 0,5"))
+        if ((stat == 1) || (stat == 5)) // home network or roaming
         {
             printf("Registered to the network\n");
             ret = true;
         }
-        retries++;
-        vTaskDelay(pdMS_TO_TICKS(10));
-    } while ((ret == false) && (retries < 50));
+    } while ((ret == false) && retryStageNext(STAGE_REGISTER));
     return ret;
 }
 
@@ -276,7 +313,7 @@ static bool checkGPRS()
     readGSMResponse();
     bool ret = false;
 
-    if (strstr(rx_buf, "+CGATT: 1"))
+    if (atArg(atFind(&rx_records, AT_REC_CGATT), 0, 0) == 1)
     {
         ret = true; // GPRS active
     }
@@ -289,188 +326,136 @@ static bool checkGPRS()
 
 static bool openMqtt()
 {
-    uint8_t *mqttString = 0;
-    bool ret;
-    unsigned char retries = 0;
+    const atRecord_t *mqttRecord = NULL;
+    bool ret = false;
+    appConfig_t config;
     // Buffer to hold the constructed string
     char mqttStr[100]; // Make sure the buffer is large enough to hold the entire string
 
     // Construct the full mqttStr string
-    sprintf(mqttStr, "AT+QMTOPEN=0,\"%s\",%d\r\n", BROKER, PORT);
+    configGet(&config);
+    sprintf(mqttStr, "AT+QMTOPEN=0,\"%s\",%u\r\n", config.broker, config.port);
     // Print the resulting string (for demonstration)
     printf("%s", mqttStr);
 
+    retryStageBegin(STAGE_MQTT_OPEN);
     do
     {
         esp_task_wdt_reset();
         GSM.print(mqttStr);
-        ret = waitForResponse("+QMTOPEN:", 75000);
-        if (ret == true)
+        mqttRecord = waitForResponse(AT_REC_QMTOPEN, retryRemaining(STAGE_MQTT_OPEN, 75000));
+        if (mqttRecord != NULL)
         {
-            mqttString = (uint8_t *)strstr(rx_buf, "+QMTOPEN:");
-            if (mqttString != 0)
+            // +QMTOPEN: <tcpconnectID>,<result>
+            int32_t num1 = atArg(mqttRecord, 0, -1);
+            int32_t num2 = atArg(mqttRecord, 1, -1);
+            printf("QMTOPEN: %ld,%ld\n", (long)num1, (long)num2);
+            // Check the values
+            if (num1 == 0 && num2 == 0)
             {
-                mqttString += 9;
-
-                // Print the resulting String
-                printf("MQTTString: %s\n", mqttString);
-                // Parse the result manually
-                int num1 = -1, num2 = -1;
-
-                char *token = strtok((char *)mqttString, ",");
-
-                if (token != NULL)
-                {
-                    num1 = atoi(token); // Convert the first number
-                    token = strtok(NULL, ",");
-                    if (token != NULL)
-                    {
-                        num2 = atoi(token); // Convert the second number
-                    }
-                }
-                Serial.println(num1);
-                Serial.println(num2);
-                // Check the values
-                if (num1 == 0 && num2 == 0)
-                {
-                    Serial.println("MQTT OPEN");
-                    ret = true;
-                    mqttAlreadyOpen = true;
-                }
-                else if (num1 == 0 && num2 == 2)
-                {
-                    Serial.println("MQTT Already OPEN");
-                    ret = false;
-                    mqttAlreadyOpen = true;
-                }
-                else
-                {
-                    Serial.println("MQTT not Open");
-                    ret = false;
-                    mqttAlreadyOpen = false;
-                }
-                vTaskDelay(pdMS_TO_TICKS(10));
+                Serial.println("MQTT OPEN");
+                ret = true;
+                mqttAlreadyOpen = true;
+            }
+            else if (num1 == 0 && num2 == 2)
+            {
+                Serial.println("MQTT Already OPEN");
+                ret = false;
+                mqttAlreadyOpen = true;
             }
             else
             {
-                printf("MQTT not found in the response.\n");
+                Serial.println("MQTT not Open");
                 ret = false;
                 mqttAlreadyOpen = false;
-                vTaskDelay(pdMS_TO_TICKS(10));
             }
         }
-        vTaskDelay(pdMS_TO_TICKS(10));
-        retries++;
-    } while (mqttAlreadyOpen == false && retries < 7);
+        else
+        {
+            printf("MQTT not found in the response.\n");
+            ret = false;
+            mqttAlreadyOpen = false;
+        }
+    } while (mqttAlreadyOpen == false && retryStageNext(STAGE_MQTT_OPEN));
 
     if ((ret == false) && (mqttAlreadyOpen != true))
     {
         Serial.println("retries exceed for open mqtt");
     }
+    retryStageEnd(STAGE_MQTT_OPEN, mqttAlreadyOpen);
     return ret;
 }
 
 static bool openMqttConnection()
 {
-    uint8_t *mqttConnString = 0;
+    const atRecord_t *connRecord = NULL;
     bool ret = false;
-    unsigned char retries = 0;
+    appConfig_t config;
 
     // Buffer to hold the constructed string
     char mqttConnStr[100]; // Make sure the buffer is large enough to hold the entire string
     // Construct the full mqttConnStr string
-    sprintf(mqttConnStr, "AT+QMTCONN=0,\"%s\"\r\n", CLIENT_ID);
+    configGet(&config);
+    sprintf(mqttConnStr, "AT+QMTCONN=0,\"%s\"\r\n", config.clientId);
     // Print the resulting string (for demonstration)
     printf("%s", mqttConnStr);
 
+    retryStageBegin(STAGE_MQTT_CONN);
     do
     {
         esp_task_wdt_reset();
         GSM.print(mqttConnStr);
-        ret = waitForResponse("+QMTCONN:", 7000);
-        if (ret == true)
+        connRecord = waitForResponse(AT_REC_QMTCONN, retryRemaining(STAGE_MQTT_CONN, 7000));
+        if (connRecord != NULL)
         {
-            mqttConnString = (uint8_t *)strstr(rx_buf, "+QMTCONN:");
-            if (mqttConnString != NULL)
+            // +QMTCONN: <tcpconnectID>,<result>,<ret_code>
+            int32_t num1 = atArg(connRecord, 0, -1);
+            int32_t num2 = atArg(connRecord, 1, -1);
+            int32_t num3 = atArg(connRecord, 2, -1);
+            printf("QMTCONN: %ld,%ld,%ld\n", (long)num1, (long)num2, (long)num3);
+            if ((num1 == 0 && num2 == 0 && num3 == 0))
             {
-                // Increment the pointer to skip "+COPS:"
-                mqttConnString += 9;
-
-                // Print the resulting copsString
-                printf("MQTTString: %s\n", mqttConnString);
-                // Parse the result manually
-                int num1 = -1, num2 = -1, num3 = -1;
-
-                char *token = strtok((char *)mqttConnString, ",");
-
-                if (token != NULL)
-                {
-                    num1 = atoi(token); // Convert the first number
-                    token = strtok(NULL, ",");
-                    if (token != NULL)
-                    {
-                        num2 = atoi(token); // Convert the second number
-                        token = strtok(NULL, ",");
-                        if (token != NULL)
-                        {
-                            num3 = atoi(token); // Convert the second number
-                        }
-                    }
-                }
-                Serial.println(num1);
-                Serial.println(num2);
-                Serial.println(num3);
-                // Check the values
-                if ((num1 == 0 && num2 == 0 && num3 == 0))
-                {
-                    // Perform some stuff
-                    Serial.println("MQTT connection OPEN");
-                    ret = true;
-                    break;
-                }
-                else
-                {
-                    Serial.println("MQTT connection not Open");
-                    ret = false;
-                }
-                vTaskDelay(pdMS_TO_TICKS(100));
+                Serial.println("MQTT connection OPEN");
+                ret = true;
+                break;
             }
             else
             {
-                printf("QMTCONN not found in the response.\n");
+                Serial.println("MQTT connection not Open");
                 ret = false;
-                vTaskDelay(pdMS_TO_TICKS(100));
-                // needToOpenMqttAgain = true;
             }
+        }
+        else
+        {
+            printf("QMTCONN not found in the response.\n");
+            ret = false;
+            // needToOpenMqttAgain = true;
+        }
 
-            if (strstr(rx_buf, "+QMTSTAT: 0,1"))
-            {
-                Serial.println("+QMTSTAT: 0,1 received so mqtt need to open again");
-                // needToOpenMqttAgain = true;
-            }
+        if (atArg(atFind(&rx_records, AT_REC_QMTSTAT), 1, 0) == 1)
+        {
+            Serial.println("+QMTSTAT: 0,1 received so mqtt need to open again");
+            // needToOpenMqttAgain = true;
         }
-        vTaskDelay(pdMS_TO_TICKS(100));
-        retries++;
-    } while (ret == false && retries < 7);
+    } while (ret == false && retryStageNext(STAGE_MQTT_CONN));
     if (ret == false)
     {
         Serial.println("timeout mqtt connection\n");
     }
+    retryStageEnd(STAGE_MQTT_CONN, ret);
     return ret;
 }
 
-static void isDataPublished(const char *response)
+static void isDataPublished()
 {
-    uint8_t *pubString = 0;
-    pubString = (uint8_t *)strstr(response, "+QMTPUB:");
-    if (pubString != 0)
+    const atRecord_t *pubRecord = atFind(&rx_records, AT_REC_QMTPUB);
+    if (pubRecord != NULL)
     {
-        // Increment the pointer to skip "+COPS:"
-        pubString += 8;
-        // Print the resulting pubString
-        printf("MQTTPUBtring: %s\n", pubString);
+        // +QMTPUB: <tcpconnectID>,<msgID>,<result>
+        printf("QMTPUB: %ld,%ld,%ld\n", (long)atArg(pubRecord, 0, -1), (long)atArg(pubRecord, 1, -1),
+               (long)atArg(pubRecord, 2, -1));
 
-        if (strstr((char *)pubString, "0,0,0"))
+        if ((atArg(pubRecord, 0, -1) == 0) && (atArg(pubRecord, 1, -1) == 0) && (atArg(pubRecord, 2, -1) == 0))
         {
             Serial.println("Data Published Succesfully");
             dataPublished = true;
@@ -487,40 +472,94 @@ static void isDataPublished(const char *response)
     }
 }
 
+// **************************************************************************************
+//
+//      Sends compatible commands chained on one command line ("AT+A;+B;E0"), costing a
+//      single round trip. On a clean final OK every command is marked ok and gets the
+//      value of its expected intermediate record. The M95 stops at the first failing
+//      command of a chain without telling which one, so on ERROR the chain falls back
+//      to sending each command on its own. Commands that switch to a data mode
+//      (QSECWRITE, QMTPUB) or answer with late URCs (QMTOPEN/CONN) must not be batched.
+//
+// **************************************************************************************
+static uint8_t sendBatch(atBatchCmd_t *cmds, uint8_t count)
+{
+    char line[AT_BATCH_LINE_MAX + 4];
+    uint8_t first = 0;
+    uint8_t okCount = 0;
+
+    while (first < count)
+    {
+        // greedily pack as many commands as fit in one line
+        uint8_t last = first;
+        size_t len = sprintf(line, "AT%s", cmds[first].command);
+        while ((last + 1 < count) && (len + 1 + strlen(cmds[last + 1].command) <= AT_BATCH_LINE_MAX))
+        {
+            last++;
+            len += sprintf(&line[len], ";%s", cmds[last].command);
+        }
+        sprintf(&line[len], "\r\n");
+
+        esp_task_wdt_reset();
+        GSM.print(line);
+        readGSMResponse();
+        bool chainOk = (atFind(&rx_records, AT_REC_OK) != NULL) && (atFind(&rx_records, AT_REC_ERROR) == NULL) &&
+                       (atFind(&rx_records, AT_REC_CME_ERROR) == NULL);
+        for (uint8_t i = first; i <= last; i++)
+        {
+            if (chainOk == false)
+            {
+                // per command fallback so every result is attributed
+                sprintf(line, "AT%s\r\n", cmds[i].command);
+                GSM.print(line);
+                readGSMResponse();
+                cmds[i].ok = (atFind(&rx_records, AT_REC_OK) != NULL);
+            }
+            else
+            {
+                cmds[i].ok = true;
+            }
+            cmds[i].value = atArg(atFind(&rx_records, cmds[i].expect), 0, -1);
+            printf("AT%s: %s\n", cmds[i].command, cmds[i].ok ? "OK" : "ERROR");
+            okCount += cmds[i].ok ? 1 : 0;
+        }
+        first = last + 1;
+    }
+    return okCount;
+}
+
 static void checkResponse()
 {
     bool modemDetected = false;
     vTaskDelay(pdMS_TO_TICKS(200));
-    GSM.print(F("AT+IPR=9600\r\n"));
-    readGSMResponse();
-    GSM.print(F("AT+IPR=9600\r\n"));
-    readGSMResponse();
+    retryStageBegin(STAGE_MODEM);
     modemDetected = checkModuleResponse();
+    retryStageEnd(STAGE_MODEM, modemDetected);
     errorStateStartTime = 0;
     if (modemDetected == true)
     {
-        GSM.print(F("AT+CFUN=1\r\n"));
-        readGSMResponse();
-
+        if (gsmUartBaud() < GSM_UART_MAX_BAUD)
+        {
+            (void)gsmUartNegotiate(GSM_UART_MAX_BAUD);
+        }
+#ifdef GSM_UART_BENCHMARK
+        (void)bootWait(BOOT_BIT(BOOT_CERTS), BOOT_WAIT_FOREVER);
+        gsmUartBenchmark(Read_rootca);
+#endif
+        atBatchCmd_t setup[] = {
+            {"+CFUN=1", AT_REC_OK, false, 0},
+            {"+IPR?", AT_REC_IPR, false, 0},
+            {"I", AT_REC_OK, false, 0},
+            {"+GSN", AT_REC_OK, false, 0},
+            {"E0", AT_REC_OK, false, 0},       // turn echo off
+            {"+QSCLK=1", AT_REC_OK, false, 0}, // Configuring sleep mode
+            {"+QNITZ=1", AT_REC_OK, false, 0}, // network time from the registration
+            {"+CTZU=3", AT_REC_OK, false, 0},  // RTC follows it, local time and zone
+        };
         // GSM.print(F("AT&W\r\n")); // save settings
-        // readGSMResponse();
-        GSM.print(F("AT+IPR?\r\n"));
-        readGSMResponse();
-
-        GSM.print(F("ATI\r\n"));
-        readGSMResponse();
-
-        GSM.print(F("AT+GSN\r\n"));
-        readGSMResponse();
-
         // GSM.print(F("AT+QGMR\r\n")); // firmware version of module
-        // readGSMResponse();
-
-        GSM.print(F("ATE0\r\n")); // turn echo off
-        readGSMResponse();
-
-        GSM.println("AT+QSCLK=1\r\n"); // Configuring sleep mode
-        readGSMResponse();
+        (void)sendBatch(setup, sizeof(setup) / sizeof(setup[0]));
+        printf("Modem baud rate: %ld\n", (long)setup[1].value);
 
         gsmStateRun = checkSimPresense;
     }
@@ -538,19 +577,19 @@ static void checkResponse()
 
 static void checkSim()
 {
-    char retries = 0;
+    retryStageBegin(STAGE_SIM);
     do
     {
         esp_task_wdt_reset();
         GSM.print(F("AT+CCID\r\n")); // Read SIM information to confirm whether the SIM is plugged
         readGSMResponse();
-        processResponseCCID(rx_buf);
-        retries++;
-        vTaskDelay(pdMS_TO_TICKS(10));
-    } while ((simInserted == false) && (retries < 30));
+        processResponseCCID();
+    } while ((simInserted == false) && retryStageNext(STAGE_SIM));
+    retryStageEnd(STAGE_SIM, simInserted);
 
     GSM.print(F("AT+CSQ\r\n")); // Signal quality test, value range is 0-31 , 31 is the best
     readGSMResponse();
+    linkSampleCSQ(atArg(atFind(&rx_records, AT_REC_CSQ), 0, 99));
 
     if (simInserted == true)
     {
@@ -567,9 +606,12 @@ static void networkReg()
 {
     bool reg = false;
     vTaskDelay(pdMS_TO_TICKS(100));
+    retryStageBegin(STAGE_REGISTER);
     reg = checkGSMRegistration();
+    retryStageEnd(STAGE_REGISTER, reg);
     if (reg == true)
     {
+        sessionMark(SESSION_REGISTERED);
         gsmStateRun = storeCertAndConfigSSL;
     }
     else
@@ -581,6 +623,17 @@ static void networkReg()
 
 static void configSSL()
 {
+    uint8_t certsWritten = 0;
+    unsigned long certStart;
+    if (!linkGate())
+    {
+        return;
+    }
+    // the certificates are read by a boot stage that may still be running on a cold boot
+    (void)bootWait(BOOT_BIT(BOOT_CERTS), BOOT_WAIT_FOREVER);
+    certStart = millis();
+    retryStageBegin(STAGE_SSL);
+    dutyBoostBegin(); // certificate streaming keeps the CPU busy feeding the UART
     // GSM.print(F("AT+QSECDEL=\"RAM:cacert.pem\"\r\n"));
     // readGSMResponse();
     // GSM.print(F("AT+QSECDEL=\"RAM:client.pem\"\r\n"));
@@ -588,13 +641,12 @@ static void configSSL()
     // GSM.print(F("AT+QSECDEL=\"RAM:user_key.pem\"\r\n"));
     // readGSMResponse();
 
-    GSM.print(F("AT+QMTCFG=\"SSL\",0,1,2\r\n"));
-    readGSMResponse();
     GSM.print(F("AT+QSECWRITE=\"RAM:cacert.pem\",1187,100\r\n"));
-    if (waitForResponse("CONNECT", 10000))
+    if (waitForResponse(AT_REC_CONNECT, 10000))
     {
         GSM.print(Read_rootca);
         readGSMResponse();
+        certsWritten++;
     }
     else
     {
@@ -602,10 +654,11 @@ static void configSSL()
     }
 
     GSM.print(F("AT+QSECWRITE=\"RAM:client.pem\",1224,100\r\n"));
-    if (waitForResponse("CONNECT", 10000))
+    if (waitForResponse(AT_REC_CONNECT, 10000))
     {
         GSM.print(Client_cert);
         readGSMResponse();
+        certsWritten++;
     }
     else
     {
@@ -613,73 +666,99 @@ static void configSSL()
     }
 
     GSM.print(F("AT+QSECWRITE=\"RAM:user_key.pem\",1679,100\r\n"));
-    if (waitForResponse("CONNECT", 10000))
+    if (waitForResponse(AT_REC_CONNECT, 10000))
     {
         GSM.print(Client_privatekey);
         readGSMResponse();
+        certsWritten++;
     }
     else
     {
         Serial.println("No CONNECT response received for Client PVT key");
     }
+    dutyBoostEnd();
+    printf("Certificates pushed in %lu ms at %lu baud\n", millis() - certStart, (unsigned long)gsmUartBaud());
 
     vTaskDelay(pdMS_TO_TICKS(200));
-    GSM.print(F("AT+QSECREAD=\"RAM:cacert.pem\"\r\n"));
-    readGSMResponse();
-
-    GSM.print(F("AT+QSECREAD=\"RAM:client.pem\"\r\n"));
-    readGSMResponse();
-    vTaskDelay(pdMS_TO_TICKS(200));
-
-    GSM.print(F("AT+QSECREAD=\"RAM:user_key.pem\"\r\n"));
-    readGSMResponse();
-    vTaskDelay(pdMS_TO_TICKS(200));
-
-    GSM.print(F("AT+QSSLCFG=\"cacert\",2,\"RAM:cacert.pem\"\r\n"));
-    readGSMResponse();
-    GSM.print(F("AT+QSSLCFG=\"clientcert\",2,\"RAM:client.pem\"\r\n"));
-    readGSMResponse();
-    GSM.print(F("AT+QSSLCFG=\"clientkey\",2,\"RAM:user_key.pem\"\r\n"));
-    readGSMResponse();
-
-    GSM.print(F("AT+QSSLCFG=\"seclevel\",2,2\r\n"));
-    readGSMResponse();
-    GSM.print(F("AT+QSSLCFG=\"sslversion\",2,4\r\n"));
-    readGSMResponse();
-    GSM.print(F("AT+QSSLCFG=\"ciphersuite\",2,\"0xFFFF\"\r\n"));
-    readGSMResponse();
-    GSM.print(F("AT+QSSLCFG=\"ignorertctime\",1\r\n"));
-    readGSMResponse();
-
+    atBatchCmd_t certCheck[] = {
+        {"+QSECREAD=\"RAM:cacert.pem\"", AT_REC_OK, false, 0},
+        {"+QSECREAD=\"RAM:client.pem\"", AT_REC_OK, false, 0},
+        {"+QSECREAD=\"RAM:user_key.pem\"", AT_REC_OK, false, 0},
+    };
+    (void)sendBatch(certCheck, sizeof(certCheck) / sizeof(certCheck[0]));
+
+    atBatchCmd_t sslConfig[] = {
+        {"+QMTCFG=\"SSL\",0,1,2", AT_REC_OK, false, 0},
+        {"+QSSLCFG=\"cacert\",2,\"RAM:cacert.pem\"", AT_REC_OK, false, 0},
+        {"+QSSLCFG=\"clientcert\",2,\"RAM:client.pem\"", AT_REC_OK, false, 0},
+        {"+QSSLCFG=\"clientkey\",2,\"RAM:user_key.pem\"", AT_REC_OK, false, 0},
+        {"+QSSLCFG=\"seclevel\",2,2", AT_REC_OK, false, 0},
+        {"+QSSLCFG=\"sslversion\",2,4", AT_REC_OK, false, 0},
+        {"+QSSLCFG=\"ciphersuite\",2,\"0xFFFF\"", AT_REC_OK, false, 0},
+        {"+QSSLCFG=\"ignorertctime\",1", AT_REC_OK, false, 0},
+    };
+    (void)sendBatch(sslConfig, sizeof(sslConfig) / sizeof(sslConfig[0]));
+
+    if (certsWritten == 3)
+    {
+        sessionMark(SESSION_SSL_LOADED);
+    }
+    retryStageEnd(STAGE_SSL, certsWritten == 3);
     gsmStateRun = openGPRS;
 }
 
 static void gprsOpen()
 {
-    uint8_t carrierDetect = 0;
+    uint32_t mccmnc = 0;
+    const atRecord_t *copsRecord = NULL;
+    appConfig_t config;
+    const apnEntry_t *operatorApn = NULL;
+    bool pdpActive = false;
 
+    if (!linkGate())
+    {
+        return;
+    }
     vTaskDelay(pdMS_TO_TICKS(100));
+    retryStageBegin(STAGE_GPRS);
+    GSM.print(F("AT+COPS=3,2\r\n")); // report the operator as numeric MCC-MNC
+    readGSMResponse();
     GSM.print(F("AT+COPS?\r\n"));
     readGSMResponse();
-    carrierDetect = ProcessCopsCommand(rx_buf);
+    copsRecord = atFind(&rx_records, AT_REC_COPS); // +COPS: <mode>,2,"<mccmnc>"
+    if ((copsRecord != NULL) && (copsRecord->text != NULL))
+    {
+        mccmnc = strtoul(copsRecord->text, NULL, 10);
+    }
+    // /apn.csv is on the data partition, mounted by a boot stage the SIM check ran beside
+    (void)bootWait(BOOT_BIT(BOOT_FS), BOOT_WAIT_FOREVER);
+    operatorApn = apnLookup(mccmnc);
 
     // BUild APN respectively by carrier
-    char APNStr[50]; // Make sure the buffer is large enough to hold the entire string
-    char APN[50];
-    if (carrierDetect == 1)
+    char APNStr[110]; // Make sure the buffer is large enough to hold the entire string
+    configGet(&config);
+    if (config.apn[0] != '\0')
+    {
+        printf("Operator %lu, configured APN %s\n", (unsigned long)mccmnc, config.apn);
+        sprintf(APNStr, "AT+QICSGP=1,\"%s\",\"%s\",\"%s\"\r\n", config.apn, config.apnUser, config.apnPassword);
+    }
+    else if ((operatorApn != NULL) && (operatorApn->auth != APN_AUTH_NONE))
     {
-        strcpy(APN, "internet"); // telenor
+        printf("Operator %lu, APN %s (%s)\n", (unsigned long)mccmnc, operatorApn->apn, apnAuthName(operatorApn->auth));
+        sprintf(APNStr, "AT+QICSGP=1,\"%s\",\"%s\",\"%s\"\r\n", operatorApn->apn, operatorApn->user,
+                operatorApn->password);
     }
-    else if (carrierDetect == 2)
+    else if (operatorApn != NULL)
     {
-        strcpy(APN, "wap.mobilinkworld.com"); // mobilink jazz
+        printf("Operator %lu, APN %s\n", (unsigned long)mccmnc, operatorApn->apn);
+        sprintf(APNStr, "AT+QICSGP=1,\"%s\"\r\n", operatorApn->apn);
     }
     else
     {
-        // do nothing, added suport for only 2 carriers yet
+        printf("WARNING: operator %lu %s, falling back to SIM_APN \"%s\"\n", (unsigned long)mccmnc,
+               (mccmnc == 0) ? "not reported by +COPS" : "not in the APN table", SIM_APN);
+        sprintf(APNStr, "AT+QICSGP=1,\"%s\"\r\n", SIM_APN);
     }
-    // Construct the full mqttConnStr string
-    sprintf(APNStr, "AT+QICSGP=1,\"%s\"\r\n", APN);
     // Print the resulting string (for demonstration)
     printf("%s", APNStr);
 
@@ -698,98 +777,432 @@ static void gprsOpen()
     readGSMResponse();
     GSM.print(F("AT+QIACT\r\n"));
     readGSMResponse();
-    GSM.print(F("AT+QILOCIP\r\n"));
-    readGSMResponse();
+    pdpActive = localIpProbe();
+    if (pdpActive == true)
+    {
+        sessionMark(SESSION_PDP_ACTIVE); // local IP assigned, PDP context is up
+    }
+    retryStageEnd(STAGE_GPRS, pdpActive);
 
     gsmStateRun = openMqttConn;
 }
 
 static void mqttOpen()
 {
+    if (!linkGate())
+    {
+        return;
+    }
     mqtt = false;
     mqtt = openMqtt();
     //    if (mqtt == true)
     //    {
-    (void)openMqttConnection();
+    if (openMqttConnection() == true)
+    {
+        sessionMark(SESSION_MQTT_OPEN);
+    }
     // }
-    takeSensorReadings = true;
     gsmStateRun = publishDataOnMqtt;
 }
 
-static void createJSON(uint16_t distanceInMM)
+// a single reading keeps the original payload, a batch becomes an array; ageS is how long
+// ago each value was taken, the receiver stamps it against its own clock
+static void createJSON(const sensorSample_t *samples, uint8_t count)
 {
-    sprintf(jsonBuffer, "{\"distanceMeasure\": %u}", distanceInMM);
+    unsigned long now = millis();
+    int len;
+
+    if (count == 1)
+    {
+        sprintf(jsonBuffer, "{\"distanceMeasure\": %u, \"ageS\": %lu}", samples[0].distanceInMM,
+                (now - samples[0].timeMs) / 1000UL);
+    }
+    else
+    {
+        len = sprintf(jsonBuffer, "{\"distanceMeasure\": [");
+        for (uint8_t i = 0; i < count; i++)
+        {
+            len += sprintf(&jsonBuffer[len], (i == 0) ? "%u" : ",%u", samples[i].distanceInMM);
+        }
+        len += sprintf(&jsonBuffer[len], "], \"ageS\": [");
+        for (uint8_t i = 0; i < count; i++)
+        {
+            len += sprintf(&jsonBuffer[len], (i == 0) ? "%lu" : ",%lu", (now - samples[i].timeMs) / 1000UL);
+        }
+        sprintf(&jsonBuffer[len], "]}");
+    }
 
     Serial.println(jsonBuffer); // Output: {"distance_measure": 123.45}
 }
 
+// tops the batch up from the acquisition ring, what does not fit waits there
+static void collectSamples()
+{
+    pendingCount += sensorTake(&pendingSamples[pendingCount], LINK_BATCH_MAX - pendingCount);
+}
+
+// **************************************************************************************
+//
+//      Ask the link scheduler before the expensive stages (TLS, PDP, QMTOPEN / QMTCONN)
+//      instead of only at publish time: at poor signal the readings are held and the
+//      modem sleeps, the stage runs again on the next round. Once it let a bring-up go
+//      ahead the later stages of that bring-up pass straight through.
+//
+// **************************************************************************************
+static bool linkGate()
+{
+    if (linkCleared)
+    {
+        return true;
+    }
+    collectSamples();
+    GSM.print(F("AT+CSQ\r\n"));
+    readGSMResponse();
+    linkSampleCSQ(atArg(atFind(&rx_records, AT_REC_CSQ), 0, 99));
+    if (linkDecide(pendingCount) == LINK_PROCEED)
+    {
+        linkCleared = true;
+        return true;
+    }
+    printf("Link quality %d (%d dBm), %u readings held, session not brought up\n", linkGetQuality(), linkGetDbm(),
+           pendingCount);
+    idleRound();
+    return false;
+}
+
+// nothing to send until the next round, the modem waits in slow clock; not counted
+// against the retry cycle budgets
+static void idleRound()
+{
+    dutyPhaseEnter(PHASE_IDLE);
+    gsmPowerReport();
+    retryCyclePause();
+    for (uint8_t i=0; i<60; i++)
+    {
+        (void)gsmPowerSleep(); // nothing queued until the next round
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        Serial.println(i);
+    }
+    retryCycleResume();
+}
+
 static void publishData()
 {
+    appConfig_t config;
     // Buffer to hold the constructed string
-    char mqttPubStr[100]; // Make sure the buffer is large enough to hold the entire string
+    char mqttPubStr[130]; // Make sure the buffer is large enough to hold the entire string
     // Construct the full mqttConnStr string
-    sprintf(mqttPubStr, "AT+QMTPUB=0,0,0,0,\"%s\"\r\n", MQTT_TOPIC);
+    configGet(&config);
+    sprintf(mqttPubStr, "AT+QMTPUB=0,0,0,0,\"%s\"\r\n", config.topic);
     // Print the resulting string (for demonstration)
     printf("%s", mqttPubStr);
 
-    unsigned char retries = 0;
     Serial.flush();
-    createJSON(14);
-    do
+    syncClock(); // before the readings are stamped
+    dutyPhaseEnter(PHASE_SAMPLE);
+    collectSamples();
+
+    // sample the link before deciding whether this round is worth the radio time
+    GSM.print(F("AT+CSQ\r\n"));
+    readGSMResponse();
+    linkSampleCSQ(atArg(atFind(&rx_records, AT_REC_CSQ), 0, 99));
+    if (pendingCount == 0)
     {
-        esp_task_wdt_reset();
-        // if (mqtt == true || mqttAlreadyOpen == true)
-        // {
-            // send data first time
-            GSM.print(mqttPubStr);
-            readGSMResponse();
-            GSM.print(F(jsonBuffer));
-            GSM.write(0X1A);
-            GSM.write(0X1A);
-            readGSMResponse();
-            isDataPublished(rx_buf);
-            vTaskDelay(pdMS_TO_TICKS(2000));
-            // send data second time
+        Serial.println("No samples to publish yet");
+    }
+    else if (linkDecide(pendingCount) != LINK_PROCEED)
+    {
+        printf("Link quality %d (%d dBm), holding %u readings\n", linkGetQuality(), linkGetDbm(), pendingCount);
+    }
+    else
+    {
+        dutyPhaseEnter(PHASE_PUBLISH);
+        createJSON(pendingSamples, pendingCount);
+        dataPublished = false;
+        retryStageBegin(STAGE_PUBLISH);
+        do
+        {
+            esp_task_wdt_reset();
             GSM.print(mqttPubStr);
             readGSMResponse();
             GSM.print(F(jsonBuffer));
             GSM.write(0X1A);
             GSM.write(0X1A);
             readGSMResponse();
-            isDataPublished(rx_buf);
-            vTaskDelay(pdMS_TO_TICKS(2000));
-        // }
-       // esp_task_wdt_reset();
-        retries++;
-    } while ((retries < 3) && (dataPublished == false));
+            isDataPublished();
+        } while ((dataPublished == false) && retryStageNext(STAGE_PUBLISH));
+        retryStageEnd(STAGE_PUBLISH, dataPublished);
 
-    if (dataPublished == true)
-    {
-       // GSM.print(F("AT+QMTDISC=0\r\n")); // disconnect MQTT before entering sleep, so we open again after wakeup
-       // readGSMResponse();
-        errorretry = 0;
-       // enterDeepSleep();
-    }
-    else
-    {
-        gsmStateRun = errorState;
+        if (dataPublished == true)
+        {
+           // GSM.print(F("AT+QMTDISC=0\r\n")); // disconnect MQTT before entering sleep, so we open again after wakeup
+           // readGSMResponse();
+            pendingCount = 0;
+            bootMilestoneReached(BOOT_FIRST_PUBLISH);
+            linkPublished();
+            linkCleared = false; // the next bring-up asks the scheduler again
+            retryCycleReset();
+            gsmError = false;
+            if (gsmOtaRound())
+            {
+                Serial.println("Cellular OTA complete, rebooting into the new firmware");
+                IsRebootRequired = true; // loop() restarts once this round is over
+            }
+            else if (dutySleepAllowed())
+            {
+                // resumeSession probes what survived the modem sleep after wakeup
+                dutyPrepareSleep(TIME_TO_SLEEP);
+                enterDeepSleep();
+            }
+        }
+        else
+        {
+            gsmStateRun = errorState;
+        }
     }
 
-    for (uint8_t i=0; i<60; i++)
-    {
-        vTaskDelay(pdMS_TO_TICKS(1000));
-        Serial.println(i);
-    }
+    idleRound();
 }
 
 static void restartGSM()
 {
+    sessionClear(); // whatever the modem had is gone after CFUN reset
     GSM.print(F("AT+CFUN=0\r\n")); // set module to minimum functioanlity
     readGSMResponse();
     vTaskDelay(pdMS_TO_TICKS(2000));
     GSM.print(F("AT+CFUN=1,1\r\n")); // reset and set module to full functioanlity
     readGSMResponse();
 }
+static void sessionMark(uint8_t flags)
+{
+    gsmSession.magic = SESSION_MAGIC;
+    gsmSession.flags |= flags;
+}
+
+static void sessionClear()
+{
+    gsmSession.magic = 0;
+    gsmSession.flags = 0;
+}
+
+static void sessionDrop(uint8_t flags)
+{
+    gsmSession.flags &= ~flags;
+}
+
+// single cheap query, no retries: used only to validate the RTC snapshot
+static const atRecord_t *sessionProbe(const char *command, atRecordType response)
+{
+    GSM.print(command);
+    readGSMResponse();
+    return atFind(&rx_records, response);
+}
+
+// AT+QILOCIP answers with the bare address, only that counts as an active PDP context;
+// a timeout or an empty reply does not
+static bool localIpProbe()
+{
+    unsigned int octets[4];
+    char text[16];
+
+    GSM.print(F("AT+QILOCIP\r\n"));
+    readGSMResponse();
+    if ((atFind(&rx_records, AT_REC_ERROR) != NULL) || (atFind(&rx_records, AT_REC_CME_ERROR) != NULL))
+    {
+        return false;
+    }
+    for (uint8_t i = 0; i < rx_records.count; i++)
+    {
+        const atRecord_t *record = &rx_records.records[i];
+        if ((record->type != AT_REC_OTHER) || (record->text == NULL) || (record->textLen >= sizeof(text)))
+        {
+            continue;
+        }
+        memcpy(text, record->text, record->textLen);
+        text[record->textLen] = '\0';
+        if ((sscanf(text, "%u.%u.%u.%u", &octets[0], &octets[1], &octets[2], &octets[3]) == 4) &&
+            (octets[0] != 0))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// "yy/MM/dd,hh:mm:ss+zz" of +QLTS / +CCLK, local time and zone in quarter hours;
+// UTC seconds, 0 when the modem has no network time (its RTC starts in 2004)
+static uint32_t modemTime(const atRecord_t *record)
+{
+    char text[32];
+    unsigned int year, month, day, hour, minute, second, quarters;
+    char sign;
+
+    if ((record == NULL) || (record->text == NULL) || (record->textLen >= sizeof(text)))
+    {
+        return 0;
+    }
+    memcpy(text, record->text, record->textLen);
+    text[record->textLen] = '\0';
+    if ((sscanf(text, "%u/%u/%u,%u:%u:%u%c%u", &year, &month, &day, &hour, &minute, &second, &sign, &quarters) != 8) ||
+        (year < 24) || (year > 69) || (month < 1) || (month > 12) || (day < 1) || (day > 31) || (hour > 23) ||
+        (minute > 59) || (second > 59) || ((sign != '+') && (sign != '-')) || (quarters > 56))
+    {
+        return 0;
+    }
+    // days since 1970-01-01 of the civil date, March based year so February is last
+    uint32_t y = 2000 + year - ((month <= 2) ? 1 : 0);
+    uint32_t doy = (153 * ((month > 2) ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t days = (y * 365) + (y / 4) - (y / 100) + (y / 400) + doy - 719468;
+    uint32_t local = (days * 86400UL) + (hour * 3600UL) + (minute * 60UL) + second;
+
+    return (sign == '+') ? local - (quarters * 900UL) : local + (quarters * 900UL);
+}
+
+// network time of the last registration, else the modem RTC if it was set from the network
+static void syncClock()
+{
+    uint32_t epoch;
+
+    if (clockSynced)
+    {
+        return;
+    }
+    epoch = modemTime(sessionProbe("AT+QLTS\r\n", AT_REC_QLTS));
+    if (epoch == 0)
+    {
+        epoch = modemTime(sessionProbe("AT+CCLK?\r\n", AT_REC_CCLK));
+    }
+    if (epoch == 0)
+    {
+        Serial.println("No network time yet, readings keep the uptime stamps");
+        return; // tried again next round
+    }
+    tsdbSetClock(epoch);
+    clockSynced = true;
+}
+
+// **************************************************************************************
+//
+//      After a deep sleep wakeup, verify the RTC snapshot of the modem session with
+//      cheap probes and jump straight to the furthest stage that is still valid
+//
+// **************************************************************************************
+static void sessionResume()
+{
+    unsigned long startTime = millis();
+    bool alive = false;
+    uint8_t flags = gsmSession.flags;
+
+    gsmStateRun = checkGsmResponse;
+    if ((esp_reset_reason() != ESP_RST_DEEPSLEEP) || (gsmSession.magic != SESSION_MAGIC))
+    {
+        sessionClear();
+        return; // cold boot, do the full bring-up
+    }
+
+    for (uint8_t i = 0; (i < 3) && (alive == false); i++)
+    {
+        esp_task_wdt_reset();
+        alive = (sessionProbe("AT\r\n", AT_REC_OK) != NULL);
+    }
+    if ((alive == true) && ((flags & SESSION_REGISTERED) != 0))
+    {
+        int32_t stat = atArg(sessionProbe("AT+CREG?\r\n", AT_REC_CREG), 1, -1);
+        linkSampleCREG(stat);
+        alive = (stat == 1) || (stat == 5);
+    }
+    else
+    {
+        alive = false;
+    }
+    if (alive == false)
+    {
+        Serial.println("Session snapshot stale, full bring-up");
+        sessionClear();
+        return;
+    }
+
+    // registration is still valid, probe the deeper layers
+    gsmSession.flags = SESSION_REGISTERED;
+    gsmStateRun = storeCertAndConfigSSL;
+    // a modem that reset or browned out registers again on its own but has lost the RAM
+    // certificates; they are written together, so the last one stands for all three
+    if (((flags & SESSION_SSL_LOADED) != 0) &&
+        (atArg(sessionProbe("AT+QSECREAD=\"RAM:user_key.pem\"\r\n", AT_REC_QSECREAD), 0, 0) == 1))
+    {
+        gsmSession.flags |= SESSION_SSL_LOADED;
+        gsmStateRun = openGPRS;
+        if (((flags & SESSION_PDP_ACTIVE) != 0) && localIpProbe())
+        {
+            gsmSession.flags |= SESSION_PDP_ACTIVE;
+            gsmStateRun = openMqttConn;
+            if (((flags & SESSION_MQTT_OPEN) != 0) && (atArg(sessionProbe("AT+QMTCONN?\r\n", AT_REC_QMTCONN), 1, 0) == 3))
+            {
+                gsmSession.flags |= SESSION_MQTT_OPEN;
+                mqttAlreadyOpen = true;
+                gsmStateRun = publishDataOnMqtt;
+            }
+        }
+    }
+    printf("Session resumed to state %d in %lu ms\n", gsmStateRun, millis() - startTime);
+}
+
+// config store listener, runs in the web server task: only record what changed
+static void configChanged(uint8_t changed)
+{
+    portENTER_CRITICAL(&configMux);
+    configPending |= changed;
+    portEXIT_CRITICAL(&configMux);
+}
+
+// **************************************************************************************
+//
+//      Redo only the stage a configuration change affects: a new APN needs a fresh PDP
+//      context, new MQTT settings only a broker reconnect. Stages not reached yet pick
+//      the new values up on their own.
+//
+// **************************************************************************************
+static void applyConfigChanges()
+{
+    uint8_t changed;
+    appConfig_t config;
+
+    portENTER_CRITICAL(&configMux);
+    changed = configPending;
+    configPending = 0;
+    portEXIT_CRITICAL(&configMux);
+
+    if ((changed & CONFIG_CHANGED_LINK) != 0)
+    {
+        configGet(&config);
+        linkSetMaxDeferral(config.maxDeferMin * 60UL * 1000UL);
+    }
+    if ((changed == 0) || (gsmStateRun == errorState))
+    {
+        return;
+    }
+    if (((changed & CONFIG_CHANGED_APN) != 0) && (gsmStateRun > openGPRS))
+    {
+        Serial.println("APN changed, re-activating PDP context");
+        GSM.print(F("AT+QIDEACT\r\n")); // also drops the MQTT connection
+        readGSMResponse();
+        sessionDrop(SESSION_PDP_ACTIVE | SESSION_MQTT_OPEN);
+        mqttAlreadyOpen = false;
+        gsmStateRun = openGPRS;
+    }
+    else if (((changed & CONFIG_CHANGED_MQTT) != 0) && (gsmStateRun == publishDataOnMqtt))
+    {
+        Serial.println("MQTT settings changed, reconnecting to broker");
+        GSM.print(F("AT+QMTDISC=0\r\n"));
+        (void)waitForResponse(AT_REC_QMTDISC, 5000);
+        GSM.print(F("AT+QMTCLOSE=0\r\n")); // may answer ERROR when DISC closed it already
+        readGSMResponse();
+        sessionDrop(SESSION_MQTT_OPEN);
+        mqttAlreadyOpen = false;
+        gsmStateRun = openMqttConn;
+    }
+}
+
 // **************************************************************************************
 //
 //           This function put ESP32 and Quecetel M95 GSm module into sleep
@@ -799,10 +1212,12 @@ static void restartGSM()
 
 static void enterDeepSleep()
 {
-    digitalWrite(32, LOW); // put GSm to Sleep
+    (void)gsmPowerSleep(); // put GSm to Sleep
+    gsmPowerReport();
     vTaskDelay(pdMS_TO_TICKS(1000));
     Serial.println("Entering sleep Mode");
     Serial.flush();
+    gsmPowerHold();         // DTR would float in deep sleep and wake the module
     esp_deep_sleep_start(); // put ESP32 to Sleep
 }
 
@@ -812,10 +1227,25 @@ static void enterDeepSleep()
 //                      GSM STATE MACHINE
 //
 // **************************************************************************************
+void gsmBegin()
+{
+    appConfig_t config;
+
+    configGet(&config);
+    linkSetMaxDeferral(config.maxDeferMin * 60UL * 1000UL);
+    (void)configSubscribe(configChanged);
+}
+
 void gsmStateMachine()
 {
+    gsmPowerWake(); // every step talks to the modem
+    applyConfigChanges();
     switch (gsmStateRun)
     {
+    case resumeSession:
+        sessionResume();
+        break;
+
     case checkGsmResponse:
         checkResponse();
         break;
@@ -845,31 +1275,34 @@ void gsmStateMachine()
         break;
 
     case errorState:
-        if (errorretry < 5)
+        linkCleared = false;
+        switch (retryEscalate())
         {
+        case RETRY_REATTACH:
+            Serial.println("Escalation: re-attach PDP context");
+            GSM.print(F("AT+QIDEACT\r\n"));
+            readGSMResponse();
+            sessionDrop(SESSION_PDP_ACTIVE | SESSION_MQTT_OPEN);
+            mqttAlreadyOpen = false;
+            gsmStateRun = openGPRS;
+            break;
+
+        case RETRY_RESET_MODEM:
+            Serial.println("Escalation: modem reset");
             restartGSM();
             gsmStateRun = checkGsmResponse;
-            takeSensorReadings = false;
+            break;
+
+        case RETRY_SLEEP:
+        default:
+            Serial.println("Escalation: sleep and retry later");
+            gsmError = true;
+            retryPrintStats();
+            retryCycleReset();
+            dutyPrepareSleep(RETRY_SLEEP_US);
+            enterDeepSleep();
+            break;
         }
-        // else
-        // {
-        //     gsmError = true;
-        //     takeSensorReadings = false;
-        //     vTaskDelay(pdMS_TO_TICKS(100));
-        //     // Serial.println("Error state");
-        //     // If the error state just started, record the start time
-        //     if (errorStateStartTime == 0)
-        //     {
-        //         errorStateStartTime = millis();
-        //     }
-        //     // Check if 5 minutes have passed
-        //     if (millis() - errorStateStartTime >= errorStateDuration)
-        //     {
-        //         vTaskDelay(pdMS_TO_TICKS(100));
-        //         enterDeepSleep();
-        //     }
-        // }
-        errorretry++;
         break;
 
     default:
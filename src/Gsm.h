@@ -7,7 +7,7 @@
 #define GSM_STATES_H
 
 #include <Arduino.h>
-#include <SoftwareSerial.h>
+#include <HardwareSerial.h>
 
 // **************************************************************************************
 //
@@ -15,9 +15,8 @@
 //
 //
 // **************************************************************************************
-extern SoftwareSerial GSM;
+extern HardwareSerial GSM;
 extern bool gsmError;
-extern bool takeSensorReadings;
 const byte MAX_RX_CAHRS = 254;
 // **************************************************************************************
 //
@@ -25,6 +24,7 @@ const byte MAX_RX_CAHRS = 254;
 //
 //
 // **************************************************************************************
+void gsmBegin();
 void gsmStateMachine();
 
 #endif // GSM_STATES_H
\ No newline at end of file
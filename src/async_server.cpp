@@ -1,11 +1,23 @@
 #include <Arduino.h>
 #include <WiFi.h>
-#include <ESPmDNS.h>
 #include <AsyncTCP.h>
 #include <ESPAsyncWebServer.h>
-#include <SPIFFS.h>
 #include <Update.h>
+#include <stdarg.h>
 #include "async_server.h"
+#include "config_store.h"
+#include "duty_cycle.h"
+#include "diag.h"
+#include "server_guard.h"
+#include "route_table.h"
+#include "storage.h"
+#include "delta_ota.h"
+#include "ota_owner.h"
+#include "fs_archive.h"
+#include "wifi_link.h"
+#include "boot.h"
+#include "gsm_ota.h"
+#include "tsdb.h"
 
 // Credits : this is a mashup of code from the following repositories, plus OTA firmware update feature
 // https://github.com/smford/esp32-asyncwebserver-fileupload-example
@@ -35,123 +47,101 @@ const String default_httppassword = "admin";
 const int default_webserverporthttp = 80;
 
 static WIFI_CONFIG config;    
-static File SpiffsFile;
 
 String Read_rootca;
 String Client_cert;
 String Client_privatekey;
 
-static String server_directory(bool ishtml = false);
+static bool server_read_file(const char *path, String &out);
+static void server_print_directory();
+static size_t server_directory_chunk(uint8_t *buffer, size_t maxLen, size_t index);
+static size_t server_diag_chunk(uint8_t *buffer, size_t maxLen, size_t index);
 static void server_not_found(AsyncWebServerRequest *request);
 static bool server_authenticate(AsyncWebServerRequest * request);
-static void server_handle_upload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final);
-static void server_handle_SPIFFS_upload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final);
+static void server_handle_upload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final);
+static void server_handle_SPIFFS_upload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final);
 static String server_string_processor(const String& var);
 static void server_configure();
+static size_t server_format_size(char *out, size_t size, const size_t bytes);
 static String server_ui_size(const size_t bytes);
-static void server_handle_OTA_update(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final);
-static int spiffs_chunked_read(uint8_t* buffer, int maxLen);
-
-
-void server_init() {
-  //=======================================
-  //Root CA File Reading.
-  File file2 = SPIFFS.open("/CACert.crt", "r");
-  if (!file2) {
-    Serial.println("Failed to open file for reading");
-    return;
-  }
-  Serial.println("Root CA File Content:");
-  while (file2.available()) {
-    Read_rootca = file2.readString();
-    Serial.println(Read_rootca);
-  }
-  //=============================================
-  // Cert file reading
-  File file4 = SPIFFS.open("/ClientCert.crt", "r");
-  if (!file4) {
-    Serial.println("Failed to open file for reading");
-    return;
-  }
-  Serial.println("Cert File Content:");
-  while (file4.available()) {
-    Client_cert = file4.readString();
-    Serial.println(Client_cert);
-  }
-  //=================================================
-  //Privatekey file reading
-  File file6 = SPIFFS.open("/ClientPrivate.key", "r");
-  if (!file6) {
-    Serial.println("Failed to open file for reading");
-    return;
-  }
-  Serial.println("privateKey File Content:");
-  while (file6.available()) {
-    Client_privatekey = file6.readString();
-    Serial.println(Client_privatekey);
-  }
-  //=====================================================
-
-  Serial.print("SPIFFS Free: "); Serial.println(server_ui_size((SPIFFS.totalBytes() - SPIFFS.usedBytes())));
-  Serial.print("SPIFFS Used: "); Serial.println(server_ui_size(SPIFFS.usedBytes()));
-  Serial.print("SPIFFS Total: "); Serial.println(server_ui_size(SPIFFS.totalBytes()));
-
-  Serial.println(server_directory(false));
-  Serial.println("Loading Configuration ...");
-  config.httpuser = default_httpuser;
-  config.httppassword = default_httppassword;
-  config.webserverporthttp = default_webserverporthttp;
+static void server_handle_OTA_update(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final);
+static void server_handle_delta_upload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final);
+static void server_index(AsyncWebServerRequest *request);
+static void server_upload_done(AsyncWebServerRequest *request);
+static void server_save_mqtt_settings(AsyncWebServerRequest *request);
+static void server_logout(AsyncWebServerRequest *request);
+static void server_logged_out(AsyncWebServerRequest *request);
+static void server_style(AsyncWebServerRequest *request);
+static void server_reboot(AsyncWebServerRequest *request);
+static void server_diag(AsyncWebServerRequest *request);
+static void server_directory(AsyncWebServerRequest *request);
+static void server_file(AsyncWebServerRequest *request);
+static void server_backup(AsyncWebServerRequest *request);
+static void server_data(AsyncWebServerRequest *request);
+static void server_restore_done(AsyncWebServerRequest *request);
+static void server_handle_restore_upload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final);
+static void server_restore_release();
+static void server_upload_refuse(AsyncWebServerRequest *request, int code, const char *reason);
+static void server_upload_refused_release();
+static void server_ota_release();
+static int spiffs_chunked_read(File &file, uint8_t* buffer, int maxLen);
+
+// the guard admits one listing class request (/directory, /diag, /data) at a time, so their
+// state can live here instead of on the heap
+static File dirRoot;
+static char dirRow[384];
+static size_t dirRowLen = 0;
+static size_t dirRowSent = 0;
+static uint8_t dirStage = 0;
+static char diagBody[DIAG_REPORT_MAX]; // one /diag section at a time
+static size_t diagBodyLen = 0;
+static size_t diagBodySent = 0;
+static uint8_t diagSection = 0;
+
+// /diag sections in the order they are sent, each one is a chunk of its own
+typedef size_t (*diagSection_t)(char *out, size_t size);
+static const diagSection_t diagSections[] = {diagReport, guardReport, storageReport, deltaReport, wifiLinkReport,
+                                             gsmOtaReport, bootReport, tsdbReport, routeReport};
+
+// the upload that owns the single restore, its later chunks and result belong to it only
+static AsyncWebServerRequest *restoreRequest = NULL;
+static bool restoreOk = false;
+
+// the upload that flashes the web OTA, and the last upload turned away with its answer
+static AsyncWebServerRequest *otaRequest = NULL;
+static AsyncWebServerRequest *refusedRequest = NULL;
+static int refusedCode = 0;
+static const char *refusedReason = NULL;
+
+// TLS material for the modem, only the sizes go to the console
+bool server_load_certs() {
+  bool ok = server_read_file("/CACert.crt", Read_rootca);
+  ok = server_read_file("/ClientCert.crt", Client_cert) && ok;
+  ok = server_read_file("/ClientPrivate.key", Client_privatekey) && ok;
+  return ok;
+}
 
+// returns at once, in station mode the link comes up in the background
+void server_wifi_begin() {
 #ifdef STATION_WEBSERVER
   // connect to existing WiFi access point as a station
   config.ssid = default_ssid;
   config.wifipassword = default_wifipassword;
 
   Serial.print("\r\nConnecting to existing Wifi Access Point : ");
-  WiFi.begin(config.ssid.c_str(), config.wifipassword.c_str());
-  WiFi.setTxPower(WIFI_POWER_MINUS_1dBm);
-
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    Serial.print(".");
-  }
-  Serial.println("\r\n\r\nNetwork Configuration:");
-  Serial.println("----------------------");
-  Serial.print("         SSID: "); Serial.println(WiFi.SSID());
-  Serial.print("  Wifi Status: "); Serial.println(WiFi.status());
-  Serial.print("Wifi Strength: "); Serial.print(WiFi.RSSI()); Serial.println(" dBm");
-  Serial.print("          MAC: "); Serial.println(WiFi.macAddress());
-  Serial.print("           IP: "); Serial.println(WiFi.localIP());
-  Serial.print("       Subnet: "); Serial.println(WiFi.subnetMask());
-  Serial.print("      Gateway: "); Serial.println(WiFi.gatewayIP());
-  Serial.print("        DNS 1: "); Serial.println(WiFi.dnsIP(0));
-  Serial.print("        DNS 2: "); Serial.println(WiFi.dnsIP(1));
-  Serial.print("        DNS 3: "); Serial.println(WiFi.dnsIP(2));
-  Serial.println();
-  if (!MDNS.begin(host)) { //Use http://esp32.local for web server page
-    Serial.println("Error setting up MDNS responder!");
-    while (1) {
-      delay(1000);
-      }
-    }
-  Serial.println("mDNS responder started");
+  Serial.println(config.ssid);
+  wifiLinkStartStation(config.ssid.c_str(), config.wifipassword.c_str(), "Esp32_Access_Point", host);
 #else // set up as stand-alone WiFi Access Point
-  WiFi.mode(WIFI_AP);
-  WiFi.setTxPower(WIFI_POWER_MINUS_1dBm);
-  bool result =  WiFi.softAP("Esp32_Access_Point", ""); // "" => no password
-  Serial.println(result == true ? "AP setup OK" : "AP setup failed");
-  IPAddress myIP = WiFi.softAPIP();  
-  Serial.print("Access Point IP address: ");
-  Serial.println(myIP);
-  
-  if (!MDNS.begin(host)) { //Use http://esp32.local for web server page
-    Serial.println("Error setting up MDNS responder!");
-    while (1) {
-      delay(1000);
-      }
-    }
-  Serial.println("mDNS responder started");
+  wifiLinkStartAP("Esp32_Access_Point", host);
 #endif
+}
+
+// needs the data partition and the network stack (server_wifi_begin)
+void server_init() {
+  Serial.println("Loading Configuration ...");
+  config.httpuser = default_httpuser;
+  config.httppassword = default_httppassword;
+  config.webserverporthttp = default_webserverporthttp;
 
   Serial.println("Configuring Webserver ...");
   server = new AsyncWebServer(config.webserverporthttp);
@@ -159,42 +149,140 @@ void server_init() {
 
   Serial.println("Starting Webserver ...");
   server->begin();
+
+  // console only, after the server is already answering
+  Serial.printf("%s Free: ", storageName()); Serial.println(server_ui_size((storageTotalBytes() - storageUsedBytes())));
+  Serial.printf("%s Used: ", storageName()); Serial.println(server_ui_size(storageUsedBytes()));
+  Serial.printf("%s Total: ", storageName()); Serial.println(server_ui_size(storageTotalBytes()));
+  server_print_directory();
+}
+
+static bool server_read_file(const char *path, String &out) {
+  File file = storageOpen(path, "r");
+  if (!file) {
+    Serial.printf("Failed to open %s for reading\n", path);
+    return false;
+    }
+  out = file.readString();
+  file.close();
+  Serial.printf("%s: %u bytes\n", path, (unsigned)out.length());
+  return true;
 }
 
-// list all of the files, if ishtml=true, return html rather than simple text
-static String server_directory(bool ishtml) {
-  String returnText = "";
-  Serial.println("Listing files stored on SPIFFS");
-  File root = SPIFFS.open("/");
+// list all of the files on the console
+static void server_print_directory() {
+  char size[16];
+  File root = storageOpen("/", "r");
   File foundfile = root.openNextFile();
-  if (ishtml) {
-    returnText += "<table align='center'><tr><th align='left'>Name</th><th align='left'>Size</th><th></th><th></th></tr>";
-  }
+
+  Serial.printf("Listing files stored on %s\n", storageName());
   while (foundfile) {
-    if (ishtml) {
-      returnText += "<tr align='left'><td>" + String(foundfile.name()) + "</td><td>" + server_ui_size(foundfile.size()) + "</td>";
-      returnText += "<td><button class='directory_buttons' onclick=\"directory_button_handler(\'"+ String("/") + String(foundfile.name()) + "\', \'download\')\">Download</button>";
-      returnText += "<td><button class='directory_buttons' onclick=\"directory_button_handler(\'"+ String("/")  + String(foundfile.name()) + "\', \'delete\')\">Delete</button></tr>";
+    server_format_size(size, sizeof(size), foundfile.size());
+    Serial.printf("File: %s Size: %s\n", foundfile.name(), size);
+    foundfile = root.openNextFile();
+  }
+  root.close();
+}
+
+// chunked filler for /directory, emits the html table one row at a time so the listing
+// never has to be held in memory as a whole
+static size_t server_directory_chunk(uint8_t *buffer, size_t maxLen, size_t index) {
+  size_t written = 0;
+
+  if (index == 0) {
+    dirRoot.close(); // a listing cut short by its client leaves the handle open
+    dirRoot = storageOpen("/", "r");
+    dirRowLen = 0;
+    dirRowSent = 0;
+    dirStage = 0;
+  }
+  while (written < maxLen) {
+    if (dirRowSent < dirRowLen) {
+      size_t part = min(dirRowLen - dirRowSent, maxLen - written);
+      memcpy(buffer + written, dirRow + dirRowSent, part);
+      dirRowSent += part;
+      written += part;
+      continue;
+    }
+    dirRowSent = 0;
+    dirRowLen = 0;
+    if (dirStage == 0) {
+      dirRowLen = snprintf(dirRow, sizeof(dirRow), "<table align='center'><tr><th align='left'>Name</th><th align='left'>Size</th><th></th><th></th></tr>");
+      dirStage = 1;
+    } else if (dirStage == 1) {
+      File foundfile = dirRoot.openNextFile();
+      if (foundfile) {
+        char size[16];
+        server_format_size(size, sizeof(size), foundfile.size());
+        dirRowLen = snprintf(dirRow, sizeof(dirRow),
+          "<tr align='left'><td>%s</td><td>%s</td>"
+          "<td><button class='directory_buttons' onclick=\"directory_button_handler('/%s', 'download')\">Download</button>"
+          "<td><button class='directory_buttons' onclick=\"directory_button_handler('/%s', 'delete')\">Delete</button></tr>",
+          foundfile.name(), size, foundfile.name(), foundfile.name());
+        dirRowLen = min(dirRowLen, sizeof(dirRow) - 1);
+      } else {
+        dirStage = 2;
+      }
+    } else if (dirStage == 2) {
+      dirRowLen = snprintf(dirRow, sizeof(dirRow), "</table>");
+      dirStage = 3;
     } else {
-      returnText += "File: " + String(foundfile.name()) + " Size: " + server_ui_size(foundfile.size()) + "\n";
+      dirRoot.close();
+      break;
     }
-    foundfile = root.openNextFile();
   }
-  if (ishtml) {
-    returnText += "</table>";
+  return written;
+}
+
+// chunked filler for /diag: every report is rendered on its own into diagBody and sent
+// before the next one, so the page is not limited to one buffer; a section that does not
+// fit is cut and marked
+static size_t server_diag_chunk(uint8_t *buffer, size_t maxLen, size_t index) {
+  static const char truncated[] = "... section truncated\n";
+  size_t written = 0;
+
+  if (index == 0) {
+    diagBodyLen = 0;
+    diagBodySent = 0;
+    diagSection = 0;
   }
-  root.close();
-  foundfile.close();
-  return returnText;
+  while (written < maxLen) {
+    if (diagBodySent < diagBodyLen) {
+      size_t part = min(diagBodyLen - diagBodySent, maxLen - written);
+      memcpy(buffer + written, diagBody + diagBodySent, part);
+      diagBodySent += part;
+      written += part;
+      continue;
+    }
+    if (diagSection >= sizeof(diagSections) / sizeof(diagSections[0])) {
+      break;
+    }
+    diagBodySent = 0;
+    diagBodyLen = diagSections[diagSection++](diagBody, sizeof(diagBody));
+    if (diagBodyLen >= sizeof(diagBody) - 1) {
+      memcpy(diagBody + sizeof(diagBody) - sizeof(truncated), truncated, sizeof(truncated));
+      diagBodyLen = sizeof(diagBody) - 1;
+    }
+  }
+  return written;
 }
 
 // Make size of files human readable
 // source: https://github.com/CelliesProjects/minimalUploadAuthESP32
+static size_t server_format_size(char *out, size_t size, const size_t bytes) {
+  int len;
+  if (bytes < 1024) len = snprintf(out, size, "%u B", (unsigned)bytes);
+  else if (bytes < (1024 * 1024)) len = snprintf(out, size, "%.2f KB", bytes / 1024.0);
+  else if (bytes < (1024 * 1024 * 1024)) len = snprintf(out, size, "%.2f MB", bytes / 1024.0 / 1024.0);
+  else len = snprintf(out, size, "%.2f GB", bytes / 1024.0 / 1024.0 / 1024.0);
+  return (len > 0) ? min((size_t)len, size - 1) : 0;
+  }
+
+// template processor flavour, the library wants a String back
 static String server_ui_size(const size_t bytes) {
-  if (bytes < 1024) return String(bytes) + " B";
-  else if (bytes < (1024 * 1024)) return String(bytes / 1024.0) + " KB";
-  else if (bytes < (1024 * 1024 * 1024)) return String(bytes / 1024.0 / 1024.0) + " MB";
-  else return String(bytes / 1024.0 / 1024.0 / 1024.0) + " GB";
+  char text[16];
+  server_format_size(text, sizeof(text), bytes);
+  return String(text);
   }
 
 
@@ -204,193 +292,287 @@ static String server_string_processor(const String& var) {
         return String(__DATE__) + " " + String(__TIME__); 
         }
     else
+    if (var == "FSNAME") {
+        return String(storageName());
+        }
+    else
     if (var == "FREESPIFFS") {
-        return server_ui_size((SPIFFS.totalBytes() - SPIFFS.usedBytes()));
+        return server_ui_size((storageTotalBytes() - storageUsedBytes()));
         }
     else
     if (var == "USEDSPIFFS") {
-        return server_ui_size(SPIFFS.usedBytes());
+        return server_ui_size(storageUsedBytes());
         }
     else
     if (var == "TOTALSPIFFS") {
-        return server_ui_size(SPIFFS.totalBytes());
+        return server_ui_size(storageTotalBytes());
         }
     else
-    if (var == "CLIENTID") {
-    return "TALHA";//readEEPROM(CLIENT_ID_ADDR, 50);  // Replace with the actual stored Client ID
-      } 
-    else 
-    if (var == "TOPIC") {
-    return "AHMED";//readEEPROM(TOPIC_ADDR, 50);      // Replace with the actual stored Topic
-      } 
-    else 
-    if (var == "SIMAPN") {
-    return "HELLO FROM ESP";//readEEPROM(SIM_APN_ADDR, 50);    // Replace with the actual stored SIM APN
+    if (var == "CLIENTID" || var == "TOPIC" || var == "SIMAPN" || var == "MAXDEFER") {
+        appConfig_t appConfig;
+        configGet(&appConfig);
+        if (var == "CLIENTID") {
+            return String(appConfig.clientId);
+            }
+        else
+        if (var == "TOPIC") {
+            return String(appConfig.topic);
+            }
+        else
+        if (var == "MAXDEFER") {
+            return String(appConfig.maxDeferMin);
+            }
+        return String(appConfig.apn); // empty => APN picked from the operator table
       }
     // return "?";
     return String();  // Return an empty string for unknown placeholders
     }
 
 
-static int spiffs_chunked_read(uint8_t* buffer, int maxLen) {              
+// file is the download's own handle (request->_tempFile), downloads can run side by side
+static int spiffs_chunked_read(File &file, uint8_t* buffer, int maxLen) {              
   //Serial.printf("MaxLen = %d\n", maxLen);
-  if (!SpiffsFile.available()) {
-    SpiffsFile.close();
+  if (!file.available()) {
+    file.close();
     return 0;
     }
   else {
-    int count = 0;
-    while (SpiffsFile.available() && (count < maxLen)) {
-      buffer[count] = SpiffsFile.read();
-      count++;
-      }
-    return count;
+    return file.read(buffer, maxLen);
     }
 }
 
+// every route the web admin serves; auth, logging, admission class and metrics are applied
+// by the dispatcher (route_table.cpp) and the guard (server_guard.cpp) from this table
+static constexpr route_t server_routes[] = {
+  //     path                   method     auth          class                 handler                    upload
+  ROUTE("/",                    HTTP_GET,  ROUTE_AUTH,   GUARD_CLASS_STATIC,   server_index,              NULL),
+  ROUTE("/",                    HTTP_POST, ROUTE_AUTH,   GUARD_CLASS_UPLOAD,   server_upload_done,        server_handle_upload),
+  ROUTE("/style.css",           HTTP_GET,  ROUTE_PUBLIC, GUARD_CLASS_STATIC,   server_style,              NULL),
+  ROUTE("/logout",              HTTP_GET,  ROUTE_PUBLIC, GUARD_CLASS_STATIC,   server_logout,             NULL),
+  ROUTE("/logged-out",          HTTP_GET,  ROUTE_PUBLIC, GUARD_CLASS_STATIC,   server_logged_out,         NULL),
+  ROUTE("/reboot",              HTTP_GET,  ROUTE_AUTH,   GUARD_CLASS_STATIC,   server_reboot,             NULL),
+  ROUTE("/save-mqtt-settings",  HTTP_POST, ROUTE_AUTH,   GUARD_CLASS_FILE_IO,  server_save_mqtt_settings, NULL),
+  ROUTE("/diag",                HTTP_GET,  ROUTE_AUTH,   GUARD_CLASS_LISTING,  server_diag,               NULL),
+  ROUTE("/directory",           HTTP_GET,  ROUTE_AUTH,   GUARD_CLASS_LISTING,  server_directory,          NULL),
+  ROUTE("/file",                HTTP_GET,  ROUTE_AUTH,   GUARD_CLASS_FILE_IO,  server_file,               NULL),
+  ROUTE("/backup",              HTTP_GET,  ROUTE_AUTH,   GUARD_CLASS_LISTING,  server_backup,             NULL),
+  ROUTE("/data",                HTTP_GET,  ROUTE_AUTH,   GUARD_CLASS_LISTING,  server_data,               NULL),
+  ROUTE("/restore",             HTTP_POST, ROUTE_AUTH,   GUARD_CLASS_UPLOAD,   server_restore_done,       server_handle_restore_upload),
+};
+
 void server_configure() {
+  // connection cap and accounting, ahead of every route
+  guardBegin(server);
+
+  if (!routeBegin(server, server_routes, sizeof(server_routes) / sizeof(server_routes[0]), server_authenticate)) {
+    Serial.println("Route table larger than ROUTE_MAX, some routes are not served");
+    }
+
   // if url isn't found
   server->onNotFound(server_not_found);
+}
+
+static void server_index(AsyncWebServerRequest *request) {
+  request->send(storageFS(), "/index.html", String(), false, server_string_processor);
+}
 
-  // run handleUpload function when any file is uploaded
-  server->onFileUpload(server_handle_upload);
+// the body has been streamed through server_handle_upload by now
+static void server_upload_done(AsyncWebServerRequest *request) {
+  if (request == refusedRequest) {
+    refusedRequest = NULL;
+    request->send_P(refusedCode, "text/plain", refusedReason);
+    return;
+    }
+  request->redirect("/");
+}
 
-   // route to handle the user inputs for MQTT settings
-  server->on("/save-mqtt-settings", HTTP_POST, [](AsyncWebServerRequest *request) {
-    String clientID, topic, simAPN;
+// the rest of the body is ignored and server_upload_done answers with the reason
+static void server_upload_refuse(AsyncWebServerRequest *request, int code, const char *reason) {
+  routeLog(request, "Upload refused: %s", reason);
+  refusedRequest = request;
+  refusedCode = code;
+  refusedReason = reason;
+  guardOnRelease(request, server_upload_refused_release);
+}
 
-    // Check if all the required parameters are present
-    if (request->hasParam("clientID", true) && request->hasParam("topic", true) && request->hasParam("simAPN", true)) {
-      clientID = request->getParam("clientID", true)->value();
-      topic = request->getParam("topic", true)->value();
-      simAPN = request->getParam("simAPN", true)->value();
+static void server_upload_refused_release() {
+  refusedRequest = NULL;
+}
 
-      // Debug prints to check the received values
-      Serial.println("Received MQTT Client ID: " + clientID);
-      Serial.println("Received MQTT Topic: " + topic);
-      Serial.println("Received SIM APN: " + simAPN);
+// copies a POST field into a fixed config field, false when it would not fit whole
+static bool server_copy_param(AsyncWebServerRequest *request, const char *name, char *dest, size_t size) {
+  const String &value = request->getParam(name, true)->value();
+  if (value.length() >= size) {
+    Serial.printf("%s is %u characters, at most %u fit\n", name, value.length(), (unsigned)(size - 1));
+    return false;
+    }
+  memcpy(dest, value.c_str(), value.length() + 1);
+  return true;
+}
 
-      // You can now save or process these variables
-      // For example, you can store them in SPIFFS, EEPROM, or use them directly
+// route to handle the user inputs for MQTT settings
+static void server_save_mqtt_settings(AsyncWebServerRequest *request) {
+  // Check if all the required parameters are present
+  if (request->hasParam("clientID", true) && request->hasParam("topic", true) && request->hasParam("simAPN", true)) {
+    appConfig_t appConfig;
+    configGet(&appConfig);
+    // a truncated client ID or topic would still be accepted by the broker, refuse it instead
+    if (!server_copy_param(request, "clientID", appConfig.clientId, sizeof(appConfig.clientId)) ||
+        !server_copy_param(request, "topic", appConfig.topic, sizeof(appConfig.topic)) ||
+        !server_copy_param(request, "simAPN", appConfig.apn, sizeof(appConfig.apn))) {
+      request->send_P(400, "text/plain", "MQTT setting too long");
+      return;
+      }
+    if (request->hasParam("maxDefer", true)) {
+      // minutes; 0 or garbage is refused by configSet
+      appConfig.maxDeferMin = (uint16_t)min(strtoul(request->getParam("maxDefer", true)->value().c_str(), NULL, 10),
+                                            (unsigned long)CONFIG_MAX_DEFER_MIN_LIMIT + 1);
+      }
 
-      // Respond with a success message
-      request->send(200, "text/plain", "MQTT Settings Saved Successfully");
-    } else {
-      // Respond with an error if any parameter is missing
-      request->send(400, "text/plain", "Missing parameters");
+    // Debug prints to check the received values
+    Serial.printf("Received MQTT Client ID: %s\n", appConfig.clientId);
+    Serial.printf("Received MQTT Topic: %s\n", appConfig.topic);
+    Serial.printf("Received SIM APN: %s\n", appConfig.apn);
+    Serial.printf("Received max deferral: %u min\n", appConfig.maxDeferMin);
+
+    // saved to NVS and applied by the GSM state machine without a reboot
+    if (configSet(&appConfig)) {
+      request->send_P(200, "text/plain", "MQTT Settings Saved Successfully");
+      }
+    else {
+      request->send_P(400, "text/plain", "Invalid MQTT settings");
+      }
+  } else {
+    // Respond with an error if any parameter is missing
+    request->send_P(400, "text/plain", "Missing parameters");
+  }
+}
+
+// visiting this page will cause you to be logged out
+static void server_logout(AsyncWebServerRequest *request) {
+  request->requestAuthentication();
+  request->send(401);
+}
+
+// presents a "you are now logged out webpage
+static void server_logged_out(AsyncWebServerRequest *request) {
+  request->send(storageFS(), "/logout.html", String(), false, server_string_processor);
+}
+
+// style sheet, cached so page loads after the first skip a connection
+static void server_style(AsyncWebServerRequest *request) {
+  AsyncWebServerResponse *response = request->beginResponse(storageFS(), "/style.css", "text/css");
+  response->addHeader("Cache-Control", "max-age=86400");
+  request->send(response);
+}
+
+static void server_reboot(AsyncWebServerRequest *request) {
+  request->send(storageFS(), "/reboot.html", String(), false, server_string_processor);
+  IsRebootRequired = true;
+}
+
+static void server_diag(AsyncWebServerRequest *request) {
+  request->send(request->beginChunkedResponse("text/plain", server_diag_chunk));
+}
+
+static void server_directory(AsyncWebServerRequest *request) {
+  dutyBoostBegin();
+  guardOnRelease(request, dutyBoostEnd);
+  request->send(request->beginChunkedResponse("text/plain", server_directory_chunk));
+}
+
+// the whole data partition as a tar archive, streamed file by file
+static void server_backup(AsyncWebServerRequest *request) {
+  dutyBoostBegin();
+  guardOnRelease(request, dutyBoostEnd);
+  storageStreamBegin();
+  guardOnRelease(request, storageStreamEnd);
+  archiveBackupBegin();
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/x-tar", [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    return archiveBackupRead(buffer, maxLen);
+    });
+  response->addHeader("Content-Disposition", arenaPrintf(guardArena(request), "attachment; filename=%s-backup.tar", host));
+  request->send(response);
+}
+
+// stored readings between from and to (seconds of tsdbNow(), both optional) as CSV or
+// with format=json, decoded one history block at a time
+static void server_data(AsyncWebServerRequest *request) {
+  uint32_t from = 0;
+  uint32_t to = UINT32_MAX;
+  tsdbFormat format = TSDB_CSV;
+
+  if (request->hasParam("from")) {
+    from = strtoul(request->getParam("from")->value().c_str(), NULL, 10);
     }
-  });
-
-  // visiting this page will cause you to be logged out
-  server->on("/logout", HTTP_GET, [](AsyncWebServerRequest * request) {
-    request->requestAuthentication();
-    request->send(401);
-  });
-
-  // presents a "you are now logged out webpage
-  server->on("/logged-out", HTTP_GET, [](AsyncWebServerRequest * request) {
-    String logmessage = "Client:" + request->client()->remoteIP().toString() + " " + request->url();
-    Serial.println(logmessage);
-    request->send(SPIFFS, "/logout.html", String(), false, server_string_processor);
-  });
-
-  server->on("/", HTTP_GET, [](AsyncWebServerRequest * request) {
-    String logmessage = "Client:" + request->client()->remoteIP().toString() + + " " + request->url();
-    if (server_authenticate(request)) {
-      logmessage += " Auth: Success";
-      Serial.println(logmessage);
-      request->send(SPIFFS, "/index.html", String(), false, server_string_processor);
-    } else {
-      logmessage += " Auth: Failed";
-      Serial.println(logmessage);
-      return request->requestAuthentication();
+  if (request->hasParam("to")) {
+    to = strtoul(request->getParam("to")->value().c_str(), NULL, 10);
     }
-    
-  });
-
-
-    // Route to load style.css file
-  server->on("/style.css", HTTP_GET, [](AsyncWebServerRequest *request){
-    request->send(SPIFFS, "/style.css", "text/css");
-  });
-
-  server->on("/reboot", HTTP_GET, [](AsyncWebServerRequest * request) {
-    String logmessage = "Client:" + request->client()->remoteIP().toString() + " " + request->url();
-    request->send(SPIFFS, "/reboot.html", String(), false, server_string_processor);
-    logmessage += " Auth: Success";
-    Serial.println(logmessage);
-    IsRebootRequired = true;
-  });
-
-  server->on("/directory", HTTP_GET, [](AsyncWebServerRequest * request)  {
-    String logmessage = "Client:" + request->client()->remoteIP().toString() + " " + request->url();
-    if (server_authenticate(request)) {
-      logmessage += " Auth: Success";
-      Serial.println(logmessage);
-      request->send(200, "text/plain", server_directory(true));
-    } else {
-      logmessage += " Auth: Failed";
-      Serial.println(logmessage);
-      return request->requestAuthentication();
+  if (request->hasParam("format") && (request->getParam("format")->value() == "json")) {
+    format = TSDB_JSON;
     }
-  });
-
-
-  server->on("/file", HTTP_GET, [](AsyncWebServerRequest * request) {
-    String logmessage = "Client:" + request->client()->remoteIP().toString() + " " + request->url();
-    if (server_authenticate(request)) {
-      logmessage += " Auth: Success";
-      Serial.println(logmessage);
-
-      if (request->hasParam("name") && request->hasParam("action")) {
-        const char *fileName = request->getParam("name")->value().c_str();
-        const char *fileAction = request->getParam("action")->value().c_str();
-        Serial.println(fileName);
-        logmessage = "Client:" + request->client()->remoteIP().toString() + " " + request->url() + "? name=" + String(fileName) + " & action=" + String(fileAction);
-
-        if (!SPIFFS.exists(fileName)) {
-          Serial.println(logmessage + " ERROR: file does not exist");
-          request->send(400, "text/plain", "ERROR: file does not exist");
-          } 
-        else {
-          Serial.println(logmessage + " file exists");
-          if (strcmp(fileAction, "download") == 0) {
-            logmessage += " downloaded";
-            SpiffsFile = SPIFFS.open(fileName, "r");
-            int sizeBytes = SpiffsFile.size();
-            Serial.println("large file, chunked download required");
-            AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", sizeBytes, [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
-              return spiffs_chunked_read(buffer, maxLen);
-              });
-            char szBuf[80];
-            sprintf(szBuf, "attachment; filename=%s", &fileName[1]);// get past the leading '/'
-            response->addHeader("Content-Disposition", szBuf);
-            response->addHeader("Connection", "close");
-            request->send(response);
-            } 
-          else 
-          if (strcmp(fileAction, "delete") == 0) {
-            logmessage += " deleted";
-            SPIFFS.remove(fileName);
-            request->send(200, "text/plain", "Deleted File: " + String(fileName));
-            } 
-          else {
-            logmessage += " ERROR: invalid action param supplied";
-            request->send(400, "text/plain", "ERROR: invalid action param supplied");
-            }
-          Serial.println(logmessage);
-          }
+  if (from > to) {
+    request->send_P(400, "text/plain", "ERROR: from is after to");
+    return;
+    }
+  dutyBoostBegin();
+  guardOnRelease(request, dutyBoostEnd);
+  tsdbQueryBegin(from, to, format);
+  request->send(request->beginChunkedResponse((format == TSDB_JSON) ? "application/json" : "text/csv", [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    return tsdbQueryRead(buffer, maxLen);
+    }));
+}
+
+static void server_restore_done(AsyncWebServerRequest *request) {
+  if (request != restoreRequest) {
+    request->send_P(409, "text/plain", "ERROR: a restore is already running");
+    return;
+    }
+  routeLog(request, "%s", archiveRestoreResult());
+  request->send_P(restoreOk ? 200 : 400, "text/plain", archiveRestoreResult());
+}
+
+static void server_file(AsyncWebServerRequest *request) {
+  reqArena_t *arena = guardArena(request);
+
+  if (request->hasParam("name") && request->hasParam("action")) {
+    // copied, the log line and replies below outlive nothing but the request itself
+    const char *fileName = arenaStrdup(arena, request->getParam("name")->value().c_str());
+    const char *fileAction = arenaStrdup(arena, request->getParam("action")->value().c_str());
+
+    if (!storageExists(fileName)) {
+      routeLog(request, "? name=%s & action=%s ERROR: file does not exist", fileName, fileAction);
+      request->send_P(400, "text/plain", "ERROR: file does not exist");
       } 
     else {
-      request->send(400, "text/plain", "ERROR: name and action params required");
+      if (strcmp(fileAction, "download") == 0) {
+        routeLog(request, "? name=%s & action=%s downloaded", fileName, fileAction);
+        storageStreamBegin(); // the file stays open until the last chunk
+        guardOnRelease(request, storageStreamEnd);
+        // closed by the filler at the end, or with the request if the client goes away
+        request->_tempFile = storageOpen(fileName, "r");
+        int sizeBytes = request->_tempFile.size();
+        AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", sizeBytes, [request](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+          return spiffs_chunked_read(request->_tempFile, buffer, maxLen);
+          });
+        response->addHeader("Content-Disposition", arenaPrintf(arena, "attachment; filename=%s", &fileName[1]));// get past the leading '/'
+        request->send(response);
+        } 
+      else 
+      if (strcmp(fileAction, "delete") == 0) {
+        routeLog(request, "? name=%s & action=%s deleted", fileName, fileAction);
+        storageRemove(fileName);
+        request->send_P(200, "text/plain", arenaPrintf(arena, "Deleted File: %s", fileName));
+        } 
+      else {
+        routeLog(request, "? name=%s & action=%s ERROR: invalid action param supplied", fileName, fileAction);
+        request->send_P(400, "text/plain", "ERROR: invalid action param supplied");
+        }
       }
-    } 
+  } 
   else {
-    logmessage += " Auth: Failed";
-    Serial.println(logmessage);
-    return request->requestAuthentication();
+    request->send_P(400, "text/plain", "ERROR: name and action params required");
     }
-  });
 }
 
 #if 0
@@ -412,9 +594,8 @@ void read_file_chunk(uint8_t* buffer, int maxlen) {
 #endif
 
 static void server_not_found(AsyncWebServerRequest *request) {
-  String logmessage = "Client:" + request->client()->remoteIP().toString() + " " + request->url();
-  Serial.println(logmessage);
-  request->send(404, "text/plain", "Not found");
+  routeLog(request, "Not found");
+  request->send_P(404, "text/plain", "Not found");
   }
   
 // used by server.on functions to discern whether a user has the correct httpapitoken OR is authenticated by username and password
@@ -429,87 +610,176 @@ bool server_authenticate(AsyncWebServerRequest * request) {
 }
 
 
-static void server_handle_upload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
+static void server_handle_upload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
     if (filename.endsWith(".bin") ) {
       server_handle_OTA_update(request, filename, index, data, len, final);
       }
+    else
+    if (filename.endsWith(".patch") ) {
+      server_handle_delta_upload(request, filename, index, data, len, final);
+      }
     else {
       server_handle_SPIFFS_upload(request, filename, index, data, len, final);
     }
 }
 
 
-// handles non .bin file uploads to the SPIFFS directory
-static void server_handle_SPIFFS_upload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
-  // make sure authenticated before allowing upload
-  if (server_authenticate(request)) {
-    String logmessage = "Client:" + request->client()->remoteIP().toString() + " " + request->url();
-    Serial.println(logmessage);
-
-    if (!index) {
-      logmessage = "Upload Start: " + String(filename);
-      // open the file on first call and store the file handle in the request object
-      request->_tempFile = SPIFFS.open("/" + filename, "w");
-      Serial.println(logmessage);
-    }
+// handles non .bin file uploads to the data partition, authenticated by the dispatcher
+static void server_handle_SPIFFS_upload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
+  if (!index) {
+    routeLog(request, "Upload Start: %s", filename.c_str());
+    // keep the unit awake until the client goes away, however the upload ends
+    dutyBusyBegin();
+    guardOnRelease(request, dutyBusyEnd);
+    storageStreamBegin();
+    guardOnRelease(request, storageStreamEnd);
+    // open the file on first call and store the file handle in the request object
+    request->_tempFile = storageOpen(arenaPrintf(guardArena(request), "/%s", filename.c_str()), "w");
+  }
 
-    if (len) {
-      // stream the incoming chunk to the opened file
-      request->_tempFile.write(data, len);
-      logmessage = "Writing file: " + String(filename) + " index=" + String(index) + " len=" + String(len);
-      Serial.println(logmessage);
-    }
+  if (len) {
+    // stream the incoming chunk to the opened file
+    storageWrite(request->_tempFile, data, len);
+    routeLog(request, "Writing file: %s index=%u len=%u", filename.c_str(), (unsigned)index, (unsigned)len);
+  }
 
-    if (final) {
-      logmessage = "Upload Complete: " + String(filename) + ",size: " + String(index + len);
-      // close the file handle as the upload is now done
-      request->_tempFile.close();
-      Serial.println(logmessage);
-      request->redirect("/");
-    }
-  } else {
-    Serial.println("Auth: Failed");
-    return request->requestAuthentication();
+  if (final) {
+    // close the file handle as the upload is now done
+    request->_tempFile.close();
+    routeLog(request, "Upload Complete: %s,size: %u", filename.c_str(), (unsigned)(index + len));
   }
 }
 
 
-// handles OTA firmware update
-static void server_handle_OTA_update(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
-  // make sure authenticated before allowing upload
-  if (server_authenticate(request)) {
-    String logmessage = "Client:" + request->client()->remoteIP().toString() + " " + request->url();
-    Serial.println(logmessage);
+// handles OTA firmware update, authenticated by the dispatcher
+static void server_handle_OTA_update(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
+  if (!index) {
+    // the delta task and the cellular download write the same inactive slot
+    if (!otaOwnerAcquire(OTA_OWNER_WEB)) {
+      routeLog(request, "OTA busy: %s", otaOwnerName());
+      server_upload_refuse(request, 409, "ERROR: another firmware update is running");
+      return;
+      }
+    if (!Update.begin(UPDATE_SIZE_UNKNOWN)) { //start with max available size
+      Update.printError(Serial);
+      otaOwnerRelease(OTA_OWNER_WEB);
+      server_upload_refuse(request, 500, "ERROR: cannot start the update");
+      return;
+      }
+    routeLog(request, "OTA Update Start: %s", filename.c_str());
+    otaRequest = request;
+    // flash writes run at full clock, released when the client goes away
+    dutyBusyBegin();
+    dutyBoostBegin();
+    storageStreamBegin(); // no filesystem GC erasing flash between Update.write() calls
+    guardOnRelease(request, dutyBoostEnd);
+    guardOnRelease(request, dutyBusyEnd);
+    guardOnRelease(request, storageStreamEnd);
+    guardOnRelease(request, server_ota_release);
+  }
+
+  if (request != otaRequest) {
+    return;
+    }
 
-    if (!index) {
-      logmessage = "OTA Update Start: " + String(filename);
-      Serial.println(logmessage);
-      if (!Update.begin(UPDATE_SIZE_UNKNOWN)) { //start with max available size
+  if (len) {
+   // flashing firmware to ESP
+   if (Update.write(data, len) != len) {
+      Update.printError(Serial);
+      }      
+    routeLog(request, "Writing file: %s index=%u len=%u", filename.c_str(), (unsigned)index, (unsigned)len);
+  }
+
+  if (final) {
+   if (Update.end(true)) { //true to set the size to the current progress
+       routeLog(request, "OTA Complete: %s,size: %u", filename.c_str(), (unsigned)(index + len));
+        } 
+   else {
         Update.printError(Serial);
         }
+    otaRequest = NULL;
+    otaOwnerRelease(OTA_OWNER_WEB);
     }
+}
 
-    if (len) {
-     // flashing firmware to ESP
-     if (Update.write(data, len) != len) {
-        Update.printError(Serial);
-        }      
-      logmessage = "Writing file: " + String(filename) + " index=" + String(index) + " len=" + String(len);
-      Serial.println(logmessage);
+// the OTA client went away before the last chunk, the half written slot is dropped
+static void server_ota_release() {
+  if (otaRequest != NULL) {
+    Update.abort();
+    otaRequest = NULL;
+    otaOwnerRelease(OTA_OWNER_WEB);
     }
+}
+
 
-    if (final) {
-     if (Update.end(true)) { //true to set the size to the current progress
-         logmessage = "OTA Complete: " + String(filename) + ",size: " + String(index + len);
-         Serial.println(logmessage);
-          } 
-     else {
-          Update.printError(Serial);
-          }
-      request->redirect("/");
+// handles .patch uploads: the patch is stored, then rebuilt into the inactive slot by
+// the delta task against the running image, see delta_ota.cpp
+static void server_handle_delta_upload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
+  if (!index) {
+    if (otaOwnerBusy()) {
+      server_upload_refuse(request, 409, "ERROR: another firmware update is running");
+      return;
       }
-  } else {
-    Serial.println("Auth: Failed");
-    return request->requestAuthentication();
+    routeLog(request, "Delta OTA Start: %s", filename.c_str());
+    dutyBusyBegin();
+    guardOnRelease(request, dutyBusyEnd);
+    storageStreamBegin();
+    guardOnRelease(request, storageStreamEnd);
+    request->_tempFile = storageOpen(DELTA_PATCH_FILE, "w");
   }
+
+  if (!request->_tempFile) {
+    return;
+    }
+
+  if (len) {
+    storageWrite(request->_tempFile, data, len);
+    routeLog(request, "Writing file: %s index=%u len=%u", filename.c_str(), (unsigned)index, (unsigned)len);
+  }
+
+  if (final) {
+    request->_tempFile.close();
+    routeLog(request, "Delta OTA received: %s,size: %u", filename.c_str(), (unsigned)(index + len));
+    if (!deltaApplyBegin(DELTA_PATCH_FILE)) {
+      server_upload_refuse(request, 409, "ERROR: another firmware update is running");
+      }
+  }
+}
+
+
+// handles the tar archive posted to /restore, parsed into temp files while it arrives and
+// committed only once complete, see fs_archive.cpp
+static void server_handle_restore_upload(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
+  if (!index) {
+    if (!archiveRestoreBegin()) {
+      routeLog(request, "Restore rejected: %s, a restore is already running", filename.c_str());
+      return;
+      }
+    routeLog(request, "Restore Start: %s", filename.c_str());
+    restoreRequest = request;
+    restoreOk = false;
+    dutyBusyBegin();
+    guardOnRelease(request, dutyBusyEnd);
+    storageStreamBegin();
+    guardOnRelease(request, storageStreamEnd);
+    guardOnRelease(request, server_restore_release);
+  }
+
+  if (request != restoreRequest) {
+    return;
+    }
+
+  if (len) {
+    archiveRestoreWrite(data, len);
+  }
+
+  if (final) {
+    restoreOk = archiveRestoreEnd();
+  }
+}
+
+// the restore client went away, an unfinished archive is dropped
+static void server_restore_release() {
+  archiveRestoreAbort();
+  restoreRequest = NULL;
 }
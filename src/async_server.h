@@ -10,6 +10,8 @@ extern String Read_rootca;
 extern String Client_cert;
 extern String Client_privatekey;
 
+bool server_load_certs();
+void server_wifi_begin();
 void server_init();
 
 #endif
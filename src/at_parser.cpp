@@ -0,0 +1,234 @@
+// **************************************************************************************
+//   This file turns a raw M95 response buffer into typed records in one pass. Every
+//   line is split off in place, its "+PREFIX" token is hashed once and dispatched
+//   through a switch over compile-time FNV-1a hashes of the known prefixes (the
+//   compiler rejects colliding prefixes as duplicate case labels), then the argument
+//   list is parsed without strtok, copies or heap use. It has no Arduino dependency.
+// **************************************************************************************
+
+#include "at_parser.h"
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static constexpr uint32_t atHashStep(const char *s, uint32_t h)
+{
+    return (*s == '\0') ? h : atHashStep(s + 1, (h ^ (uint8_t)*s) * 16777619UL);
+}
+
+static constexpr uint32_t atHash(const char *s)
+{
+    return atHashStep(s, 2166136261UL);
+}
+
+static enum atRecordType atClassify(uint32_t hash)
+{
+    switch (hash)
+    {
+    case atHash("OK"):
+        return AT_REC_OK;
+    case atHash("ERROR"):
+        return AT_REC_ERROR;
+    case atHash("+CME ERROR"):
+    case atHash("+CMS ERROR"):
+        return AT_REC_CME_ERROR;
+    case atHash("CONNECT"):
+        return AT_REC_CONNECT;
+    case atHash(">"):
+        return AT_REC_PROMPT;
+    case atHash("+CCID"):
+        return AT_REC_CCID;
+    case atHash("+CSQ"):
+        return AT_REC_CSQ;
+    case atHash("+CREG"):
+        return AT_REC_CREG;
+    case atHash("+CGATT"):
+        return AT_REC_CGATT;
+    case atHash("+COPS"):
+        return AT_REC_COPS;
+    case atHash("+IPR"):
+        return AT_REC_IPR;
+    case atHash("+QSECWRITE"):
+        return AT_REC_QSECWRITE;
+    case atHash("+QSECREAD"):
+        return AT_REC_QSECREAD;
+    case atHash("+QMTOPEN"):
+        return AT_REC_QMTOPEN;
+    case atHash("+QMTCONN"):
+        return AT_REC_QMTCONN;
+    case atHash("+QMTPUB"):
+        return AT_REC_QMTPUB;
+    case atHash("+QMTSTAT"):
+        return AT_REC_QMTSTAT;
+    case atHash("+QMTDISC"):
+        return AT_REC_QMTDISC;
+    case atHash("+QLTS"):
+        return AT_REC_QLTS;
+    case atHash("+CCLK"):
+        return AT_REC_CCLK;
+    default:
+        return AT_REC_OTHER;
+    }
+}
+
+// "<a>,<b>,\"text\",<c>" after the ':' of a line
+static void atParseArgs(const char *p, const char *end, atRecord_t *record)
+{
+    while (p < end)
+    {
+        while ((p < end) && (*p == ' '))
+        {
+            p++;
+        }
+        if (p >= end)
+        {
+            break;
+        }
+        bool negative = (*p == '-');
+        const char *digits = negative ? p + 1 : p;
+        const char *digitsEnd = digits;
+        while ((digitsEnd < end) && (*digitsEnd >= '0') && (*digitsEnd <= '9'))
+        {
+            digitsEnd++;
+        }
+        // a plain number that fits int32, longer digit runs (CCID) stay text
+        if ((digitsEnd > digits) && ((digitsEnd - digits) <= 9) &&
+            ((digitsEnd == end) || (*digitsEnd == ',') || (*digitsEnd == ' ')))
+        {
+            int32_t value = 0;
+            for (p = digits; p < digitsEnd; p++)
+            {
+                value = (value * 10) + (*p - '0');
+            }
+            if (record->argc < AT_MAX_ARGS)
+            {
+                record->args[record->argc++] = negative ? -value : value;
+            }
+        }
+        else
+        {
+            // quoted or free text argument, keep only the first one
+            bool quoted = (*p == '"');
+            const char *start = quoted ? p + 1 : p;
+            const char *stop = start;
+            while ((stop < end) && (quoted ? (*stop != '"') : (*stop != ',')))
+            {
+                stop++;
+            }
+            if (record->text == NULL)
+            {
+                record->text = start;
+                record->textLen = (uint8_t)((stop - start) > 255 ? 255 : (stop - start));
+            }
+            p = (quoted && (stop < end)) ? stop + 1 : stop;
+        }
+        while ((p < end) && (*p != ','))
+        {
+            p++;
+        }
+        p++; // skip ','
+    }
+}
+
+static void atParseLine(const char *line, const char *end, atRecord_t *record)
+{
+    const char *colon = line;
+    uint32_t hash = 2166136261UL;
+
+    while ((colon < end) && (*colon != ':'))
+    {
+        hash = (hash ^ (uint8_t)*colon) * 16777619UL;
+        colon++;
+    }
+    // trailing blanks are not part of a bare token such as "> "
+    if (colon == end)
+    {
+        const char *stop = end;
+        while ((stop > line) && (stop[-1] == ' '))
+        {
+            stop--;
+        }
+        if (stop != end)
+        {
+            hash = 2166136261UL;
+            for (const char *c = line; c < stop; c++)
+            {
+                hash = (hash ^ (uint8_t)*c) * 16777619UL;
+            }
+        }
+    }
+
+    record->type = atClassify(hash);
+    record->argc = 0;
+    record->text = NULL;
+    record->textLen = 0;
+    if (record->type == AT_REC_OTHER)
+    {
+        record->text = line;
+        record->textLen = (uint8_t)((end - line) > 255 ? 255 : (end - line));
+    }
+    else if (colon < end)
+    {
+        atParseArgs(colon + 1, end, record);
+    }
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+uint8_t atParse(const char *buf, size_t len, atResponse_t *response)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+
+    response->count = 0;
+    response->dropped = 0;
+    while ((p < end) && (*p != '\0'))
+    {
+        while ((p < end) && ((*p == '\r') || (*p == '\n')))
+        {
+            p++;
+        }
+        const char *line = p;
+        while ((p < end) && (*p != '\r') && (*p != '\n') && (*p != '\0'))
+        {
+            p++;
+        }
+        if ((p > line) && (response->count < AT_MAX_RECORDS))
+        {
+            atParseLine(line, p, &response->records[response->count++]);
+        }
+        else if (p > line)
+        {
+            response->dropped += (response->dropped < 255) ? 1 : 0; // the caller reports it
+        }
+    }
+    return response->count;
+}
+
+const atRecord_t *atFind(const atResponse_t *response, enum atRecordType type)
+{
+    for (uint8_t i = 0; i < response->count; i++)
+    {
+        if (response->records[i].type == type)
+        {
+            return &response->records[i];
+        }
+    }
+    return NULL;
+}
+
+int32_t atArg(const atRecord_t *record, uint8_t index, int32_t fallback)
+{
+    if ((record == NULL) || (index >= record->argc))
+    {
+        return fallback;
+    }
+    return record->args[index];
+}
@@ -0,0 +1,73 @@
+// **************************************************************************************
+//    This header file handles at_parser.cpp data
+//    Single pass AT response / URC parser producing typed records
+// **************************************************************************************
+#ifndef AT_PARSER_H
+#define AT_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define AT_MAX_RECORDS 12
+#define AT_MAX_ARGS 4
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum atRecordType
+{
+    AT_REC_OTHER = 0, // echo, free text, unknown prefixes
+    AT_REC_OK,
+    AT_REC_ERROR,
+    AT_REC_CME_ERROR,
+    AT_REC_CONNECT,
+    AT_REC_PROMPT,
+    AT_REC_CCID,
+    AT_REC_CSQ,
+    AT_REC_CREG,
+    AT_REC_CGATT,
+    AT_REC_COPS,
+    AT_REC_IPR,
+    AT_REC_QSECWRITE,
+    AT_REC_QSECREAD,
+    AT_REC_QMTOPEN,
+    AT_REC_QMTCONN,
+    AT_REC_QMTPUB,
+    AT_REC_QMTSTAT,
+    AT_REC_QMTDISC,
+    AT_REC_QLTS,
+    AT_REC_CCLK
+};
+
+// numeric arguments in order, the first quoted (or non numeric) argument is
+// referenced in place through text/textLen, nothing is copied out of the buffer
+typedef struct
+{
+    enum atRecordType type;
+    uint8_t argc;
+    int32_t args[AT_MAX_ARGS];
+    const char *text;
+    uint8_t textLen;
+} atRecord_t;
+
+typedef struct
+{
+    uint8_t count;
+    uint8_t dropped; // lines past AT_MAX_RECORDS, counted but not parsed
+    atRecord_t records[AT_MAX_RECORDS];
+} atResponse_t;
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+uint8_t atParse(const char *buf, size_t len, atResponse_t *response);
+const atRecord_t *atFind(const atResponse_t *response, enum atRecordType type);
+int32_t atArg(const atRecord_t *record, uint8_t index, int32_t fallback);
+
+#endif // AT_PARSER_H
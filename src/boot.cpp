@@ -0,0 +1,217 @@
+// **************************************************************************************
+//   This file runs the init stages of setup() as concurrent FreeRTOS tasks. Every stage
+//   declares the stages it needs (bootStage_t.after) and waits for their bits in one
+//   event group before it runs, so the modem power-up does not queue behind the
+//   filesystem mount and the WiFi start does not queue behind the certificate reads.
+//   Code outside the table waits for a stage with bootWait(), e.g. the GSM state
+//   machine only needs the certificates when it is about to push them to the modem.
+//   Per-stage start / end times and the first HTTP response and MQTT publish after
+//   reset are kept for the console and /diag.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include "boot.h"
+#include "duty_cycle.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t startMs; // dependencies met
+    uint32_t endMs;
+    bool ok;
+} bootTiming_t;
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static const bootStage_t *bootStages = NULL;
+static EventGroupHandle_t bootEvents = NULL;
+static bootTiming_t timing[BOOT_STAGES];
+static uint32_t milestoneMs[BOOT_MILESTONES];
+static uint8_t stagesDone = 0;
+static portMUX_TYPE bootMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *milestoneNames[BOOT_MILESTONES] = {"first http response", "first publish"};
+
+// **************************************************************************************
+//
+//                      Local Functions declaration
+//
+//
+// **************************************************************************************
+static size_t appendf(char *out, size_t size, size_t len, const char *format, ...);
+static void printReport();
+static void stageTask(void *parameter);
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+// snprintf that keeps appending and never runs past the end of out
+static size_t appendf(char *out, size_t size, size_t len, const char *format, ...)
+{
+    va_list args;
+    int written;
+
+    if (len >= size)
+    {
+        return len;
+    }
+    va_start(args, format);
+    written = vsnprintf(out + len, size - len, format, args);
+    va_end(args);
+    if (written < 0)
+    {
+        return len;
+    }
+    return ((len + written) < size) ? (len + written) : (size - 1);
+}
+
+static void printReport()
+{
+    uint32_t last = 0;
+
+    Serial.println("Boot stages (ms since reset):");
+    for (uint8_t i = 0; i < BOOT_STAGES; i++)
+    {
+        Serial.printf("  %-8s %5lu .. %5lu  %5lu ms%s\r\n", bootStages[i].name, (unsigned long)timing[i].startMs,
+                      (unsigned long)timing[i].endMs, (unsigned long)(timing[i].endMs - timing[i].startMs),
+                      timing[i].ok ? "" : "  FAILED");
+        last = max(last, timing[i].endMs);
+    }
+    Serial.printf("Boot done in %lu ms\r\n", (unsigned long)last);
+}
+
+static void stageTask(void *parameter)
+{
+    uint8_t stage = (uint8_t)(uintptr_t)parameter;
+    const bootStage_t *entry = &bootStages[stage];
+    bool last;
+
+    if (entry->after != 0)
+    {
+        xEventGroupWaitBits(bootEvents, entry->after, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    timing[stage].startMs = millis();
+    timing[stage].ok = entry->run();
+    timing[stage].endMs = millis();
+    if (!timing[stage].ok)
+    {
+        Serial.printf("Boot stage %s failed\r\n", entry->name);
+    }
+
+    portENTER_CRITICAL(&bootMux);
+    last = (++stagesDone == BOOT_STAGES);
+    portEXIT_CRITICAL(&bootMux);
+    xEventGroupSetBits(bootEvents, BOOT_BIT(stage));
+    if (last)
+    {
+        printReport();
+        dutyBoostEnd();
+    }
+    vTaskDelete(NULL);
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+// stages[] holds BOOT_STAGES entries in bootStage order and must outlive the boot
+void bootBegin(const bootStage_t *stages)
+{
+    bootStages = stages;
+    bootEvents = xEventGroupCreate();
+    dutyBoostBegin(); // the whole boot runs at full clock, the last stage drops it
+    for (uint8_t i = 0; i < BOOT_STAGES; i++)
+    {
+        if (xTaskCreate(stageTask, stages[i].name, stages[i].stack, (void *)(uintptr_t)i, 1, NULL) != pdPASS)
+        {
+            // nothing sensible to continue with, the dependents would wait forever
+            Serial.printf("Boot stage %s: no memory for its task, rebooting\r\n", stages[i].name);
+            delay(1000);
+            ESP.restart();
+        }
+    }
+}
+
+// true once all of the BOOT_BIT() stages have run, failed ones included
+bool bootWait(uint32_t stages, uint32_t timeoutMs)
+{
+    TickType_t ticks = (timeoutMs == BOOT_WAIT_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs);
+
+    if (bootEvents == NULL)
+    {
+        return false;
+    }
+    return (xEventGroupWaitBits(bootEvents, stages, pdFALSE, pdTRUE, ticks) & stages) == stages;
+}
+
+void bootMilestoneReached(bootMilestone milestone)
+{
+    bool first;
+
+    portENTER_CRITICAL(&bootMux);
+    first = (milestoneMs[milestone] == 0);
+    if (first)
+    {
+        milestoneMs[milestone] = millis();
+    }
+    portEXIT_CRITICAL(&bootMux);
+    if (first)
+    {
+        Serial.printf("Boot: %s at %lu ms\r\n", milestoneNames[milestone], (unsigned long)milestoneMs[milestone]);
+    }
+}
+
+size_t bootReport(char *out, size_t size)
+{
+    EventBits_t done = (bootEvents != NULL) ? xEventGroupGetBits(bootEvents) : 0;
+    size_t len = 0;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+    out[0] = '\0';
+    len = appendf(out, size, len, "boot");
+    for (uint8_t i = 0; i < BOOT_STAGES; i++)
+    {
+        if ((done & BOOT_BIT(i)) == 0)
+        {
+            len = appendf(out, size, len, " %s ..", (bootStages != NULL) ? bootStages[i].name : "?");
+        }
+        else
+        {
+            len = appendf(out, size, len, " %s %lu+%lu%s", bootStages[i].name, (unsigned long)timing[i].startMs,
+                          (unsigned long)(timing[i].endMs - timing[i].startMs), timing[i].ok ? "" : "!");
+        }
+    }
+    for (uint8_t i = 0; i < BOOT_MILESTONES; i++)
+    {
+        if (milestoneMs[i] == 0)
+        {
+            len = appendf(out, size, len, ", %s -", milestoneNames[i]);
+        }
+        else
+        {
+            len = appendf(out, size, len, ", %s %lu", milestoneNames[i], (unsigned long)milestoneMs[i]);
+        }
+    }
+    return appendf(out, size, len, " ms\n");
+}
@@ -0,0 +1,61 @@
+// **************************************************************************************
+//    This header file handles boot.cpp data
+//    Boot orchestrator: init stages as concurrent tasks with declared dependencies
+// **************************************************************************************
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <Arduino.h>
+
+#define BOOT_WAIT_FOREVER 0xFFFFFFFFUL
+#define BOOT_BIT(stage) (1UL << (stage))
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum bootStage
+{
+    BOOT_FS = 0,   // data partition mounted, interrupted restore recovered
+    BOOT_CONFIG,   // NVS configuration loaded
+    BOOT_MODEM,    // M95 powered, UART up
+    BOOT_CERTS,    // TLS material read from the data partition
+    BOOT_WIFI,     // WiFi started (the link itself comes up in the background)
+    BOOT_WEB,      // web server listening
+    BOOT_HISTORY,  // history index built, clock past the newest stored sample
+    BOOT_SENSOR,   // sampling task running
+    BOOT_SERVICES, // diagnostics, filesystem maintenance
+    BOOT_STAGES
+};
+
+enum bootMilestone
+{
+    BOOT_FIRST_HTTP = 0, // first web request answered
+    BOOT_FIRST_PUBLISH,  // first MQTT publish acknowledged
+    BOOT_MILESTONES
+};
+
+typedef bool (*bootStageFn)(); // false marks the stage failed, its dependents still run
+
+typedef struct
+{
+    const char *name;
+    bootStageFn run;
+    uint32_t after; // BOOT_BIT() of every stage that must be done first
+    uint32_t stack;
+} bootStage_t;
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void bootBegin(const bootStage_t *stages);
+bool bootWait(uint32_t stages, uint32_t timeoutMs);
+void bootMilestoneReached(bootMilestone milestone);
+size_t bootReport(char *out, size_t size);
+
+#endif // BOOT_H
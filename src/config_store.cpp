@@ -0,0 +1,177 @@
+// **************************************************************************************
+//   This file keeps the runtime configuration shared by the web UI and the GSM stack.
+//   The whole record is one versioned NVS blob, so a write either lands completely or
+//   not at all. Readers get a copy of the RAM cached view under a mutex (the web server
+//   and the GSM state machine run in different tasks). Every successful write tells
+//   the subscribed listeners which groups of fields changed.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "config_store.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// compile-time defaults, used until something is saved from the web UI
+#define DEFAULT_BROKER "iot.thingsty.com"
+#define DEFAULT_PORT 8883
+#define DEFAULT_CLIENT_ID "625fdecb95fe84dd1ac9"
+#define DEFAULT_MQTT_TOPIC "625fdecb95fe8/pub/l/4dd1ac9"
+#define DEFAULT_MAX_DEFER_MIN 30
+
+#define CONFIG_NAMESPACE "config"
+#define CONFIG_KEY "app"
+#define MAX_LISTENERS 4
+#define CONFIG_V1_SIZE offsetof(appConfig_t, maxDeferMin) // version 1 ended before the link fields
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static appConfig_t cachedConfig;
+static SemaphoreHandle_t configMutex = NULL;
+static configListener listeners[MAX_LISTENERS];
+static uint8_t listenerCount = 0;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static void configDefaults(appConfig_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->version = CONFIG_VERSION;
+    config->port = DEFAULT_PORT;
+    strncpy(config->broker, DEFAULT_BROKER, sizeof(config->broker) - 1);
+    strncpy(config->clientId, DEFAULT_CLIENT_ID, sizeof(config->clientId) - 1);
+    strncpy(config->topic, DEFAULT_MQTT_TOPIC, sizeof(config->topic) - 1);
+    config->maxDeferMin = DEFAULT_MAX_DEFER_MIN;
+}
+
+// every string must be terminated inside its field
+static bool configValid(const appConfig_t *config)
+{
+    return (config->port != 0) && (config->maxDeferMin != 0) && (config->maxDeferMin <= CONFIG_MAX_DEFER_MIN_LIMIT) &&
+           (config->broker[0] != '\0') && (config->clientId[0] != '\0') &&
+           (config->topic[0] != '\0') && (memchr(config->broker, '\0', sizeof(config->broker)) != NULL) &&
+           (memchr(config->clientId, '\0', sizeof(config->clientId)) != NULL) &&
+           (memchr(config->topic, '\0', sizeof(config->topic)) != NULL) &&
+           (memchr(config->apn, '\0', sizeof(config->apn)) != NULL) &&
+           (memchr(config->apnUser, '\0', sizeof(config->apnUser)) != NULL) &&
+           (memchr(config->apnPassword, '\0', sizeof(config->apnPassword)) != NULL);
+}
+
+static uint8_t configDiff(const appConfig_t *a, const appConfig_t *b)
+{
+    uint8_t changed = 0;
+
+    if ((a->port != b->port) || strcmp(a->broker, b->broker) || strcmp(a->clientId, b->clientId) ||
+        strcmp(a->topic, b->topic))
+    {
+        changed |= CONFIG_CHANGED_MQTT;
+    }
+    if (strcmp(a->apn, b->apn) || strcmp(a->apnUser, b->apnUser) || strcmp(a->apnPassword, b->apnPassword))
+    {
+        changed |= CONFIG_CHANGED_APN;
+    }
+    if (a->maxDeferMin != b->maxDeferMin)
+    {
+        changed |= CONFIG_CHANGED_LINK;
+    }
+    return changed;
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+void configBegin()
+{
+    Preferences prefs;
+    appConfig_t stored;
+    size_t storedLen;
+
+    if (configMutex == NULL)
+    {
+        configMutex = xSemaphoreCreateMutex();
+    }
+    configDefaults(&cachedConfig);
+
+    prefs.begin(CONFIG_NAMESPACE, true);
+    storedLen = prefs.getBytesLength(CONFIG_KEY);
+    stored = cachedConfig; // a version 1 record keeps the defaults of the newer fields
+    if (((storedLen == sizeof(stored)) || (storedLen == CONFIG_V1_SIZE)) &&
+        (prefs.getBytes(CONFIG_KEY, &stored, storedLen) == storedLen) &&
+        (stored.version == ((storedLen == sizeof(stored)) ? CONFIG_VERSION : 1)) && configValid(&stored))
+    {
+        stored.version = CONFIG_VERSION;
+        cachedConfig = stored;
+        Serial.println("Configuration loaded from NVS");
+    }
+    else
+    {
+        Serial.println("No stored configuration, using defaults");
+    }
+    prefs.end();
+}
+
+void configGet(appConfig_t *config)
+{
+    xSemaphoreTake(configMutex, portMAX_DELAY);
+    *config = cachedConfig;
+    xSemaphoreGive(configMutex);
+}
+
+// persists and applies a new configuration, false when it is rejected or NVS fails
+bool configSet(const appConfig_t *config)
+{
+    Preferences prefs;
+    appConfig_t updated = *config;
+    uint8_t changed;
+    bool written = true;
+
+    updated.version = CONFIG_VERSION;
+    if (configValid(&updated) == false)
+    {
+        return false;
+    }
+
+    xSemaphoreTake(configMutex, portMAX_DELAY);
+    changed = configDiff(&cachedConfig, &updated);
+    if (changed != 0)
+    {
+        prefs.begin(CONFIG_NAMESPACE, false);
+        written = (prefs.putBytes(CONFIG_KEY, &updated, sizeof(updated)) == sizeof(updated));
+        prefs.end();
+        if (written)
+        {
+            cachedConfig = updated;
+        }
+    }
+    xSemaphoreGive(configMutex);
+
+    if ((changed != 0) && written)
+    {
+        for (uint8_t i = 0; i < listenerCount; i++)
+        {
+            listeners[i](changed);
+        }
+    }
+    return written;
+}
+
+bool configSubscribe(configListener listener)
+{
+    if (listenerCount >= MAX_LISTENERS)
+    {
+        return false;
+    }
+    listeners[listenerCount++] = listener;
+    return true;
+}
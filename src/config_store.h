@@ -0,0 +1,51 @@
+// **************************************************************************************
+//    This header file handles config_store.cpp data
+//    NVS backed runtime configuration (MQTT / APN) with change notification
+// **************************************************************************************
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <Arduino.h>
+
+#define CONFIG_VERSION 2
+
+// change mask passed to listeners
+#define CONFIG_CHANGED_MQTT 0x01 // broker, port, client id or topic
+#define CONFIG_CHANGED_APN 0x02  // APN or its credentials
+#define CONFIG_CHANGED_LINK 0x04 // link scheduler limits
+
+#define CONFIG_MAX_DEFER_MIN_LIMIT 1440 // longest accepted deferral, one day
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint16_t version;
+    uint16_t port;
+    char broker[64];
+    char clientId[48];
+    char topic[96];
+    char apn[40]; // empty: pick the APN from the operator table
+    char apnUser[16];
+    char apnPassword[16];
+    uint16_t maxDeferMin; // longest hold of readings at poor signal, minutes (version 2)
+} appConfig_t;
+
+typedef void (*configListener)(uint8_t changed);
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void configBegin();
+void configGet(appConfig_t *config);
+bool configSet(const appConfig_t *config);
+bool configSubscribe(configListener listener);
+
+#endif // CONFIG_STORE_H
@@ -0,0 +1,384 @@
+// **************************************************************************************
+//   This file rebuilds a new firmware image from the running one and a patch made by
+//   tools/delta_ota/make_patch.py, so a release that changes a few KB does not have to
+//   ship the whole 1 MB image. The patch is a list of operations:
+//   - COPY: take a range of the running image (esp_ota_get_running_partition)
+//   - ADD:  take literal bytes from the patch
+//   - DIFF: take a range of the running image with scattered bytes replaced, for code
+//           that only moved and so had its addresses and call offsets changed
+//   and the output streams through Update into the inactive app slot, never held in RAM.
+//   The source MD5 in the header rejects a patch made for another base before anything
+//   is written; the target MD5 is handed to Update, whose end() refuses to mark the
+//   slot bootable unless the rebuilt image matches it.
+//   The patch is uploaded to the data partition first and applied from there by its own
+//   task, a long COPY runs for seconds and must not stall the web server task.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <Update.h>
+#include <MD5Builder.h>
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "delta_ota.h"
+#include "duty_cycle.h"
+#include "storage.h"
+#include "ota_owner.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define DELTA_TASK_STACK 4096
+#define DELTA_BUFFER_SIZE 1024
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t targetSize;
+    uint32_t sourceSize;
+    uint8_t targetMd5[16];
+    uint8_t sourceMd5[16];
+} deltaHeader_t;
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static volatile deltaState state = DELTA_IDLE;
+static const char *failReason = "";
+static uint32_t produced = 0;
+static uint32_t targetSize = 0;
+static uint32_t patchSize = 0;
+static uint32_t applyMs = 0;
+static char patchPath[32];
+static uint8_t buffer[DELTA_BUFFER_SIZE]; // delta task only
+
+static const char *stateNames[DELTA_STATES] = {"idle", "applying", "done", "failed"};
+
+// **************************************************************************************
+//
+//                      Local Functions declaration
+//
+//
+// **************************************************************************************
+static uint32_t readU32(const uint8_t *p);
+static bool readExact(File &file, uint8_t *out, size_t len);
+static bool readHeader(File &file, deltaHeader_t *header);
+static bool sourceMatches(const esp_partition_t *running, const deltaHeader_t *header);
+static bool applyCopy(const esp_partition_t *running, uint32_t sourceSize, uint32_t offset, uint32_t len);
+static bool applyAdd(File &file, uint32_t len);
+static bool readVarint(File &file, uint32_t *value);
+static bool applyDiff(File &file, const esp_partition_t *running, uint32_t sourceSize, uint32_t offset, uint32_t len);
+static bool applyPatch(File &file);
+static void deltaTask(void *parameter);
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static uint32_t readU32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool readExact(File &file, uint8_t *out, size_t len)
+{
+    return file.read(out, len) == len;
+}
+
+static bool readHeader(File &file, deltaHeader_t *header)
+{
+    uint8_t raw[DELTA_HEADER_SIZE];
+
+    if (!readExact(file, raw, sizeof(raw)) || (memcmp(raw, DELTA_MAGIC, 4) != 0))
+    {
+        failReason = "not a patch file";
+        return false;
+    }
+    header->targetSize = readU32(&raw[4]);
+    header->sourceSize = readU32(&raw[8]);
+    memcpy(header->targetMd5, &raw[12], 16);
+    memcpy(header->sourceMd5, &raw[28], 16);
+    return true;
+}
+
+// the running partition is larger than the image in it, only the image is hashed
+static bool sourceMatches(const esp_partition_t *running, const deltaHeader_t *header)
+{
+    MD5Builder md5;
+    uint8_t digest[16];
+
+    if (header->sourceSize > running->size)
+    {
+        return false;
+    }
+    md5.begin();
+    for (uint32_t offset = 0; offset < header->sourceSize; offset += DELTA_BUFFER_SIZE)
+    {
+        uint32_t part = min((uint32_t)DELTA_BUFFER_SIZE, header->sourceSize - offset);
+        if (esp_partition_read(running, offset, buffer, part) != ESP_OK)
+        {
+            return false;
+        }
+        md5.add(buffer, part);
+    }
+    md5.calculate();
+    md5.getBytes(digest);
+    return memcmp(digest, header->sourceMd5, sizeof(digest)) == 0;
+}
+
+static bool applyCopy(const esp_partition_t *running, uint32_t sourceSize, uint32_t offset, uint32_t len)
+{
+    if ((offset > sourceSize) || (len > sourceSize - offset))
+    {
+        failReason = "copy outside the base image";
+        return false;
+    }
+    while (len > 0)
+    {
+        uint32_t part = min((uint32_t)DELTA_BUFFER_SIZE, len);
+        if ((esp_partition_read(running, offset, buffer, part) != ESP_OK) || (Update.write(buffer, part) != part))
+        {
+            failReason = "copy failed";
+            return false;
+        }
+        offset += part;
+        len -= part;
+        produced += part;
+    }
+    return true;
+}
+
+static bool applyAdd(File &file, uint32_t len)
+{
+    while (len > 0)
+    {
+        uint32_t part = min((uint32_t)DELTA_BUFFER_SIZE, len);
+        if (!readExact(file, buffer, part) || (Update.write(buffer, part) != part))
+        {
+            failReason = "add failed";
+            return false;
+        }
+        len -= part;
+        produced += part;
+    }
+    return true;
+}
+
+static bool readVarint(File &file, uint32_t *value)
+{
+    uint8_t byte;
+
+    *value = 0;
+    for (uint8_t shift = 0; shift < 32; shift += 7)
+    {
+        if (!readExact(file, &byte, 1))
+        {
+            return false;
+        }
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool applyDiff(File &file, const esp_partition_t *running, uint32_t sourceSize, uint32_t offset, uint32_t len)
+{
+    uint32_t end = produced + len;
+    uint32_t skip;
+    uint32_t count;
+
+    while (produced < end)
+    {
+        if (!readVarint(file, &skip) || !readVarint(file, &count) || (skip > end - produced) ||
+            (count > end - produced - skip))
+        {
+            failReason = "bad diff run";
+            return false;
+        }
+        if (!applyCopy(running, sourceSize, offset, skip) || !applyAdd(file, count))
+        {
+            return false;
+        }
+        offset += skip + count;
+    }
+    return true;
+}
+
+static bool applyPatch(File &file)
+{
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    deltaHeader_t header;
+    char md5Hex[33];
+    uint8_t op[9];
+
+    if (!readHeader(file, &header))
+    {
+        return false;
+    }
+    if ((running == NULL) || !sourceMatches(running, &header))
+    {
+        failReason = "patch was made for another firmware";
+        return false;
+    }
+    targetSize = header.targetSize;
+    if (!Update.begin(header.targetSize))
+    {
+        failReason = "no room for the new image";
+        return false;
+    }
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        snprintf(&md5Hex[i * 2], 3, "%02x", header.targetMd5[i]);
+    }
+    Update.setMD5(md5Hex);
+
+    while (produced < header.targetSize)
+    {
+        if (!readExact(file, op, 1))
+        {
+            failReason = "patch truncated";
+            break;
+        }
+        if (op[0] == DELTA_OP_COPY)
+        {
+            if (!readExact(file, &op[1], 8) || !applyCopy(running, header.sourceSize, readU32(&op[1]), readU32(&op[5])))
+            {
+                break;
+            }
+        }
+        else if (op[0] == DELTA_OP_DIFF)
+        {
+            if (!readExact(file, &op[1], 8) || !applyDiff(file, running, header.sourceSize, readU32(&op[1]), readU32(&op[5])))
+            {
+                break;
+            }
+        }
+        else if (op[0] == DELTA_OP_ADD)
+        {
+            if (!readExact(file, &op[1], 4) || !applyAdd(file, readU32(&op[1])))
+            {
+                break;
+            }
+        }
+        else
+        {
+            failReason = "unknown patch operation";
+            break;
+        }
+    }
+    if (produced != header.targetSize)
+    {
+        Update.abort();
+        return false;
+    }
+    if (!Update.end())
+    {
+        failReason = Update.errorString(); // MD5 mismatch or a bad image header
+        return false;
+    }
+    return true;
+}
+
+static void deltaTask(void *parameter)
+{
+    (void)parameter;
+    unsigned long start = millis();
+    File file = storageOpen(patchPath, "r");
+
+    dutyBusyBegin();
+    dutyBoostBegin();
+    storageStreamBegin();
+    if (!file)
+    {
+        failReason = "patch file missing";
+        state = DELTA_FAILED;
+    }
+    else
+    {
+        patchSize = file.size();
+        state = applyPatch(file) ? DELTA_DONE : DELTA_FAILED;
+        file.close();
+    }
+    storageRemove(patchPath);
+    applyMs = millis() - start;
+    if (state == DELTA_DONE)
+    {
+        Serial.printf("Delta OTA: %u byte image from a %u byte patch in %lu ms, reboot to run it\r\n",
+                      (unsigned)targetSize, (unsigned)patchSize, (unsigned long)applyMs);
+    }
+    else
+    {
+        Serial.printf("Delta OTA failed: %s\r\n", failReason);
+    }
+    otaOwnerRelease(OTA_OWNER_DELTA);
+    storageStreamEnd();
+    dutyBoostEnd();
+    dutyBusyEnd();
+    vTaskDelete(NULL);
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+// takes over the uploaded patch file, it is deleted once applied
+bool deltaApplyBegin(const char *path)
+{
+    if (state == DELTA_APPLYING)
+    {
+        return false;
+    }
+    produced = 0;
+    targetSize = 0;
+    patchSize = 0;
+    // held from here until the task ends, the web upload and the cellular download wait
+    if (!otaOwnerAcquire(OTA_OWNER_DELTA))
+    {
+        failReason = "another firmware update is running";
+        state = DELTA_FAILED;
+        storageRemove(path);
+        return false;
+    }
+    strlcpy(patchPath, path, sizeof(patchPath));
+    failReason = "";
+    state = DELTA_APPLYING;
+    if (xTaskCreate(deltaTask, "delta", DELTA_TASK_STACK, NULL, 1, NULL) != pdPASS)
+    {
+        failReason = "no memory for the delta task";
+        state = DELTA_FAILED;
+        otaOwnerRelease(OTA_OWNER_DELTA);
+        return false;
+    }
+    return true;
+}
+
+bool deltaIsApplying()
+{
+    return state == DELTA_APPLYING;
+}
+
+size_t deltaReport(char *out, size_t size)
+{
+    int written = snprintf(out, size, "delta ota %s%s%s, %u of %u bytes, patch %u bytes, %lu ms\n",
+                           stateNames[state], (state == DELTA_FAILED) ? ": " : "", (state == DELTA_FAILED) ? failReason : "",
+                           (unsigned)produced, (unsigned)targetSize,
+                           (unsigned)patchSize, (unsigned long)applyMs);
+    if (written < 0)
+    {
+        return 0;
+    }
+    return ((size_t)written < size) ? (size_t)written : size - 1;
+}
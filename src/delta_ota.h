@@ -0,0 +1,42 @@
+// **************************************************************************************
+//    This header file handles delta_ota.cpp data
+//    Firmware update from a binary patch against the running image
+// **************************************************************************************
+#ifndef DELTA_OTA_H
+#define DELTA_OTA_H
+
+#include <Arduino.h>
+
+#define DELTA_PATCH_FILE "/ota.patch" // uploads land here until they are applied
+#define DELTA_MAGIC "EDP1"
+#define DELTA_HEADER_SIZE 44 // magic, target size, source size, target MD5, source MD5
+#define DELTA_OP_COPY 0x01   // u32 source offset, u32 length
+#define DELTA_OP_ADD 0x02    // u32 length, then the bytes
+#define DELTA_OP_DIFF 0x03   // u32 source offset, u32 length, then varint skip / count / bytes runs
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum deltaState
+{
+    DELTA_IDLE = 0,
+    DELTA_APPLYING,
+    DELTA_DONE, // new image in the inactive slot, boots on the next reset
+    DELTA_FAILED,
+    DELTA_STATES
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+bool deltaApplyBegin(const char *patchPath);
+bool deltaIsApplying();
+size_t deltaReport(char *out, size_t size);
+
+#endif // DELTA_OTA_H
@@ -0,0 +1,168 @@
+// **************************************************************************************
+//   This file samples what the firmware needs to right-size its stacks and buffers:
+//   the stack high-water mark of every task, free heap, the low-water mark of the heap,
+//   the largest block still allocatable (fragmentation) and, when the FreeRTOS build
+//   collects them, per-task run-time shares. The same report is served on /diag and
+//   printed every DIAG_PERIOD_MS by a low priority task.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include "diag.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define DIAG_MAX_TASKS 24
+#define DIAG_TASK_STACK 3072
+
+// **************************************************************************************
+//
+//      Local Functions declaration
+//
+//
+// **************************************************************************************
+static size_t appendf(char *out, size_t size, size_t len, const char *format, ...);
+static size_t reportTasks(char *out, size_t size, size_t len);
+static void diagTask(void *parameter);
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+// the task table is shared by the diag task and the /diag handler (async_tcp task)
+static SemaphoreHandle_t tasksMutex = NULL;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+
+// snprintf that keeps appending and never runs past the end of out
+static size_t appendf(char *out, size_t size, size_t len, const char *format, ...)
+{
+    va_list args;
+    int written;
+
+    if (len >= size)
+    {
+        return len;
+    }
+    va_start(args, format);
+    written = vsnprintf(out + len, size - len, format, args);
+    va_end(args);
+    if (written < 0)
+    {
+        return len;
+    }
+    return ((len + written) < size) ? (len + written) : (size - 1);
+}
+
+#if configUSE_TRACE_FACILITY
+static size_t reportTasks(char *out, size_t size, size_t len)
+{
+    static TaskStatus_t tasks[DIAG_MAX_TASKS]; // too big for the caller's stack, guarded by tasksMutex
+    uint32_t totalRunTime = 0;
+    UBaseType_t count;
+
+    // before diagBegin only the async_tcp task reports, no one to share the table with
+    if (tasksMutex != NULL)
+    {
+        xSemaphoreTake(tasksMutex, portMAX_DELAY);
+    }
+    count = uxTaskGetSystemState(tasks, DIAG_MAX_TASKS, &totalRunTime);
+
+#if configGENERATE_RUN_TIME_STATS
+    len = appendf(out, size, len, "task             prio  stack free  cpu%%\n");
+#else
+    len = appendf(out, size, len, "task             prio  stack free\n");
+#endif
+    for (UBaseType_t i = 0; i < count; i++)
+    {
+        len = appendf(out, size, len, "%-16s %4u %11lu", tasks[i].pcTaskName,
+                      (unsigned)tasks[i].uxCurrentPriority, (unsigned long)tasks[i].usStackHighWaterMark);
+#if configGENERATE_RUN_TIME_STATS
+        if (totalRunTime > 0)
+        {
+            len = appendf(out, size, len, " %5lu", (unsigned long)((uint64_t)tasks[i].ulRunTimeCounter * 100ULL / totalRunTime));
+        }
+#endif
+        len = appendf(out, size, len, "\n");
+    }
+    if (tasksMutex != NULL)
+    {
+        xSemaphoreGive(tasksMutex);
+    }
+    return len;
+}
+#else
+// tasks looked up by name when the kernel cannot list all of them
+static const char *knownTasks[] = {"loopTask", "async_tcp", "LED Task", "sensor", "diag", "IDLE0", "IDLE1"};
+
+static size_t reportTasks(char *out, size_t size, size_t len)
+{
+    len = appendf(out, size, len, "task             stack free\n");
+    for (uint8_t i = 0; i < sizeof(knownTasks) / sizeof(knownTasks[0]); i++)
+    {
+        TaskHandle_t handle = xTaskGetHandle(knownTasks[i]);
+        if (handle != NULL)
+        {
+            len = appendf(out, size, len, "%-16s %10lu\n", knownTasks[i], (unsigned long)uxTaskGetStackHighWaterMark(handle));
+        }
+    }
+    return len;
+}
+#endif
+
+static void diagTask(void *parameter)
+{
+    (void)parameter;
+    for (;;)
+    {
+        vTaskDelay(pdMS_TO_TICKS(DIAG_PERIOD_MS));
+        diagPrint();
+    }
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+void diagBegin()
+{
+    tasksMutex = xSemaphoreCreateMutex();
+    xTaskCreate(diagTask, "diag", DIAG_TASK_STACK, NULL, 1, NULL);
+}
+
+// stack figures are in bytes on the ESP32 port
+size_t diagReport(char *out, size_t size)
+{
+    uint32_t freeHeap = ESP.getFreeHeap();
+    uint32_t largestBlock = ESP.getMaxAllocHeap();
+    size_t len = 0;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+    out[0] = '\0';
+    len = appendf(out, size, len, "uptime %lu s, %u tasks\n", millis() / 1000UL, (unsigned)uxTaskGetNumberOfTasks());
+    len = appendf(out, size, len, "heap free %lu, min free %lu, largest block %lu, fragmentation %lu%%\n",
+                  (unsigned long)freeHeap, (unsigned long)ESP.getMinFreeHeap(), (unsigned long)largestBlock,
+                  (unsigned long)(freeHeap > 0 ? 100UL - ((uint64_t)largestBlock * 100ULL / freeHeap) : 0));
+    return reportTasks(out, size, len);
+}
+
+void diagPrint()
+{
+    static char report[DIAG_REPORT_MAX]; // diag task only, /diag builds its own copy
+
+    (void)diagReport(report, sizeof(report));
+    Serial.print(report);
+}
@@ -0,0 +1,23 @@
+// **************************************************************************************
+//    This header file handles diag.cpp data
+//    Runtime task stack, heap and CPU load diagnostics
+// **************************************************************************************
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <Arduino.h>
+
+#define DIAG_PERIOD_MS (5UL * 60UL * 1000UL) // periodic summary on the console
+#define DIAG_REPORT_MAX 2048                  // largest /diag section, the task table
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void diagBegin();
+size_t diagReport(char *out, size_t size);
+void diagPrint();
+
+#endif // DIAG_H
@@ -0,0 +1,205 @@
+// **************************************************************************************
+//   This file runs the battery duty cycle: wake, sample, publish a batch, then deep sleep
+//   on an RTC timer. The CPU runs at 80 MHz and is raised to 240 MHz only while a
+//   CPU-heavy job holds a boost reference. Time and estimated charge per phase are
+//   accumulated in RTC memory, so the report covers sleep periods and gives the
+//   average current of the unit.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <sys/time.h>
+#include "duty_cycle.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// stay awake this long after a power-on so a technician can reach the web UI
+#define MIN_AWAKE_AFTER_POWER_ON_MS (3UL * 60UL * 1000UL)
+
+// estimated board current per phase (ESP32 + M95), in units of 0.1 mA
+static const uint32_t phaseCurrent[PHASE_COUNT] = {
+    1500, // wake: WiFi AP up, modem registering
+    1100, // sample
+    2500, // publish: modem transmitting
+    1000, // idle
+    15,   // sleep: ESP32 deep sleep + M95 slow clock
+};
+#define BOOST_EXTRA_CURRENT 300 // 240 MHz vs 80 MHz
+
+static const char *phaseNames[PHASE_COUNT] = {"wake", "sample", "publish", "idle", "sleep"};
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint64_t timeMs[PHASE_COUNT];
+    uint64_t charge[PHASE_COUNT]; // 0.1 mA * ms
+    uint64_t sleepStartUs;        // wall clock when the last sleep started, 0 if none
+    uint32_t cycles;
+} dutyStats_t;
+
+RTC_DATA_ATTR static dutyStats_t dutyStats;
+
+static dutyPhase currentPhase = PHASE_WAKE;
+static unsigned long phaseStart = 0;
+static unsigned long boostStart = 0;
+static uint8_t boostRefs = 0;
+static uint8_t busyRefs = 0;
+static portMUX_TYPE dutyMux = portMUX_INITIALIZER_UNLOCKED;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static uint64_t wallClockUs()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL); // kept by the RTC timer across deep sleep
+    return ((uint64_t)now.tv_sec * 1000000ULL) + now.tv_usec;
+}
+
+static void accountPhase(unsigned long now)
+{
+    unsigned long elapsed = now - phaseStart;
+
+    dutyStats.timeMs[currentPhase] += elapsed;
+    dutyStats.charge[currentPhase] += (uint64_t)elapsed * phaseCurrent[currentPhase];
+    phaseStart = now;
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+void dutyBegin()
+{
+    setCpuFrequencyMhz(DUTY_CPU_BASE_MHZ);
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP)
+    {
+        memset(&dutyStats, 0, sizeof(dutyStats)); // power-on: start a fresh account
+    }
+    else if (dutyStats.sleepStartUs != 0)
+    {
+        uint64_t sleptMs = (wallClockUs() - dutyStats.sleepStartUs) / 1000ULL;
+        dutyStats.timeMs[PHASE_SLEEP] += sleptMs;
+        dutyStats.charge[PHASE_SLEEP] += sleptMs * phaseCurrent[PHASE_SLEEP];
+    }
+    dutyStats.sleepStartUs = 0;
+    dutyStats.cycles++;
+    currentPhase = PHASE_WAKE;
+    phaseStart = millis();
+}
+
+void dutyPhaseEnter(dutyPhase phase)
+{
+    if (phase == currentPhase)
+    {
+        return;
+    }
+    accountPhase(millis());
+    currentPhase = phase;
+}
+
+// reference counted, jobs in different tasks may overlap
+void dutyBoostBegin()
+{
+    bool raise;
+
+    portENTER_CRITICAL(&dutyMux);
+    raise = (boostRefs++ == 0);
+    portEXIT_CRITICAL(&dutyMux);
+    if (raise)
+    {
+        boostStart = millis();
+        setCpuFrequencyMhz(DUTY_CPU_BOOST_MHZ);
+    }
+}
+
+void dutyBoostEnd()
+{
+    bool lower;
+
+    portENTER_CRITICAL(&dutyMux);
+    lower = (boostRefs > 0) && (--boostRefs == 0);
+    portEXIT_CRITICAL(&dutyMux);
+    if (lower)
+    {
+        unsigned long elapsed = millis() - boostStart;
+        dutyStats.charge[currentPhase] += (uint64_t)elapsed * BOOST_EXTRA_CURRENT;
+        setCpuFrequencyMhz(DUTY_CPU_BASE_MHZ);
+    }
+}
+
+// uploads and other jobs that must not be cut by a deep sleep
+void dutyBusyBegin()
+{
+    portENTER_CRITICAL(&dutyMux);
+    busyRefs++;
+    portEXIT_CRITICAL(&dutyMux);
+}
+
+void dutyBusyEnd()
+{
+    portENTER_CRITICAL(&dutyMux);
+    if (busyRefs > 0)
+    {
+        busyRefs--;
+    }
+    portEXIT_CRITICAL(&dutyMux);
+}
+
+bool dutyIsBusy()
+{
+    return busyRefs != 0;
+}
+
+bool dutySleepAllowed()
+{
+    if (busyRefs != 0 || WiFi.softAPgetStationNum() != 0)
+    {
+        return false; // someone is using the web UI
+    }
+    if ((esp_reset_reason() != ESP_RST_DEEPSLEEP) && (millis() < MIN_AWAKE_AFTER_POWER_ON_MS))
+    {
+        return false;
+    }
+    return true;
+}
+
+// arms the RTC timer and closes the account of this awake period
+void dutyPrepareSleep(uint64_t sleepUs)
+{
+    dutyPhaseEnter(PHASE_SLEEP);
+    dutyReport();
+    dutyStats.sleepStartUs = wallClockUs();
+    esp_sleep_enable_timer_wakeup(sleepUs);
+}
+
+void dutyReport()
+{
+    uint64_t totalMs = 0;
+    uint64_t totalCharge = 0;
+
+    accountPhase(millis());
+    printf("phase      time s    est. mAh\n");
+    for (uint8_t i = 0; i < PHASE_COUNT; i++)
+    {
+        totalMs += dutyStats.timeMs[i];
+        totalCharge += dutyStats.charge[i];
+        printf("%-8s %8lu %11.3f\n", phaseNames[i], (unsigned long)(dutyStats.timeMs[i] / 1000ULL),
+               dutyStats.charge[i] / 36000000.0);
+    }
+    if (totalMs > 0)
+    {
+        printf("cycles %lu, average current %.2f mA\n", (unsigned long)dutyStats.cycles,
+               (double)totalCharge / (double)totalMs / 10.0);
+    }
+}
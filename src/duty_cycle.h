@@ -0,0 +1,48 @@
+// **************************************************************************************
+//    This header file handles duty_cycle.cpp data
+//    Wake / sample / publish / sleep duty cycle with CPU frequency scaling
+// **************************************************************************************
+#ifndef DUTY_CYCLE_H
+#define DUTY_CYCLE_H
+
+#include <Arduino.h>
+
+#define DUTY_CPU_BASE_MHZ 80   // lowest frequency that keeps WiFi running
+#define DUTY_CPU_BOOST_MHZ 240 // TLS material streaming, OTA writes, HTTP bursts
+
+extern uint64_t TIME_TO_SLEEP;
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum dutyPhase
+{
+    PHASE_WAKE = 0, // boot and modem bring-up
+    PHASE_SAMPLE,
+    PHASE_PUBLISH,
+    PHASE_IDLE, // awake, waiting for the next round
+    PHASE_SLEEP,
+    PHASE_COUNT
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void dutyBegin();
+void dutyPhaseEnter(dutyPhase phase);
+void dutyBoostBegin();
+void dutyBoostEnd();
+void dutyBusyBegin();
+void dutyBusyEnd();
+bool dutyIsBusy();
+bool dutySleepAllowed();
+void dutyPrepareSleep(uint64_t sleepUs);
+void dutyReport();
+
+#endif // DUTY_CYCLE_H
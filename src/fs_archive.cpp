@@ -0,0 +1,519 @@
+// **************************************************************************************
+//   This file streams the data partition as a ustar archive and restores one.
+//   Backup walks the root directory and produces the archive block by block inside the
+//   chunked response filler: a 512 byte header, the file data read straight into the
+//   response buffer, zero padding, and two zero blocks at the end. Memory use does not
+//   depend on the number or size of the files.
+//   Restore parses the uploaded archive as it arrives and writes every member into a
+//   temp file. Only after the whole archive was received and parsed are the temp files
+//   renamed over the live ones. The renames are listed in a journal first, so a reset in
+//   the middle is finished by archiveRecover() on the next boot; a restore that never
+//   got that far leaves the live files untouched and its temp files are removed.
+//   The journal is written under a temp name, closed with an end line that carries the
+//   pair count, and only then renamed into place: a journal cut short by a reset is
+//   never replayed, the restore is dropped as a whole instead.
+//   The partition is flat: directories and other member types are skipped.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include "fs_archive.h"
+#include "storage.h"
+#include "delta_ota.h"
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum restoreState
+{
+    RESTORE_IDLE = 0,
+    RESTORE_HEADER,
+    RESTORE_DATA,
+    RESTORE_PAD,
+    RESTORE_END, // zero block seen, anything after it is ignored
+    RESTORE_FAILED
+};
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+// backup, one at a time: the route is in the listing class
+static File backupDir;
+static File backupFile;
+static uint8_t backupBlock[ARCHIVE_BLOCK];
+static size_t backupBlockLen = 0;
+static size_t backupBlockSent = 0;
+static uint32_t backupFileLeft = 0;
+static uint32_t backupPadLeft = 0;
+static bool backupDone = false;
+
+// restore, one at a time: archiveRestoreBegin refuses a second one
+static restoreState restoreStage = RESTORE_IDLE;
+static uint8_t restoreBlock[ARCHIVE_BLOCK];
+static size_t restoreBlockLen = 0;
+static File restoreFile;
+static uint32_t restoreLeft = 0;
+static uint32_t restorePad = 0;
+static uint8_t restoreCount = 0;
+static char restoreNames[ARCHIVE_MAX_FILES][ARCHIVE_NAME_MAX + 1];
+static char restoreResult[64] = "";
+
+// **************************************************************************************
+//
+//                      Local Functions declaration
+//
+//
+// **************************************************************************************
+static const char *baseName(const char *name);
+static bool isInternalFile(const char *name);
+static void tempName(char *out, size_t size, uint8_t index);
+static uint32_t parseOctal(const uint8_t *field, size_t len);
+static uint32_t headerChecksum(const uint8_t *header);
+static void tarHeader(uint8_t *header, const char *name, uint32_t size);
+static bool backupNextFile();
+static void restoreFail(const char *reason, const char *detail);
+static void restoreRemoveTemps();
+static void restoreHeader();
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+// File::name() carries the leading '/' on older cores and not on newer ones
+static const char *baseName(const char *name)
+{
+    return (name[0] == '/') ? name + 1 : name;
+}
+
+// restore temp files, the journal and a pending delta patch are not part of a backup
+static bool isInternalFile(const char *name)
+{
+    return (name[0] == '~') || (strcmp(name, baseName(DELTA_PATCH_FILE)) == 0);
+}
+
+static void tempName(char *out, size_t size, uint8_t index)
+{
+    snprintf(out, size, ARCHIVE_TEMP_FORMAT, (unsigned)index);
+}
+
+static uint32_t parseOctal(const uint8_t *field, size_t len)
+{
+    uint32_t value = 0;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((field[i] >= '0') && (field[i] <= '7'))
+        {
+            value = (value << 3) | (field[i] - '0');
+        }
+        else if (field[i] != ' ')
+        {
+            break;
+        }
+    }
+    return value;
+}
+
+// sum of the header bytes with the checksum field itself read as spaces
+static uint32_t headerChecksum(const uint8_t *header)
+{
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < ARCHIVE_BLOCK; i++)
+    {
+        sum += ((i >= 148) && (i < 156)) ? ' ' : header[i];
+    }
+    return sum;
+}
+
+static void tarHeader(uint8_t *header, const char *name, uint32_t size)
+{
+    memset(header, 0, ARCHIVE_BLOCK);
+    strlcpy((char *)header, name, 100);
+    memcpy(&header[100], "0000644", 8); // mode
+    memcpy(&header[108], "0000000", 8); // uid
+    memcpy(&header[116], "0000000", 8); // gid
+    snprintf((char *)&header[124], 12, "%011lo", (unsigned long)size);
+    memcpy(&header[136], "00000000000", 12); // mtime, the partition keeps none
+    header[156] = '0';
+    memcpy(&header[257], "ustar", 6);
+    memcpy(&header[263], "00", 2);
+    snprintf((char *)&header[148], 8, "%06lo", (unsigned long)headerChecksum(header));
+    header[155] = ' ';
+}
+
+// opens the next regular file and queues its header, false when the listing is done
+static bool backupNextFile()
+{
+    for (;;)
+    {
+        backupFile = backupDir.openNextFile();
+        if (!backupFile)
+        {
+            return false;
+        }
+        const char *name = baseName(backupFile.name());
+        if (backupFile.isDirectory() || isInternalFile(name))
+        {
+            backupFile.close();
+            continue;
+        }
+        tarHeader(backupBlock, name, backupFile.size());
+        backupBlockLen = ARCHIVE_BLOCK;
+        backupBlockSent = 0;
+        backupFileLeft = backupFile.size();
+        backupPadLeft = (ARCHIVE_BLOCK - backupFileLeft % ARCHIVE_BLOCK) % ARCHIVE_BLOCK;
+        return true;
+    }
+}
+
+// detail may be NULL
+static void restoreFail(const char *reason, const char *detail)
+{
+    snprintf(restoreResult, sizeof(restoreResult), "%s%s%s", reason, detail ? ": " : "", detail ? detail : "");
+    restoreStage = RESTORE_FAILED;
+    restoreFile.close();
+    restoreRemoveTemps();
+}
+
+static void restoreRemoveTemps()
+{
+    char name[ARCHIVE_NAME_MAX + 1];
+
+    for (uint8_t i = 0; i < ARCHIVE_MAX_FILES; i++)
+    {
+        tempName(name, sizeof(name), i);
+        if (storageExists(name))
+        {
+            storageRemove(name);
+        }
+    }
+}
+
+// a complete header block is in restoreBlock
+static void restoreHeader()
+{
+    char name[101];
+    char temp[ARCHIVE_NAME_MAX + 1];
+    bool allZero = true;
+
+    for (size_t i = 0; i < ARCHIVE_BLOCK; i++)
+    {
+        if (restoreBlock[i] != 0)
+        {
+            allZero = false;
+            break;
+        }
+    }
+    if (allZero)
+    {
+        restoreStage = RESTORE_END;
+        return;
+    }
+    if (parseOctal(&restoreBlock[148], 8) != headerChecksum(restoreBlock))
+    {
+        restoreFail("bad header checksum", NULL);
+        return;
+    }
+    restoreLeft = parseOctal(&restoreBlock[124], 12);
+    restorePad = (ARCHIVE_BLOCK - restoreLeft % ARCHIVE_BLOCK) % ARCHIVE_BLOCK;
+    restoreStage = RESTORE_DATA;
+
+    // anything but a regular file (directories, pax headers, links) is skipped
+    if ((restoreBlock[156] != '0') && (restoreBlock[156] != '\0'))
+    {
+        return;
+    }
+    memcpy(name, restoreBlock, 100);
+    name[100] = '\0';
+    const char *base = name;
+    if (strncmp(base, "./", 2) == 0)
+    {
+        base += 2;
+    }
+    base = baseName(base);
+    if ((restoreBlock[345] != '\0') || (strchr(base, '/') != NULL) || (strlen(base) + 1 > ARCHIVE_NAME_MAX))
+    {
+        restoreFail("not a flat file name", base);
+        return;
+    }
+    if (restoreCount >= ARCHIVE_MAX_FILES)
+    {
+        restoreFail("too many files", base);
+        return;
+    }
+    snprintf(restoreNames[restoreCount], sizeof(restoreNames[0]), "/%s", base);
+    tempName(temp, sizeof(temp), restoreCount);
+    restoreFile = storageOpen(temp, "w");
+    if (!restoreFile)
+    {
+        restoreFail("cannot create a temp file", base);
+        return;
+    }
+    restoreCount++;
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+// run once after mounting: finishes a commit cut short by a reset, drops unfinished restores
+void archiveRecover()
+{
+    File journal = storageOpen(ARCHIVE_JOURNAL_FILE, "r");
+    char line[2 * (ARCHIVE_NAME_MAX + 1)];
+    unsigned pairs = 0;
+    bool complete = false;
+
+    if (storageExists(ARCHIVE_JOURNAL_TEMP))
+    {
+        storageRemove(ARCHIVE_JOURNAL_TEMP); // reset while the journal was written, nothing renamed yet
+    }
+    // the journal only counts when its end line matches the pairs before it
+    while (journal && journal.available())
+    {
+        size_t len = journal.readBytesUntil('\n', line, sizeof(line) - 1);
+        unsigned count;
+        line[len] = '\0';
+        if (sscanf(line, ARCHIVE_JOURNAL_END " %u", &count) == 1)
+        {
+            complete = (count == pairs) && !journal.available();
+            break;
+        }
+        pairs++;
+    }
+    if (journal && !complete)
+    {
+        Serial.println("Restore: incomplete journal dropped, live files kept");
+        journal.close();
+        journal = File();
+        storageRemove(ARCHIVE_JOURNAL_FILE);
+    }
+    if (journal)
+    {
+        journal.seek(0);
+        while (journal.available())
+        {
+            size_t len = journal.readBytesUntil('\n', line, sizeof(line) - 1);
+            line[len] = '\0';
+            char *final = strchr(line, ' ');
+            if (final == NULL)
+            {
+                continue;
+            }
+            *final++ = '\0';
+            if ((strcmp(line, ARCHIVE_JOURNAL_END) != 0) && storageExists(line))
+            {
+                storageRemove(final);
+                storageRename(line, final);
+                Serial.printf("Restore: recovered %s\r\n", final);
+            }
+        }
+        journal.close();
+        storageRemove(ARCHIVE_JOURNAL_FILE);
+    }
+    restoreRemoveTemps();
+}
+
+void archiveBackupBegin()
+{
+    backupFile.close();
+    backupDir.close(); // a backup cut short by its client leaves the handles open
+    backupDir = storageOpen("/", "r");
+    backupBlockLen = 0;
+    backupBlockSent = 0;
+    backupFileLeft = 0;
+    backupPadLeft = 0;
+    backupDone = false;
+}
+
+// chunked response filler, 0 ends the response
+size_t archiveBackupRead(uint8_t *buffer, size_t maxLen)
+{
+    size_t written = 0;
+
+    while (written < maxLen)
+    {
+        size_t part;
+
+        if (backupBlockSent < backupBlockLen)
+        {
+            part = min(backupBlockLen - backupBlockSent, maxLen - written);
+            memcpy(buffer + written, backupBlock + backupBlockSent, part);
+            backupBlockSent += part;
+        }
+        else if (backupFileLeft > 0)
+        {
+            part = min((size_t)backupFileLeft, maxLen - written);
+            size_t got = backupFile.read(buffer + written, part);
+            if (got < part)
+            {
+                memset(buffer + written + got, 0, part - got); // shrank under us, keep the size we announced
+            }
+            backupFileLeft -= part;
+        }
+        else if (backupPadLeft > 0)
+        {
+            part = min((size_t)backupPadLeft, maxLen - written);
+            memset(buffer + written, 0, part);
+            backupPadLeft -= part;
+        }
+        else
+        {
+            backupFile.close();
+            if (backupDone)
+            {
+                break;
+            }
+            if (!backupNextFile())
+            {
+                // end of archive, two zero blocks
+                memset(backupBlock, 0, ARCHIVE_BLOCK);
+                backupBlockLen = ARCHIVE_BLOCK;
+                backupBlockSent = 0;
+                backupPadLeft = ARCHIVE_BLOCK;
+                backupDone = true;
+                backupDir.close();
+            }
+            continue;
+        }
+        written += part;
+    }
+    return written;
+}
+
+bool archiveRestoreBegin()
+{
+    if ((restoreStage != RESTORE_IDLE) && (restoreStage != RESTORE_FAILED))
+    {
+        return false;
+    }
+    restoreRemoveTemps();
+    restoreStage = RESTORE_HEADER;
+    restoreBlockLen = 0;
+    restoreCount = 0;
+    restoreResult[0] = '\0';
+    return true;
+}
+
+// upload chunks in order, parsed as they come
+void archiveRestoreWrite(const uint8_t *data, size_t len)
+{
+    while ((len > 0) && (restoreStage != RESTORE_FAILED) && (restoreStage != RESTORE_END))
+    {
+        size_t part;
+
+        if (restoreStage == RESTORE_HEADER)
+        {
+            part = min(len, ARCHIVE_BLOCK - restoreBlockLen);
+            memcpy(restoreBlock + restoreBlockLen, data, part);
+            restoreBlockLen += part;
+            if (restoreBlockLen == ARCHIVE_BLOCK)
+            {
+                restoreBlockLen = 0;
+                restoreHeader();
+            }
+        }
+        else if (restoreStage == RESTORE_DATA)
+        {
+            part = min(len, (size_t)restoreLeft);
+            if (restoreFile && (storageWrite(restoreFile, data, part) != part))
+            {
+                restoreFail("out of space", NULL);
+                return;
+            }
+            restoreLeft -= part;
+        }
+        else
+        {
+            part = min(len, (size_t)restorePad);
+            restorePad -= part;
+        }
+        data += part;
+        len -= part;
+
+        if ((restoreStage == RESTORE_DATA) && (restoreLeft == 0))
+        {
+            restoreFile.close();
+            restoreStage = RESTORE_PAD;
+        }
+        if ((restoreStage == RESTORE_PAD) && (restorePad == 0))
+        {
+            restoreStage = RESTORE_HEADER;
+        }
+    }
+}
+
+// commits the restored files when the whole archive was good, see archiveRecover()
+bool archiveRestoreEnd()
+{
+    char temp[ARCHIVE_NAME_MAX + 1];
+
+    if ((restoreStage == RESTORE_HEADER) && (restoreBlockLen == 0) && (restoreCount > 0))
+    {
+        restoreStage = RESTORE_END; // archive without the trailing zero blocks
+    }
+    if (restoreStage != RESTORE_END)
+    {
+        if (restoreStage != RESTORE_FAILED)
+        {
+            restoreFail("archive truncated", NULL);
+        }
+        return false;
+    }
+
+    File journal = storageOpen(ARCHIVE_JOURNAL_TEMP, "w");
+    bool written = (bool)journal;
+    for (uint8_t i = 0; written && (i < restoreCount); i++)
+    {
+        tempName(temp, sizeof(temp), i);
+        written = (journal.printf("%s %s\n", temp, restoreNames[i]) > 0);
+    }
+    written = written && (journal.printf(ARCHIVE_JOURNAL_END " %u\n", (unsigned)restoreCount) > 0);
+    if (journal)
+    {
+        journal.close();
+    }
+    // the rename is the commit point, before it a reset keeps the live files
+    if (!written || !storageRename(ARCHIVE_JOURNAL_TEMP, ARCHIVE_JOURNAL_FILE))
+    {
+        storageRemove(ARCHIVE_JOURNAL_TEMP);
+        restoreFail("out of space", NULL);
+        return false;
+    }
+
+    for (uint8_t i = 0; i < restoreCount; i++)
+    {
+        tempName(temp, sizeof(temp), i);
+        storageRemove(restoreNames[i]);
+        storageRename(temp, restoreNames[i]);
+    }
+    storageRemove(ARCHIVE_JOURNAL_FILE);
+    snprintf(restoreResult, sizeof(restoreResult), "Restored %u files", (unsigned)restoreCount);
+    restoreStage = RESTORE_IDLE;
+    return true;
+}
+
+// the upload went away before archiveRestoreEnd(), nothing of it is kept
+void archiveRestoreAbort()
+{
+    if ((restoreStage == RESTORE_IDLE) || (restoreStage == RESTORE_FAILED))
+    {
+        return;
+    }
+    restoreFail("upload aborted", NULL);
+}
+
+const char *archiveRestoreResult()
+{
+    return restoreResult;
+}
@@ -0,0 +1,33 @@
+// **************************************************************************************
+//    This header file handles fs_archive.cpp data
+//    Whole filesystem backup and restore as a streamed tar archive
+// **************************************************************************************
+#ifndef FS_ARCHIVE_H
+#define FS_ARCHIVE_H
+
+#include <Arduino.h>
+
+#define ARCHIVE_BLOCK 512
+#define ARCHIVE_MAX_FILES 32
+#define ARCHIVE_NAME_MAX 31                   // SPIFFS object names, leading '/' included
+#define ARCHIVE_TEMP_FORMAT "/~r%02u"         // restored files until the commit
+#define ARCHIVE_JOURNAL_FILE "/~restore.lst"  // temp / final pairs while the commit runs
+#define ARCHIVE_JOURNAL_TEMP "/~restore.new"  // journal being written, renamed once complete
+#define ARCHIVE_JOURNAL_END "end"             // last journal line, followed by the pair count
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void archiveRecover();
+void archiveBackupBegin();
+size_t archiveBackupRead(uint8_t *buffer, size_t maxLen);
+bool archiveRestoreBegin();
+void archiveRestoreWrite(const uint8_t *data, size_t len);
+bool archiveRestoreEnd();
+void archiveRestoreAbort();
+const char *archiveRestoreResult();
+
+#endif // FS_ARCHIVE_H
@@ -0,0 +1,190 @@
+// **************************************************************************************
+//   This file maps the numeric operator of the serving network (AT+COPS=3,2) to the
+//   APN and credentials for the PDP context. The table is a sorted array searched
+//   with bsearch; it starts from the built-in entries below and is extended or
+//   overridden by /apn.csv on the data partition, one "mccmnc,apn,user,password,auth" per
+//   line. auth is none, pap or chap; left out it is pap when a user is given, else none.
+//   The M95 negotiates PAP / CHAP on its own (AT+QICSGP takes no auth type), so the
+//   column decides whether the credentials are sent at all.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include "gsm_apn.h"
+#include "storage.h"
+#include "boot.h"
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+#define APN_LINE_MAX 100
+
+static const apnEntry_t builtinApns[] = {
+    {41001, "wap.mobilinkworld.com", "", "", APN_AUTH_NONE}, // Jazz
+    {41003, "ufone.internet", "", "", APN_AUTH_NONE},        // Ufone
+    {41004, "zonginternet", "", "", APN_AUTH_NONE},          // Zong
+    {41006, "internet", "", "", APN_AUTH_NONE},              // Telenor
+};
+
+static const char *authNames[] = {"none", "pap", "chap"};
+
+static apnEntry_t apnTable[APN_TABLE_MAX];
+static uint8_t apnCount = 0;
+static bool apnLoaded = false;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static int apnCompare(const void *a, const void *b)
+{
+    uint32_t keyA = ((const apnEntry_t *)a)->mccmnc;
+    uint32_t keyB = ((const apnEntry_t *)b)->mccmnc;
+    return (keyA > keyB) - (keyA < keyB);
+}
+
+// copy one comma separated field, returns pointer past the separator
+static const char *apnField(const char *src, char *dst, size_t size)
+{
+    size_t n = 0;
+    while ((*src != '\0') && (*src != ',') && (*src != '\r') && (*src != '\n'))
+    {
+        if (n + 1 < size)
+        {
+            dst[n++] = *src;
+        }
+        src++;
+    }
+    dst[n] = '\0';
+    return (*src == ',') ? src + 1 : src;
+}
+
+static apnAuth apnParseAuth(const char *text, const apnEntry_t *entry)
+{
+    for (uint8_t i = 0; i < sizeof(authNames) / sizeof(authNames[0]); i++)
+    {
+        if (strcasecmp(text, authNames[i]) == 0)
+        {
+            return (apnAuth)i;
+        }
+    }
+    return (entry->user[0] != '\0') ? APN_AUTH_PAP : APN_AUTH_NONE;
+}
+
+// true when the whole line fit; an over-long line is consumed up to its end and dropped
+static bool apnReadLine(File &file, char *line, size_t size)
+{
+    size_t len = file.readBytesUntil('\n', line, size - 1);
+    int next;
+
+    line[len] = '\0';
+    if (len < size - 1)
+    {
+        return true;
+    }
+    next = file.peek();
+    if ((next == '\n') || (next == '\r') || (next < 0))
+    {
+        (void)file.read(); // exactly full, only the terminator is left
+        return true;
+    }
+    while (file.available() && (file.read() != '\n'))
+    {
+    }
+    return false;
+}
+
+static void apnInsert(const apnEntry_t *entry)
+{
+    for (uint8_t i = 0; i < apnCount; i++)
+    {
+        if (apnTable[i].mccmnc == entry->mccmnc)
+        {
+            apnTable[i] = *entry; // file entries override the built-in ones
+            return;
+        }
+    }
+    if (apnCount < APN_TABLE_MAX)
+    {
+        apnTable[apnCount++] = *entry;
+    }
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+uint8_t apnTableLoad()
+{
+    char line[APN_LINE_MAX];
+    char key[8];
+    char auth[8];
+    apnEntry_t entry;
+    const char *p;
+
+    apnCount = 0;
+    for (uint8_t i = 0; i < sizeof(builtinApns) / sizeof(builtinApns[0]); i++)
+    {
+        apnInsert(&builtinApns[i]);
+    }
+
+    File file = storageOpen(APN_TABLE_FILE, "r");
+    if (file)
+    {
+        while (file.available())
+        {
+            if (!apnReadLine(file, line, sizeof(line)))
+            {
+                printf("APN table: line longer than %u characters skipped\n", APN_LINE_MAX - 1);
+                continue;
+            }
+            if ((line[0] == '\0') || (line[0] == '\r') || (line[0] == '#'))
+            {
+                continue;
+            }
+            memset(&entry, 0, sizeof(entry));
+            p = apnField(line, key, sizeof(key));
+            p = apnField(p, entry.apn, sizeof(entry.apn));
+            p = apnField(p, entry.user, sizeof(entry.user));
+            p = apnField(p, entry.password, sizeof(entry.password));
+            (void)apnField(p, auth, sizeof(auth));
+            entry.auth = apnParseAuth(auth, &entry);
+            entry.mccmnc = strtoul(key, NULL, 10);
+            if ((entry.mccmnc != 0) && (entry.apn[0] != '\0'))
+            {
+                apnInsert(&entry);
+            }
+        }
+        file.close();
+    }
+
+    qsort(apnTable, apnCount, sizeof(apnTable[0]), apnCompare);
+    // read before the data partition was mounted: built-in table only, load again next lookup
+    apnLoaded = bootWait(BOOT_BIT(BOOT_FS), 0);
+    printf("APN table: %u operators\n", apnCount);
+    return apnCount;
+}
+
+const apnEntry_t *apnLookup(uint32_t mccmnc)
+{
+    apnEntry_t key;
+
+    if (apnLoaded == false)
+    {
+        (void)apnTableLoad();
+    }
+    key.mccmnc = mccmnc;
+    return (const apnEntry_t *)bsearch(&key, apnTable, apnCount, sizeof(apnTable[0]), apnCompare);
+}
+
+const char *apnAuthName(apnAuth auth)
+{
+    return authNames[auth];
+}
@@ -0,0 +1,45 @@
+// **************************************************************************************
+//    This header file handles gsm_apn.cpp data
+//    Operator (MCC-MNC) to APN lookup table
+// **************************************************************************************
+#ifndef GSM_APN_H
+#define GSM_APN_H
+
+#include <Arduino.h>
+
+#define APN_TABLE_FILE "/apn.csv"
+#define APN_TABLE_MAX 32
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum apnAuth
+{
+    APN_AUTH_NONE = 0, // APN only, no credentials sent
+    APN_AUTH_PAP,
+    APN_AUTH_CHAP
+};
+
+typedef struct
+{
+    uint32_t mccmnc; // e.g. 41006, 3 digit MNCs give 6 digit keys
+    char apn[40];
+    char user[16];
+    char password[16];
+    apnAuth auth;
+} apnEntry_t;
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+uint8_t apnTableLoad();
+const apnEntry_t *apnLookup(uint32_t mccmnc);
+const char *apnAuthName(apnAuth auth);
+
+#endif // GSM_APN_H
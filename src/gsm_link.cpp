@@ -0,0 +1,180 @@
+// **************************************************************************************
+//   This file keeps a sampled model of the cellular link: AT+CSQ RSSI smoothed with an
+//   EWMA, plus the last AT+CREG registration status. The session bring-up (before TLS,
+//   PDP and MQTT) and the publish path ask it whether to proceed, batch or defer, so that
+//   we do not burn minutes of radio time on TLS handshakes and QMTOPEN retries at poor
+//   signal. The maximum deferral comes from the config store.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include "gsm_link.h"
+
+// thresholds in dBm, with hysteresis between entering and leaving each band
+#define POOR_ENTER_DBM -101 // CSQ 6
+#define POOR_LEAVE_DBM -95  // CSQ 9
+#define GOOD_ENTER_DBM -83  // CSQ 15
+#define GOOD_LEAVE_DBM -89  // CSQ 12
+#define EWMA_SHIFT 2        // new sample weight 1/4
+#define SAMPLE_MAX_AGE_MS (10UL * 60UL * 1000UL)
+#define DEFAULT_MAX_DEFER_MS (30UL * 60UL * 1000UL)
+#define BATCH_SIZE 4
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static int32_t rssiAvgQ4 = 0; // smoothed dBm, Q4 fixed point
+static bool rssiValid = false;
+static bool registered = false;
+static unsigned long lastSampleTime = 0;
+static unsigned long deferStartTime = 0;
+static unsigned long maxDeferralMs = DEFAULT_MAX_DEFER_MS;
+static enum linkQuality quality = LINK_GOOD;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static void updateQuality()
+{
+    int16_t dbm = linkGetDbm();
+
+    if (registered == false)
+    {
+        quality = LINK_POOR;
+        return;
+    }
+    switch (quality)
+    {
+    case LINK_POOR:
+        if (dbm >= GOOD_ENTER_DBM)
+        {
+            quality = LINK_GOOD;
+        }
+        else if (dbm >= POOR_LEAVE_DBM)
+        {
+            quality = LINK_MARGINAL;
+        }
+        break;
+
+    case LINK_MARGINAL:
+        if (dbm < POOR_ENTER_DBM)
+        {
+            quality = LINK_POOR;
+        }
+        else if (dbm >= GOOD_ENTER_DBM)
+        {
+            quality = LINK_GOOD;
+        }
+        break;
+
+    case LINK_GOOD:
+    default:
+        if (dbm < POOR_ENTER_DBM)
+        {
+            quality = LINK_POOR;
+        }
+        else if (dbm < GOOD_LEAVE_DBM)
+        {
+            quality = LINK_MARGINAL;
+        }
+        break;
+    }
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+
+// AT+CSQ rssi 0..31 maps to -113..-51 dBm, 99 is unknown and ignored
+void linkSampleCSQ(int32_t rssi)
+{
+    int32_t dbmQ4;
+
+    if ((rssi < 0) || (rssi > 31))
+    {
+        return;
+    }
+    dbmQ4 = (int32_t)(-113 + (2 * rssi)) * 16;
+    if (rssiValid == false || ((millis() - lastSampleTime) > SAMPLE_MAX_AGE_MS))
+    {
+        rssiAvgQ4 = dbmQ4; // first or stale sample, restart the average
+    }
+    else
+    {
+        rssiAvgQ4 += (dbmQ4 - rssiAvgQ4) / (1 << EWMA_SHIFT);
+    }
+    rssiValid = true;
+    lastSampleTime = millis();
+    updateQuality();
+    printf("CSQ %ld -> %ld dBm, avg %d dBm, quality %d\n", (long)rssi, (long)(-113 + (2 * rssi)), linkGetDbm(), quality);
+}
+
+// AT+CREG stat: 1 home and 5 roaming are registered, negative when not reported
+void linkSampleCREG(int32_t stat)
+{
+    if (stat < 0)
+    {
+        return;
+    }
+    registered = (stat == 1) || (stat == 5);
+    updateQuality();
+}
+
+linkQuality linkGetQuality()
+{
+    return quality;
+}
+
+int16_t linkGetDbm()
+{
+    return rssiValid ? (int16_t)(rssiAvgQ4 / 16) : -113;
+}
+
+linkDecision linkDecide(uint8_t pendingReadings)
+{
+    linkDecision decision;
+
+    if (deferStartTime == 0)
+    {
+        deferStartTime = millis();
+    }
+    if (pendingReadings >= LINK_BATCH_MAX || (millis() - deferStartTime) >= maxDeferralMs)
+    {
+        return LINK_PROCEED; // queue full or held long enough, send whatever the link
+    }
+    switch (quality)
+    {
+    case LINK_POOR:
+        decision = LINK_DEFER;
+        break;
+
+    case LINK_MARGINAL:
+        decision = (pendingReadings + 1 >= BATCH_SIZE) ? LINK_PROCEED : LINK_BATCH;
+        break;
+
+    case LINK_GOOD:
+    default:
+        decision = LINK_PROCEED;
+        break;
+    }
+    return decision;
+}
+
+// restart the deferral window once the pending readings went out
+void linkPublished()
+{
+    deferStartTime = 0;
+}
+
+void linkSetMaxDeferral(unsigned long maxDeferMs)
+{
+    maxDeferralMs = maxDeferMs;
+}
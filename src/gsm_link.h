@@ -0,0 +1,47 @@
+// **************************************************************************************
+//    This header file handles gsm_link.cpp data
+//    Sampled link-quality model used to schedule cellular transmissions
+// **************************************************************************************
+#ifndef GSM_LINK_H
+#define GSM_LINK_H
+
+#include <Arduino.h>
+
+// readings kept while the link is deferred or batched
+#define LINK_BATCH_MAX 8
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum linkQuality
+{
+    LINK_POOR = 0,
+    LINK_MARGINAL,
+    LINK_GOOD
+};
+
+enum linkDecision
+{
+    LINK_PROCEED = 0, // publish now
+    LINK_BATCH,       // queue this reading, publish once the batch is full
+    LINK_DEFER        // hold everything until the link recovers or max deferral is hit
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void linkSampleCSQ(int32_t rssi);
+void linkSampleCREG(int32_t stat);
+linkQuality linkGetQuality();
+int16_t linkGetDbm();
+linkDecision linkDecide(uint8_t pendingReadings);
+void linkPublished();
+void linkSetMaxDeferral(unsigned long maxDeferMs);
+
+#endif // GSM_LINK_H
@@ -0,0 +1,363 @@
+// **************************************************************************************
+//   This file updates the firmware over the cellular link, using the HTTP client of the
+//   M95 (AT+QHTTPURL / AT+QHTTPGET / AT+QHTTPREAD) on the PDP context the MQTT session
+//   already runs on.
+//   GSM_OTA_MANIFEST_URL answers with one line "<size> <md5> <image url>". When the MD5
+//   differs from the running sketch the image is fetched in GSM_OTA_CHUNK_SIZE pieces,
+//   each one its own request "<image url>?offset=<n>&length=<m>" (tools/ota_server
+//   serves that). QHTTPREAD hands over the whole body at once, so the request size is
+//   the flow control: a chunk is read from the UART into RAM first and only written to
+//   flash when the modem is quiet, no sector erase can stall the UART mid-transfer.
+//   The state machine calls gsmOtaRound() after every successful publish, one round
+//   fetches at most GSM_OTA_CHUNKS_PER_ROUND chunks, so publishing keeps its rhythm.
+//   A failed chunk is fetched again from the same offset in the next round; the device
+//   stays awake (dutyBusyBegin) until the image is complete, since Update cannot resume
+//   after a reset. Update checks the manifest MD5 before it marks the slot bootable.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <Update.h>
+#include "gsm.h"
+#include "gsm_ota.h"
+#include "duty_cycle.h"
+#include "ota_owner.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define HTTP_URL_TIMEOUT_S 30  // AT+QHTTPURL input time
+#define HTTP_GET_TIMEOUT_S 60  // AT+QHTTPGET response time
+#define HTTP_READ_TIMEOUT_S 30 // AT+QHTTPREAD wait time
+#define LINE_TIMEOUT_MS 5000
+#define BODY_IDLE_TIMEOUT_MS 3000 // silence in the middle of a body means the transfer broke
+#define LINE_MAX 64
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+RTC_DATA_ATTR static uint8_t roundsSinceCheck = GSM_OTA_CHECK_ROUNDS - 1; // first round after power on checks
+RTC_DATA_ATTR static char rejectedMd5[33];                                 // image that failed verification
+
+static gsmOtaState state = GSM_OTA_IDLE;
+static const char *failReason = "";
+static char imageUrl[GSM_OTA_URL_MAX];
+static char imageMd5[33];
+static uint32_t imageSize = 0;
+static uint32_t offset = 0;
+static uint8_t chunkFailures = 0;
+static uint32_t retries = 0;
+static uint32_t downloadMs = 0;
+static uint8_t chunk[GSM_OTA_CHUNK_SIZE]; // state machine task only
+
+static const char *stateNames[GSM_OTA_STATES] = {"idle", "downloading", "done", "failed"};
+
+// **************************************************************************************
+//
+//                      Local Functions declaration
+//
+//
+// **************************************************************************************
+static void drainInput();
+static bool readLine(char *line, size_t size, unsigned long timeout);
+static bool waitFor(const char *expect, unsigned long timeout);
+static bool readBody(uint8_t *out, size_t len);
+static bool httpGet(const char *url);
+static bool checkManifest();
+static bool fetchChunk(uint32_t at, uint32_t len);
+static void downloadFail(const char *reason);
+static bool downloadRound();
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static void drainInput()
+{
+    while (GSM.available() > 0)
+    {
+        (void)GSM.read();
+    }
+}
+
+// one CR LF terminated line without the terminator, empty lines are skipped
+static bool readLine(char *line, size_t size, unsigned long timeout)
+{
+    unsigned long startTime = millis();
+    size_t len = 0;
+
+    while (millis() - startTime < timeout)
+    {
+        if (GSM.available() <= 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(5));
+            continue;
+        }
+        char c = GSM.read();
+        if (c == '\n')
+        {
+            if (len > 0)
+            {
+                line[len] = '\0';
+                return true;
+            }
+        }
+        else if ((c != '\r') && (len < size - 1))
+        {
+            line[len++] = c;
+        }
+    }
+    return false;
+}
+
+// skips echo and URCs until the expected line; false on ERROR / +CME ERROR / timeout
+static bool waitFor(const char *expect, unsigned long timeout)
+{
+    unsigned long startTime = millis();
+    char line[LINE_MAX];
+
+    while (readLine(line, sizeof(line), timeout - min(timeout, millis() - startTime)))
+    {
+        if (strncmp(line, expect, strlen(expect)) == 0)
+        {
+            return true;
+        }
+        if ((strcmp(line, "ERROR") == 0) || (strncmp(line, "+CME ERROR", 10) == 0))
+        {
+            printf("Cellular OTA: %s\n", line);
+            return false;
+        }
+    }
+    return false;
+}
+
+// exactly len raw bytes, as long as they keep coming
+static bool readBody(uint8_t *out, size_t len)
+{
+    unsigned long lastByte = millis();
+    size_t got = 0;
+
+    while (got < len)
+    {
+        int available = GSM.available();
+        if (available <= 0)
+        {
+            if (millis() - lastByte > BODY_IDLE_TIMEOUT_MS)
+            {
+                return false;
+            }
+            vTaskDelay(pdMS_TO_TICKS(2));
+            continue;
+        }
+        got += GSM.readBytes(&out[got], min((size_t)available, len - got));
+        lastByte = millis();
+    }
+    return true;
+}
+
+static bool httpGet(const char *url)
+{
+    char command[32];
+
+    drainInput();
+    snprintf(command, sizeof(command), "AT+QHTTPURL=%u,%u\r\n", (unsigned)strlen(url), HTTP_URL_TIMEOUT_S);
+    GSM.print(command);
+    if (!waitFor("CONNECT", LINE_TIMEOUT_MS))
+    {
+        return false;
+    }
+    GSM.print(url);
+    if (!waitFor("OK", LINE_TIMEOUT_MS))
+    {
+        return false;
+    }
+    snprintf(command, sizeof(command), "AT+QHTTPGET=%u\r\n", HTTP_GET_TIMEOUT_S);
+    GSM.print(command);
+    return waitFor("OK", (HTTP_GET_TIMEOUT_S + 5) * 1000UL);
+}
+
+// true when a new image is announced and Update is ready for it
+static bool checkManifest()
+{
+#ifdef GSM_OTA_MANIFEST_URL
+    char line[GSM_OTA_URL_MAX + 48];
+    char format[24];
+    unsigned long size = 0;
+
+    if (!httpGet(GSM_OTA_MANIFEST_URL))
+    {
+        Serial.println("Cellular OTA: manifest not reachable");
+        return false;
+    }
+    GSM.printf("AT+QHTTPREAD=%u\r\n", HTTP_READ_TIMEOUT_S);
+    if (!waitFor("CONNECT", LINE_TIMEOUT_MS) || !readLine(line, sizeof(line), LINE_TIMEOUT_MS) ||
+        !waitFor("OK", LINE_TIMEOUT_MS))
+    {
+        Serial.println("Cellular OTA: manifest read failed");
+        return false;
+    }
+    snprintf(format, sizeof(format), "%%lu %%32s %%%us", (unsigned)sizeof(imageUrl) - 1);
+    if ((sscanf(line, format, &size, imageMd5, imageUrl) != 3) || (strlen(imageMd5) != 32) || (size == 0))
+    {
+        printf("Cellular OTA: bad manifest \"%s\"\n", line);
+        return false;
+    }
+    for (uint8_t i = 0; i < 32; i++)
+    {
+        imageMd5[i] = tolower(imageMd5[i]);
+    }
+    if ((strcmp(imageMd5, ESP.getSketchMD5().c_str()) == 0) || (strcmp(imageMd5, rejectedMd5) == 0))
+    {
+        return false; // running it already, or it did not verify last time
+    }
+    if (!otaOwnerAcquire(OTA_OWNER_CELLULAR))
+    {
+        printf("Cellular OTA: update slot held by the %s\n", otaOwnerName());
+        return false;
+    }
+    if (!Update.begin(size))
+    {
+        otaOwnerRelease(OTA_OWNER_CELLULAR);
+        Serial.println("Cellular OTA: update slot too small");
+        return false;
+    }
+    Update.setMD5(imageMd5);
+    imageSize = size;
+    offset = 0;
+    chunkFailures = 0;
+    retries = 0;
+    downloadMs = 0;
+    failReason = "";
+    state = GSM_OTA_DOWNLOADING;
+    dutyBusyBegin(); // no deep sleep until the image is complete
+    printf("Cellular OTA: %lu byte image %s\n", size, imageMd5);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// the server answers with exactly len bytes, anything else is a broken transfer
+static bool fetchChunk(uint32_t at, uint32_t len)
+{
+    char url[GSM_OTA_URL_MAX + 40];
+    uint8_t trailer[6];
+
+    snprintf(url, sizeof(url), "%s%coffset=%lu&length=%lu", imageUrl, (strchr(imageUrl, '?') != NULL) ? '&' : '?',
+             (unsigned long)at, (unsigned long)len);
+    if (!httpGet(url))
+    {
+        return false;
+    }
+    GSM.printf("AT+QHTTPREAD=%u\r\n", HTTP_READ_TIMEOUT_S);
+    if (!waitFor("CONNECT", LINE_TIMEOUT_MS) || !readBody(chunk, len))
+    {
+        return false;
+    }
+    // a longer body (server ignoring the range) shows up here instead of the final result
+    return readBody(trailer, sizeof(trailer)) && (memcmp(trailer, "\r\nOK\r\n", sizeof(trailer)) == 0);
+}
+
+static void downloadFail(const char *reason)
+{
+    Update.abort();
+    otaOwnerRelease(OTA_OWNER_CELLULAR);
+    failReason = reason;
+    state = GSM_OTA_FAILED;
+    dutyBusyEnd();
+    printf("Cellular OTA failed at %lu of %lu bytes: %s\n", (unsigned long)offset, (unsigned long)imageSize, reason);
+}
+
+// true once the whole image is written and verified
+static bool downloadRound()
+{
+    unsigned long startTime = millis();
+
+    for (uint8_t i = 0; (i < GSM_OTA_CHUNKS_PER_ROUND) && (offset < imageSize); i++)
+    {
+        uint32_t len = min((uint32_t)GSM_OTA_CHUNK_SIZE, imageSize - offset);
+        if (!fetchChunk(offset, len))
+        {
+            retries++;
+            downloadMs += millis() - startTime;
+            if (++chunkFailures >= GSM_OTA_CHUNK_RETRIES)
+            {
+                downloadFail("download keeps failing");
+            }
+            return false; // resumes at this offset next round
+        }
+        if (Update.write(chunk, len) != len)
+        {
+            downloadFail(Update.errorString());
+            return false;
+        }
+        offset += len;
+        chunkFailures = 0;
+    }
+    downloadMs += millis() - startTime;
+    printf("Cellular OTA: %lu of %lu bytes\n", (unsigned long)offset, (unsigned long)imageSize);
+    if (offset < imageSize)
+    {
+        return false;
+    }
+    if (!Update.end())
+    {
+        strlcpy(rejectedMd5, imageMd5, sizeof(rejectedMd5)); // not again until the manifest changes
+        downloadFail(Update.errorString());                  // MD5 mismatch or a bad image header
+        return false;
+    }
+    state = GSM_OTA_DONE;
+    otaOwnerRelease(OTA_OWNER_CELLULAR);
+    dutyBusyEnd();
+    return true;
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+// state machine task, PDP context up; true when a new image is ready to boot
+bool gsmOtaRound()
+{
+    if (state == GSM_OTA_DONE)
+    {
+        return false;
+    }
+    if (state != GSM_OTA_DOWNLOADING)
+    {
+        if (++roundsSinceCheck < GSM_OTA_CHECK_ROUNDS)
+        {
+            return false;
+        }
+        roundsSinceCheck = 0;
+        if (!checkManifest())
+        {
+            return false;
+        }
+    }
+    return downloadRound();
+}
+
+gsmOtaState gsmOtaGetState()
+{
+    return state;
+}
+
+size_t gsmOtaReport(char *out, size_t size)
+{
+    int written = snprintf(out, size, "cellular ota %s%s%s, %lu of %lu bytes, %lu chunk retries, %lu B/s\n",
+                           stateNames[state], (state == GSM_OTA_FAILED) ? ": " : "",
+                           (state == GSM_OTA_FAILED) ? failReason : "", (unsigned long)offset,
+                           (unsigned long)imageSize, (unsigned long)retries,
+                           (unsigned long)((downloadMs > 0) ? ((uint64_t)offset * 1000ULL / downloadMs) : 0));
+    if (written < 0)
+    {
+        return 0;
+    }
+    return ((size_t)written < size) ? (size_t)written : size - 1;
+}
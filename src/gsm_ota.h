@@ -0,0 +1,44 @@
+// **************************************************************************************
+//    This header file handles gsm_ota.cpp data
+//    Firmware update over the cellular link with the M95 HTTP client
+// **************************************************************************************
+#ifndef GSM_OTA_H
+#define GSM_OTA_H
+
+#include <Arduino.h>
+
+// the manifest URL turns the feature on, e.g. in platformio.ini:
+// build_flags = '-DGSM_OTA_MANIFEST_URL="http://updates.example.com/awd/manifest.txt"'
+
+#define GSM_OTA_CHUNK_SIZE 4096       // one HTTP request, held in RAM until it is complete
+#define GSM_OTA_CHUNKS_PER_ROUND 8    // per publish round, the rest waits for the next round
+#define GSM_OTA_CHECK_ROUNDS 6        // manifest checked every N published rounds
+#define GSM_OTA_CHUNK_RETRIES 5       // failed requests in a row at one offset before giving up
+#define GSM_OTA_URL_MAX 160
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum gsmOtaState
+{
+    GSM_OTA_IDLE = 0,
+    GSM_OTA_DOWNLOADING,
+    GSM_OTA_DONE, // verified image in the inactive slot, boots on the next restart
+    GSM_OTA_FAILED,
+    GSM_OTA_STATES
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+bool gsmOtaRound();
+gsmOtaState gsmOtaGetState();
+size_t gsmOtaReport(char *out, size_t size);
+
+#endif // GSM_OTA_H
@@ -0,0 +1,125 @@
+// **************************************************************************************
+//   This file drives the M95 in and out of slow-clock sleep. With AT+QSCLK=1 the module
+//   sleeps as soon as DTR goes high and the UART is quiet, and wakes when DTR goes low.
+//   The state machine wakes the module before each step and puts it to sleep whenever it
+//   has nothing queued, so the modem only runs at full power while commands are in flight.
+//   Registration, the PDP context and the MQTT connection survive the sleep, the module
+//   still wakes on its own to answer paging and send keep-alives.
+//   Across ESP32 deep sleep the pin is latched with the GPIO hold, otherwise it floats
+//   when the digital domain powers down and the module sees DTR go low and wakes up.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include "gsm.h"
+#include "gsm_power.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static gsmPowerState powerState = GSM_POWER_AWAKE;
+static unsigned long stateSince = 0;
+static uint32_t stateTimeMs[GSM_POWER_STATES] = {0};
+static uint32_t wakeCount = 0;
+
+static const char *powerStateNames[GSM_POWER_STATES] = {"awake", "sleep"};
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static void enterState(gsmPowerState state)
+{
+    unsigned long now = millis();
+
+    stateTimeMs[powerState] += now - stateSince;
+    stateSince = now;
+    powerState = state;
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+void gsmPowerBegin()
+{
+    // after a deep sleep the pin is still held at the sleep level: drive that level first,
+    // then release the hold, so DTR does not glitch before the module is woken on purpose
+    digitalWrite(GSM_SLEEP_PIN, !GSM_PIN_AWAKE);
+    pinMode(GSM_SLEEP_PIN, OUTPUT);
+    gpio_hold_dis((gpio_num_t)GSM_SLEEP_PIN);
+    gpio_deep_sleep_hold_dis();
+    digitalWrite(GSM_SLEEP_PIN, GSM_PIN_AWAKE);
+    powerState = GSM_POWER_AWAKE;
+    stateSince = millis();
+}
+
+// keeps DTR at its current level through ESP32 deep sleep, released by gsmPowerBegin
+void gsmPowerHold()
+{
+    gpio_hold_en((gpio_num_t)GSM_SLEEP_PIN);
+    gpio_deep_sleep_hold_en();
+}
+
+// cheap when already awake, so it can sit in front of every command sequence
+void gsmPowerWake()
+{
+    if (powerState == GSM_POWER_AWAKE)
+    {
+        return;
+    }
+    digitalWrite(GSM_SLEEP_PIN, GSM_PIN_AWAKE);
+    vTaskDelay(pdMS_TO_TICKS(GSM_WAKE_GUARD_MS));
+    wakeCount++;
+    enterState(GSM_POWER_AWAKE);
+}
+
+// refuses while the modem is still talking, the caller tries again on its next idle spell
+bool gsmPowerSleep()
+{
+    if (powerState == GSM_POWER_SLEEP)
+    {
+        return true;
+    }
+    GSM.flush();
+    if (GSM.available() > 0)
+    {
+        return false;
+    }
+    digitalWrite(GSM_SLEEP_PIN, !GSM_PIN_AWAKE);
+    enterState(GSM_POWER_SLEEP);
+    return true;
+}
+
+gsmPowerState gsmPowerGetState()
+{
+    return powerState;
+}
+
+uint32_t gsmPowerTimeMs(gsmPowerState state)
+{
+    uint32_t total = stateTimeMs[state];
+
+    if (state == powerState)
+    {
+        total += millis() - stateSince;
+    }
+    return total;
+}
+
+void gsmPowerReport()
+{
+    printf("Modem power: %s %lu s, %s %lu s, %lu wakeups\n",
+           powerStateNames[GSM_POWER_AWAKE], (unsigned long)(gsmPowerTimeMs(GSM_POWER_AWAKE) / 1000UL),
+           powerStateNames[GSM_POWER_SLEEP], (unsigned long)(gsmPowerTimeMs(GSM_POWER_SLEEP) / 1000UL),
+           (unsigned long)wakeCount);
+}
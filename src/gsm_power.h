@@ -0,0 +1,41 @@
+// **************************************************************************************
+//    This header file handles gsm_power.cpp data
+//    M95 slow-clock sleep through the DTR line
+// **************************************************************************************
+#ifndef GSM_POWER_H
+#define GSM_POWER_H
+
+#include <Arduino.h>
+
+#define GSM_SLEEP_PIN 32
+#define GSM_PIN_AWAKE HIGH // the board inverts the pin onto DTR, HIGH keeps DTR low
+#define GSM_WAKE_GUARD_MS 50 // M95 needs at least 20 ms after DTR low before the first command
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum gsmPowerState
+{
+    GSM_POWER_AWAKE = 0,
+    GSM_POWER_SLEEP, // slow clock, still registered, PDP and MQTT kept by the module
+    GSM_POWER_STATES
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void gsmPowerBegin();
+void gsmPowerWake();
+bool gsmPowerSleep();
+void gsmPowerHold();
+gsmPowerState gsmPowerGetState();
+uint32_t gsmPowerTimeMs(gsmPowerState state);
+void gsmPowerReport();
+
+#endif // GSM_POWER_H
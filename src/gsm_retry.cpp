@@ -0,0 +1,288 @@
+// **************************************************************************************
+//   This file holds the retry / backoff policy of every GSM state machine stage:
+//   exponential backoff with jitter, per-stage and per-cycle time budgets, an
+//   estimated energy budget and the escalation ladder used by the error state.
+//   The energy estimate charges the time spent in each stage at that stage's typical
+//   modem current (TLS handshake and publish transmit, registration mostly listens),
+//   the rest of the cycle at the idle or slow-clock current the power manager tracks,
+//   so a cycle stuck in transmit-heavy retries runs out before the time budget does.
+//   Idle rounds, where the link scheduler holds the readings or there is nothing to send,
+//   are left out of both, so a long deferral does not use up the ladder.
+//   It also records stage latencies so the table below can be tuned from data.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include "gsm_retry.h"
+#include "gsm_power.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <esp_task_wdt.h>
+
+// whole bring-up + publish cycle limits before giving up and sleeping
+#define CYCLE_BUDGET_MS (10UL * 60UL * 1000UL)
+#define CYCLE_ENERGY_BUDGET_MAS (60UL * 1000UL) // mA*s, ~17 mAh per cycle
+#define MODEM_IDLE_CURRENT_MA 15UL             // awake between stages, registered, not talking
+#define MODEM_SLEEP_CURRENT_MA 2UL             // DTR slow clock
+#define MAX_MODEM_RESETS 4
+
+// **************************************************************************************
+//
+//      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    const char *name;
+    uint8_t maxAttempts;
+    uint16_t baseDelayMs;
+    uint16_t maxDelayMs;
+    uint32_t budgetMs;
+    uint16_t currentMa; // M95 average while the stage runs
+} stagePolicy_t;
+
+static const stagePolicy_t stagePolicy[STAGE_COUNT] = {
+    // name        attempts base   max    budget  mA
+    {"modem", 15, 50, 1000, 15000, 40},
+    {"sim", 30, 100, 2000, 30000, 40},
+    {"register", 50, 250, 5000, 120000, 80},
+    {"ssl", 1, 0, 0, 60000, 30},
+    {"gprs", 1, 0, 0, 30000, 120},
+    {"mqtt-open", 7, 1000, 8000, 180000, 220},
+    {"mqtt-conn", 7, 500, 4000, 60000, 200},
+    {"publish", 3, 2000, 8000, 30000, 250},
+};
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static stageStats_t stageStats[STAGE_COUNT];
+static unsigned long stageStart[STAGE_COUNT];
+static uint8_t stageAttempts[STAGE_COUNT];
+static bool stageRunning[STAGE_COUNT];
+static unsigned long cycleStart = 0;
+static uint32_t cycleSleepStartMs = 0; // gsmPowerTimeMs(GSM_POWER_SLEEP) at cycle start
+static uint32_t cycleStageMs = 0;      // finished stage time in the cycle
+static uint32_t cycleStageMas = 0;     // and its charge
+static uint8_t cycleFailures = 0;
+static unsigned long pauseStart = 0;  // idle round in progress, 0: none
+static uint32_t pauseSleepStartMs = 0; // gsmPowerTimeMs(GSM_POWER_SLEEP) when it started
+static gsmStage lastFailedStage = STAGE_MODEM;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+
+// "equal jitter": half of the exponential delay is fixed, the other half random
+static uint32_t backoffDelay(gsmStage stage, uint8_t attempt)
+{
+    const stagePolicy_t *policy = &stagePolicy[stage];
+    uint32_t delayMs = policy->baseDelayMs;
+    uint8_t shift = (attempt < 16) ? attempt : 16;
+
+    delayMs <<= shift;
+    if (delayMs > policy->maxDelayMs)
+    {
+        delayMs = policy->maxDelayMs;
+    }
+    return (delayMs / 2) + (esp_random() % ((delayMs / 2) + 1));
+}
+
+static void cycleStartIfIdle()
+{
+    if (cycleStart == 0)
+    {
+        retryCycleReset();
+    }
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+
+void retryStageBegin(gsmStage stage)
+{
+    cycleStartIfIdle();
+    stageStart[stage] = millis();
+    stageAttempts[stage] = 0;
+    stageRunning[stage] = true;
+}
+
+// called after a failed attempt; waits the backoff delay and returns true when
+// another attempt is allowed by the attempt count and the stage time budget
+bool retryStageNext(gsmStage stage)
+{
+    const stagePolicy_t *policy = &stagePolicy[stage];
+    uint32_t delayMs;
+
+    stageAttempts[stage]++;
+    if (stageAttempts[stage] >= policy->maxAttempts)
+    {
+        printf("Stage %s: attempts exhausted\n", policy->name);
+        return false;
+    }
+    delayMs = backoffDelay(stage, stageAttempts[stage] - 1);
+    if ((millis() - stageStart[stage]) + delayMs >= policy->budgetMs)
+    {
+        printf("Stage %s: time budget exhausted\n", policy->name);
+        return false;
+    }
+    esp_task_wdt_reset();
+    vTaskDelay(pdMS_TO_TICKS(delayMs));
+    return true;
+}
+
+void retryStageEnd(gsmStage stage, bool success)
+{
+    stageStats_t *stats = &stageStats[stage];
+    uint32_t elapsed = millis() - stageStart[stage];
+
+    if (stageRunning[stage])
+    {
+        stageRunning[stage] = false;
+        cycleStageMs += elapsed;
+        cycleStageMas += (elapsed * stagePolicy[stage].currentMa) / 1000UL;
+    }
+    stats->runs++;
+    stats->lastMs = elapsed;
+    stats->totalMs += elapsed;
+    if ((stats->minMs == 0) || (elapsed < stats->minMs))
+    {
+        stats->minMs = elapsed;
+    }
+    if (elapsed > stats->maxMs)
+    {
+        stats->maxMs = elapsed;
+    }
+    if (success == false)
+    {
+        stats->failures++;
+        lastFailedStage = stage;
+    }
+    printf("Stage %s %s in %lu ms (%u attempts)\n", stagePolicy[stage].name, success ? "done" : "failed",
+           (unsigned long)elapsed, stageAttempts[stage] + 1);
+}
+
+// per-attempt timeout clipped to what is left of the stage budget
+unsigned long retryRemaining(gsmStage stage, unsigned long attemptTimeout)
+{
+    unsigned long elapsed = millis() - stageStart[stage];
+    unsigned long remaining = (elapsed < stagePolicy[stage].budgetMs) ? (stagePolicy[stage].budgetMs - elapsed) : 0;
+
+    return (remaining < attemptTimeout) ? remaining : attemptTimeout;
+}
+
+// escalation ladder: retry -> re-attach -> modem reset -> sleep
+retryAction retryEscalate()
+{
+    unsigned long elapsed;
+
+    cycleStartIfIdle();
+    elapsed = millis() - cycleStart;
+    cycleFailures++;
+
+    if ((elapsed >= CYCLE_BUDGET_MS) || (retryCycleEnergy() >= CYCLE_ENERGY_BUDGET_MAS) ||
+        (cycleFailures > MAX_MODEM_RESETS + 1))
+    {
+        printf("Cycle budget exhausted after %lu ms, ~%lu mAs, %u failures\n", elapsed,
+               (unsigned long)retryCycleEnergy(), cycleFailures);
+        return RETRY_SLEEP;
+    }
+    if ((cycleFailures == 1) && (lastFailedStage >= STAGE_MQTT_OPEN))
+    {
+        return RETRY_REATTACH;
+    }
+    return RETRY_RESET_MODEM;
+}
+
+void retryCycleReset()
+{
+    cycleStart = millis();
+    cycleFailures = 0;
+    cycleSleepStartMs = gsmPowerTimeMs(GSM_POWER_SLEEP);
+    cycleStageMs = 0;
+    cycleStageMas = 0;
+    memset(stageRunning, 0, sizeof(stageRunning)); // a stage left without an end stops counting
+}
+
+// an idle round (readings held for the link, nothing to send) is not part of the
+// cycle: its time and slow-clock charge are taken out on resume, failures are kept
+void retryCyclePause()
+{
+    pauseStart = millis();
+    pauseSleepStartMs = gsmPowerTimeMs(GSM_POWER_SLEEP);
+}
+
+void retryCycleResume()
+{
+    if (pauseStart == 0)
+    {
+        return;
+    }
+    if (cycleStart != 0)
+    {
+        cycleStart += millis() - pauseStart;
+        cycleSleepStartMs += gsmPowerTimeMs(GSM_POWER_SLEEP) - pauseSleepStartMs;
+    }
+    pauseStart = 0;
+}
+
+// estimated charge spent by the modem in the current cycle, in mA*s: stages at their
+// own current, the time between them awake idle or in slow clock
+uint32_t retryCycleEnergy()
+{
+    uint32_t elapsed;
+    uint32_t stageMs = cycleStageMs;
+    uint32_t charge = cycleStageMas;
+    uint32_t sleepMs;
+    uint32_t idleMs;
+
+    if (cycleStart == 0)
+    {
+        return 0;
+    }
+    elapsed = millis() - cycleStart;
+    for (uint8_t i = 0; i < STAGE_COUNT; i++)
+    {
+        if (stageRunning[i])
+        {
+            uint32_t running = millis() - stageStart[i];
+            stageMs += running;
+            charge += (running * stagePolicy[i].currentMa) / 1000UL;
+        }
+    }
+    sleepMs = min(gsmPowerTimeMs(GSM_POWER_SLEEP) - cycleSleepStartMs, elapsed);
+    idleMs = (elapsed > stageMs + sleepMs) ? (elapsed - stageMs - sleepMs) : 0;
+    return charge + ((idleMs * MODEM_IDLE_CURRENT_MA) + (sleepMs * MODEM_SLEEP_CURRENT_MA)) / 1000UL;
+}
+
+const stageStats_t *retryStats(gsmStage stage)
+{
+    return &stageStats[stage];
+}
+
+const char *retryStageName(gsmStage stage)
+{
+    return stagePolicy[stage].name;
+}
+
+void retryPrintStats()
+{
+    printf("stage       runs fail   last    min    max    avg (ms)\n");
+    for (uint8_t i = 0; i < STAGE_COUNT; i++)
+    {
+        const stageStats_t *stats = &stageStats[i];
+        printf("%-10s %5u %4u %6lu %6lu %6lu %6lu\n", stagePolicy[i].name, stats->runs, stats->failures,
+               (unsigned long)stats->lastMs, (unsigned long)stats->minMs, (unsigned long)stats->maxMs,
+               (unsigned long)(stats->runs ? stats->totalMs / stats->runs : 0));
+    }
+}
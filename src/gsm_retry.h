@@ -0,0 +1,65 @@
+// **************************************************************************************
+//    This header file handles gsm_retry.cpp data
+//    Central retry / backoff policy for the GSM state machine stages
+// **************************************************************************************
+#ifndef GSM_RETRY_H
+#define GSM_RETRY_H
+
+#include <Arduino.h>
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum gsmStage
+{
+    STAGE_MODEM = 0,
+    STAGE_SIM,
+    STAGE_REGISTER,
+    STAGE_SSL,
+    STAGE_GPRS,
+    STAGE_MQTT_OPEN,
+    STAGE_MQTT_CONN,
+    STAGE_PUBLISH,
+    STAGE_COUNT
+};
+
+enum retryAction
+{
+    RETRY_REATTACH = 0, // drop PDP context and redo GPRS + MQTT
+    RETRY_RESET_MODEM,  // CFUN reset and full bring-up
+    RETRY_SLEEP         // give up for this cycle, deep sleep and try later
+};
+
+typedef struct
+{
+    uint16_t runs;
+    uint16_t failures;
+    uint32_t lastMs;
+    uint32_t minMs;
+    uint32_t maxMs;
+    uint32_t totalMs;
+} stageStats_t;
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void retryStageBegin(gsmStage stage);
+bool retryStageNext(gsmStage stage);
+void retryStageEnd(gsmStage stage, bool success);
+unsigned long retryRemaining(gsmStage stage, unsigned long attemptTimeout);
+retryAction retryEscalate();
+void retryCycleReset();
+void retryCyclePause();
+void retryCycleResume();
+uint32_t retryCycleEnergy();
+const stageStats_t *retryStats(gsmStage stage);
+const char *retryStageName(gsmStage stage);
+void retryPrintStats();
+
+#endif // GSM_RETRY_H
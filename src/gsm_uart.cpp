@@ -0,0 +1,307 @@
+// **************************************************************************************
+//   This file owns the modem UART (UART2 on GPIO 19/18). At boot it finds the rate the
+//   M95 is currently using, starting from the one remembered in NVS. Once the modem
+//   answers it negotiates up to the highest rate that passes a burst of AT probes,
+//   stores it in the modem (AT&W) and in NVS, so the next boot starts there directly.
+//   The settled rate and the ceiling it was negotiated for are also kept in RTC memory:
+//   a wake from deep sleep starts there without an NVS read, and while the cached rate
+//   answers the negotiation is not run again.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include "gsm.h"
+#include "gsm_uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <esp_task_wdt.h>
+
+#define UART_RX_BUFFER 1024
+#define PROBE_TIMEOUT_MS 300
+#define STABLE_PROBES 10 // consecutive clean AT round trips to accept a rate
+#define UART_CACHE_MAGIC 0x55415254
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t magic;
+    uint32_t baud;          // rate both ends use
+    uint32_t negotiatedFor; // ceiling of the last negotiation, 0: not negotiated
+} uartCache_t;
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static const uint32_t baudRates[] = {115200, 57600, 38400, 19200, 9600};
+static uint32_t currentBaud = 9600;
+static Preferences uartPrefs;
+RTC_DATA_ATTR static uartCache_t uartCache;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+
+// reads until the expected token and the end of its line, so nothing of the reply is left
+// behind for the next command; the next bytes after that are not touched
+static bool uartExpect(const char *expect, unsigned long timeout)
+{
+    char buf[64];
+    uint8_t len = 0;
+    bool matched = false;
+    unsigned long startTime = millis();
+
+    buf[0] = '\0';
+    while (millis() - startTime < timeout)
+    {
+        while (GSM.available() > 0)
+        {
+            char c = GSM.read();
+            if (matched && (c == '\n'))
+            {
+                return true;
+            }
+            if (len < sizeof(buf) - 1)
+            {
+                buf[len++] = c;
+                buf[len] = '\0';
+            }
+            else
+            {
+                memmove(buf, buf + 1, len); // keep the tail, the token may still be arriving
+                buf[len - 1] = c;
+            }
+            if (!matched && (strstr(buf, expect) != NULL))
+            {
+                matched = true;
+            }
+            if (!matched && (strstr(buf, "ERROR") != NULL))
+            {
+                return false;
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    return matched;
+}
+
+// sends a command and waits for the expected token, independent of the state machine rx_buf
+static bool uartCommand(const char *command, const char *expect, unsigned long timeout)
+{
+    while (GSM.available() > 0)
+    {
+        (void)GSM.read(); // drop stale bytes
+    }
+    GSM.print(command);
+    return uartExpect(expect, timeout);
+}
+
+static bool probeAt(uint32_t baud)
+{
+    GSM.updateBaudRate(baud);
+    vTaskDelay(pdMS_TO_TICKS(20));
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        if (uartCommand("AT\r\n", "OK", PROBE_TIMEOUT_MS))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool rateIsStable()
+{
+    for (uint8_t i = 0; i < STABLE_PROBES; i++)
+    {
+        esp_task_wdt_reset();
+        if (uartCommand("AT\r\n", "OK", PROBE_TIMEOUT_MS) == false)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void saveBaud(uint32_t baud, uint32_t negotiatedFor)
+{
+    uartCache.magic = UART_CACHE_MAGIC;
+    uartCache.baud = baud;
+    uartCache.negotiatedFor = negotiatedFor;
+    uartPrefs.begin("gsm", false);
+    if (uartPrefs.getUInt("baud", 0) != baud)
+    {
+        uartPrefs.putUInt("baud", baud);
+    }
+    if (uartPrefs.getUInt("ceiling", 0) != negotiatedFor)
+    {
+        uartPrefs.putUInt("ceiling", negotiatedFor);
+    }
+    uartPrefs.end();
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+
+// starts the UART at the remembered rate and finds the modem's actual rate
+uint32_t gsmUartBegin()
+{
+    uint32_t savedBaud;
+
+    if (uartCache.magic != UART_CACHE_MAGIC)
+    {
+        uartPrefs.begin("gsm", true);
+        uartCache.baud = uartPrefs.getUInt("baud", 9600);
+        uartCache.negotiatedFor = uartPrefs.getUInt("ceiling", 0);
+        uartPrefs.end();
+        uartCache.magic = UART_CACHE_MAGIC;
+    }
+    savedBaud = uartCache.baud;
+
+    GSM.setRxBufferSize(UART_RX_BUFFER);
+    GSM.begin(savedBaud, SERIAL_8N1, GSM_UART_RX_PIN, GSM_UART_TX_PIN);
+    currentBaud = savedBaud;
+    if (probeAt(savedBaud))
+    {
+        printf("Modem UART at %lu baud\n", (unsigned long)savedBaud);
+        return currentBaud;
+    }
+    for (uint8_t i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++)
+    {
+        if ((baudRates[i] != savedBaud) && probeAt(baudRates[i]))
+        {
+            currentBaud = baudRates[i];
+            saveBaud(currentBaud, 0); // the modem lost the settled rate, negotiate again
+            printf("Modem UART found at %lu baud\n", (unsigned long)currentBaud);
+            return currentBaud;
+        }
+    }
+    // modem silent (still booting or off): stay on the saved rate, the state machine retries
+    GSM.updateBaudRate(savedBaud);
+    currentBaud = savedBaud;
+    printf("Modem UART not answering, staying at %lu baud\n", (unsigned long)savedBaud);
+    return currentBaud;
+}
+
+// walks down from maxBaud to the first rate that is stable, falls back to the old one;
+// skipped when the current rate already came out of a negotiation for this ceiling
+uint32_t gsmUartNegotiate(uint32_t maxBaud)
+{
+    uint32_t oldBaud = currentBaud;
+    char cmd[24];
+
+    if ((uartCache.negotiatedFor == maxBaud) && (uartCache.baud == currentBaud))
+    {
+        return currentBaud;
+    }
+
+    for (uint8_t i = 0; i < sizeof(baudRates) / sizeof(baudRates[0]); i++)
+    {
+        uint32_t baud = baudRates[i];
+        if ((baud > maxBaud) || (baud <= oldBaud))
+        {
+            continue;
+        }
+        sprintf(cmd, "AT+IPR=%lu\r\n", (unsigned long)baud);
+        if (uartCommand(cmd, "OK", PROBE_TIMEOUT_MS) == false)
+        {
+            continue; // the OK comes back at the old rate, rate refused
+        }
+        GSM.updateBaudRate(baud); // the OK line is read, nothing of the reply is pending
+        vTaskDelay(pdMS_TO_TICKS(50));
+        if (rateIsStable())
+        {
+            (void)uartCommand("AT&W\r\n", "OK", 1000); // keep the rate over a modem power cycle
+            currentBaud = baud;
+            saveBaud(baud, maxBaud);
+            printf("Modem UART negotiated to %lu baud\n", (unsigned long)baud);
+            return currentBaud;
+        }
+        // not clean at this rate, put both ends back on the old one and try the next
+        printf("Modem UART unstable at %lu baud\n", (unsigned long)baud);
+        sprintf(cmd, "AT+IPR=%lu\r\n", (unsigned long)oldBaud);
+        (void)uartCommand(cmd, "OK", PROBE_TIMEOUT_MS);
+        if (probeAt(oldBaud) == false)
+        {
+            (void)gsmUartBegin(); // lost sync, search again
+            return currentBaud;
+        }
+    }
+    saveBaud(currentBaud, maxBaud); // nothing faster is stable, don't walk the rates every boot
+    return currentBaud;
+}
+
+uint32_t gsmUartBaud()
+{
+    return currentBaud;
+}
+
+// **************************************************************************************
+//
+//      Transfer benchmark: pushes a certificate sized payload into modem RAM and runs
+//      a burst of short commands at every rate, then returns to the negotiated rate.
+//      Only built with -DGSM_UART_BENCHMARK, the modem must be idle.
+//
+// **************************************************************************************
+void gsmUartBenchmark(const String &payload)
+{
+#ifdef GSM_UART_BENCHMARK
+    uint32_t negotiated = currentBaud;
+    char cmd[64];
+
+    printf("baud     cert ms   cert B/s   20xAT ms\n");
+    for (int8_t i = (sizeof(baudRates) / sizeof(baudRates[0])) - 1; i >= 0; i--)
+    {
+        uint32_t baud = baudRates[i];
+        sprintf(cmd, "AT+IPR=%lu\r\n", (unsigned long)baud);
+        if ((uartCommand(cmd, "OK", PROBE_TIMEOUT_MS) == false) || (probeAt(baud) == false))
+        {
+            (void)probeAt(currentBaud);
+            continue;
+        }
+        currentBaud = baud;
+
+        unsigned long startTime = millis();
+        sprintf(cmd, "AT+QSECWRITE=\"RAM:bench.pem\",%u,100\r\n", payload.length());
+        bool ok = uartCommand(cmd, "CONNECT", 5000);
+        if (ok)
+        {
+            GSM.print(payload);
+            ok = uartExpect("+QSECWRITE:", 20000) && uartExpect("OK", 1000); // reply may already be buffered
+        }
+        unsigned long certMs = millis() - startTime;
+
+        startTime = millis();
+        for (uint8_t n = 0; n < 20; n++)
+        {
+            esp_task_wdt_reset();
+            (void)uartCommand("AT\r\n", "OK", PROBE_TIMEOUT_MS);
+        }
+        unsigned long atMs = millis() - startTime;
+
+        printf("%-8lu %7lu %10lu %10lu%s\n", (unsigned long)baud, certMs,
+               certMs ? (unsigned long)(payload.length() * 1000UL / certMs) : 0UL, atMs, ok ? "" : " (write failed)");
+        (void)uartCommand("AT+QSECDEL=\"RAM:bench.pem\"\r\n", "OK", 1000);
+    }
+    sprintf(cmd, "AT+IPR=%lu\r\n", (unsigned long)negotiated);
+    (void)uartCommand(cmd, "OK", PROBE_TIMEOUT_MS);
+    (void)probeAt(negotiated);
+    currentBaud = negotiated;
+#else
+    (void)payload;
+#endif
+}
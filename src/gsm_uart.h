@@ -0,0 +1,25 @@
+// **************************************************************************************
+//    This header file handles gsm_uart.cpp data
+//    Hardware UART link to the M95 with automatic baud rate negotiation
+// **************************************************************************************
+#ifndef GSM_UART_H
+#define GSM_UART_H
+
+#include <Arduino.h>
+
+#define GSM_UART_RX_PIN 19
+#define GSM_UART_TX_PIN 18
+#define GSM_UART_MAX_BAUD 115200UL
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+uint32_t gsmUartBegin();
+uint32_t gsmUartNegotiate(uint32_t maxBaud);
+uint32_t gsmUartBaud();
+void gsmUartBenchmark(const String &payload);
+
+#endif // GSM_UART_H
@@ -1,7 +1,16 @@
 #include <Arduino.h>
-#include <SPIFFS.h>
 #include "async_server.h"
 #include "gsm.h"
+#include "gsm_uart.h"
+#include "gsm_power.h"
+#include "diag.h"
+#include "sensor.h"
+#include "config_store.h"
+#include "duty_cycle.h"
+#include "storage.h"
+#include "fs_archive.h"
+#include "boot.h"
+#include "tsdb.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 //#include <esp_task_wdt.h>
@@ -15,7 +24,6 @@
 // 3 seconds WDT
 #define WDT_TIMEOUT 4
 #define ledPin 2
-#define GSM_SLEEP_PIN 32
 #define uS_TO_S_FACTOR 1000000ULL /* Conversion factor for micro seconds to seconds */     
 uint64_t TIME_TO_SLEEP = 14400ULL * uS_TO_S_FACTOR; /* Time ESP32 will go to sleep (in seconds) */
 
@@ -27,6 +35,15 @@ uint64_t TIME_TO_SLEEP = 14400ULL * uS_TO_S_FACTOR; /* Time ESP32 will go to sle
 // **************************************************************************************
 
 static void Led(uint8_t ledState, uint32_t ledDelay);
+static bool bootFs();
+static bool bootConfig();
+static bool bootModem();
+static bool bootCerts();
+static bool bootWifi();
+static bool bootWeb();
+static bool bootHistory();
+static bool bootSensor();
+static bool bootServices();
 void ledTask(void *pvParameters);
 void setup();
 void loop();
@@ -43,6 +60,85 @@ static void Led(uint8_t ledState, uint32_t ledDelay)
     vTaskDelay(ledDelay / portTICK_PERIOD_MS); // Use FreeRTOS delay instead of delay()
 }
 
+static bool bootFs()
+{
+    if (!storageBegin(true))
+    {
+        // the partition is formatted on this failed mount, the next boot finds it empty
+        Serial.println("Rebooting");
+        delay(1000);
+        ESP.restart();
+    }
+    archiveRecover();
+    return true;
+}
+
+static bool bootConfig()
+{
+    configBegin();
+    gsmBegin();
+    return true;
+}
+
+static bool bootModem()
+{
+    gsmPowerBegin(); // modem awake before the UART probes it
+    gsmUartBegin();
+    while (!GSM)
+    {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return true;
+}
+
+static bool bootCerts()
+{
+    return server_load_certs();
+}
+
+static bool bootWifi()
+{
+    server_wifi_begin();
+    return true;
+}
+
+static bool bootWeb()
+{
+    server_init();
+    return true;
+}
+
+static bool bootHistory()
+{
+    return tsdbBegin();
+}
+
+static bool bootSensor()
+{
+    sensorBegin(SENSOR_SAMPLE_MS);
+    return true;
+}
+
+static bool bootServices()
+{
+    diagBegin();
+    storageMaintenanceBegin();
+    return true;
+}
+
+// in bootStage order; stacks in bytes, they only live until their stage is done
+static const bootStage_t bootStages[BOOT_STAGES] = {
+    {"fs", bootFs, 0, 4096},
+    {"config", bootConfig, 0, 3072},
+    {"modem", bootModem, 0, 3072},
+    {"certs", bootCerts, BOOT_BIT(BOOT_FS), 4096},
+    {"wifi", bootWifi, 0, 4096},
+    {"web", bootWeb, BOOT_BIT(BOOT_FS) | BOOT_BIT(BOOT_CONFIG) | BOOT_BIT(BOOT_WIFI), 6144},
+    {"history", bootHistory, BOOT_BIT(BOOT_FS), 4096},
+    {"sensor", bootSensor, BOOT_BIT(BOOT_HISTORY), 3072},
+    {"services", bootServices, BOOT_BIT(BOOT_FS), 3072},
+};
+
 // **************************************************************************************
 //
 //                      Definition of Main Functions
@@ -71,40 +167,27 @@ void ledTask(void *pvParameters)
 
 void setup() {
 	Serial.begin(115200);
-    GSM.begin(9600);
+    dutyBegin();
     // Serial.println("Configuring WDT...");
     // esp_task_wdt_init(WDT_TIMEOUT, true); // enable panic so ESP32 restarts
     // esp_task_wdt_add(NULL);               // add current thread to WDT watch
-    while (!GSM)
-    {
-        ;
-    }
     pinMode(ledPin, OUTPUT);
-    pinMode(GSM_SLEEP_PIN, OUTPUT);
     Led(HIGH, 0);
-    digitalWrite(32, HIGH);
     Serial.println("LETS Start");
 
     // Create the LED task
     xTaskCreate(
         ledTask,    // Task function
         "LED Task", // Name of the task (for debugging)
-        1000,       // Stack size (in words, not bytes)
+        1000,       // Stack size (bytes on the ESP32 port, see /diag before changing)
         NULL,       // Task input parameter
         1,          // Priority of the task
         NULL);      // Task handle
 
 
 	Serial.printf("\r\n\r\nBinary compiled on %s at %s\r\n", __DATE__, __TIME__);
-	Serial.println("Mounting SPIFFS ...");
-	if (!SPIFFS.begin(true)) {
-		// SPIFFS will be configured on reboot
-		Serial.println("ERROR: Cannot mount SPIFFS, Rebooting");
-		delay(1000);
-		ESP.restart();
-		}
- 
-	server_init();
+	// the init stages run as their own tasks, setup() returns right away
+	bootBegin(bootStages);
 	// your application initialization code ...
 	}
 
@@ -118,6 +201,8 @@ void loop() {
 	// your application loop ...
 
     vTaskDelay(pdMS_TO_TICKS(10));
+    // blocks on the first pass only, the rest of the boot carries on meanwhile
+    (void)bootWait(BOOT_BIT(BOOT_MODEM) | BOOT_BIT(BOOT_CONFIG), BOOT_WAIT_FOREVER);
     gsmStateMachine();
 
-	}
\ No newline at end of file
+	}
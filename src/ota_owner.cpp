@@ -0,0 +1,66 @@
+// **************************************************************************************
+//   This file decides who may write the inactive firmware slot. The web upload, the
+//   delta patch task and the cellular download all drive the one Update object, and an
+//   update started by one of them while another is half way would interleave two images
+//   in the slot. Each path acquires the slot before Update.begin() and releases it once
+//   Update.end() or Update.abort() ran. Update.isRunning() is checked as well, so an
+//   update begun outside these paths also keeps the slot busy.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <Update.h>
+#include "ota_owner.h"
+#include "freertos/FreeRTOS.h"
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static portMUX_TYPE ownerMux = portMUX_INITIALIZER_UNLOCKED;
+static otaOwner currentOwner = OTA_OWNER_NONE;
+
+static const char *ownerNames[OTA_OWNER_COUNT] = {"none", "web upload", "delta patch", "cellular download"};
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+// false while another path holds the slot or an update is running
+bool otaOwnerAcquire(otaOwner owner)
+{
+    bool acquired = false;
+
+    portENTER_CRITICAL(&ownerMux);
+    if ((currentOwner == OTA_OWNER_NONE) && !Update.isRunning())
+    {
+        currentOwner = owner;
+        acquired = true;
+    }
+    portEXIT_CRITICAL(&ownerMux);
+    return acquired;
+}
+
+// only the holder releases, a stale release from another path is ignored
+void otaOwnerRelease(otaOwner owner)
+{
+    portENTER_CRITICAL(&ownerMux);
+    if (currentOwner == owner)
+    {
+        currentOwner = OTA_OWNER_NONE;
+    }
+    portEXIT_CRITICAL(&ownerMux);
+}
+
+bool otaOwnerBusy()
+{
+    return (currentOwner != OTA_OWNER_NONE) || Update.isRunning();
+}
+
+const char *otaOwnerName()
+{
+    return ownerNames[currentOwner];
+}
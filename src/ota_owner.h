@@ -0,0 +1,36 @@
+// **************************************************************************************
+//    This header file handles ota_owner.cpp data
+//    Single owner of the inactive firmware slot across the update paths
+// **************************************************************************************
+#ifndef OTA_OWNER_H
+#define OTA_OWNER_H
+
+#include <Arduino.h>
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum otaOwner
+{
+    OTA_OWNER_NONE = 0,
+    OTA_OWNER_WEB,      // .bin upload
+    OTA_OWNER_DELTA,    // patch being rebuilt into the slot
+    OTA_OWNER_CELLULAR, // image fetched over the modem, spans many rounds
+    OTA_OWNER_COUNT
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+bool otaOwnerAcquire(otaOwner owner);
+void otaOwnerRelease(otaOwner owner);
+bool otaOwnerBusy();
+const char *otaOwnerName();
+
+#endif // OTA_OWNER_H
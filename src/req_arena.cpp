@@ -0,0 +1,84 @@
+// **************************************************************************************
+//   This file implements the per-request arena. Every admitted web request gets one of a
+//   fixed pool of arenas (see server_guard.cpp) and formats its paths, log lines and
+//   replies into it instead of building heap Strings. The whole arena is dropped in one
+//   step when the client disconnects, so request handling leaves no holes in the heap.
+//   Formatting is bounded: text that does not fit is truncated, never spilled.
+// **************************************************************************************
+
+#include <stdio.h>
+#include <string.h>
+#include "req_arena.h"
+
+#define ARENA_ALIGN 4
+
+// returned when the arena is exhausted, callers never have to check for NULL text
+static char arenaEmpty[1] = {'\0'};
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+void arenaReset(reqArena_t *arena)
+{
+    arena->used = 0;
+}
+
+void *arenaAlloc(reqArena_t *arena, size_t size)
+{
+    size_t start = (arena->used + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if ((start > ARENA_SIZE) || (size > (ARENA_SIZE - start)))
+    {
+        return NULL;
+    }
+    arena->used = start + size;
+    if (arena->used > arena->highWater)
+    {
+        arena->highWater = arena->used;
+    }
+    return &arena->buf[start];
+}
+
+char *arenaStrdup(reqArena_t *arena, const char *text)
+{
+    return arenaPrintf(arena, "%s", text);
+}
+
+char *arenaPrintf(reqArena_t *arena, const char *format, ...)
+{
+    va_list args;
+    char *text;
+
+    va_start(args, format);
+    text = arenaVprintf(arena, format, args);
+    va_end(args);
+    return text;
+}
+
+// formats into whatever is left and keeps only what was written
+char *arenaVprintf(reqArena_t *arena, const char *format, va_list args)
+{
+    size_t room = (arena->used < ARENA_SIZE) ? (ARENA_SIZE - arena->used) : 0;
+    char *text = &arena->buf[arena->used];
+    int written;
+
+    if (room == 0)
+    {
+        return arenaEmpty;
+    }
+    written = vsnprintf(text, room, format, args);
+    if (written < 0)
+    {
+        text[0] = '\0';
+        written = 0;
+    }
+    arena->used += ((size_t)written < room) ? (size_t)written + 1 : room;
+    if (arena->used > arena->highWater)
+    {
+        arena->highWater = arena->used;
+    }
+    return text;
+}
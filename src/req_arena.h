@@ -0,0 +1,38 @@
+// **************************************************************************************
+//    This header file handles req_arena.cpp data
+//    Fixed per-request scratch arena with a bounded formatter, host compilable
+// **************************************************************************************
+#ifndef REQ_ARENA_H
+#define REQ_ARENA_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+#define ARENA_SIZE 512 // paths, parameters, log lines and short replies of one request
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    size_t used;
+    size_t highWater; // most ever used since boot, for sizing ARENA_SIZE
+    char buf[ARENA_SIZE];
+} reqArena_t;
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void arenaReset(reqArena_t *arena);
+void *arenaAlloc(reqArena_t *arena, size_t size);
+char *arenaStrdup(reqArena_t *arena, const char *text);
+char *arenaPrintf(reqArena_t *arena, const char *format, ...) __attribute__((format(printf, 2, 3)));
+char *arenaVprintf(reqArena_t *arena, const char *format, va_list args);
+
+#endif // REQ_ARENA_H
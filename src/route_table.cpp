@@ -0,0 +1,215 @@
+// **************************************************************************************
+//   This file dispatches web requests from a declarative route table. AsyncWebServer
+//   scans its handlers one by one and asks each whether it takes the request; here a
+//   single handler answers for every route with one hash of the url and a probe into an
+//   open-addressed bucket array, so the cost does not grow with the number of routes.
+//   The dispatcher applies the same middleware to every route: authentication by the
+//   route's policy, one log line, and per-route counts and handler time for /diag.
+//   Requests and uploads all run in the async_tcp task, no lock is needed.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <stdarg.h>
+#include <ESPAsyncWebServer.h>
+#include "route_table.h"
+#include "boot.h"
+
+#define BUCKET_MASK (ROUTE_BUCKETS - 1)
+#define BUCKET_EMPTY 0xFF
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t requests;
+    uint32_t authFailures;
+    uint32_t served;
+    uint32_t totalUs;
+    uint32_t maxUs;
+} routeStats_t;
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static const route_t *routes = NULL;
+static uint8_t routeCount = 0;
+static uint8_t buckets[ROUTE_BUCKETS];
+static routeStats_t routeStats[ROUTE_MAX];
+static routeAuthenticate_t routeAuthenticate = NULL;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static uint8_t routeIndex(const route_t *route)
+{
+    return (uint8_t)(route - routes);
+}
+
+static bool passesAuth(const route_t *route, AsyncWebServerRequest *request)
+{
+    if ((route->auth == ROUTE_PUBLIC) || routeAuthenticate(request))
+    {
+        return true;
+    }
+    return false;
+}
+
+class RouteDispatcher : public AsyncWebHandler
+{
+public:
+    bool canHandle(AsyncWebServerRequest *request) override
+    {
+        return routeFind(request) != NULL;
+    }
+
+    void handleRequest(AsyncWebServerRequest *request) override
+    {
+        const route_t *route = routeFind(request);
+        routeStats_t *stats;
+        unsigned long started = micros();
+        uint32_t elapsed;
+
+        if (route == NULL)
+        {
+            request->send(404);
+            return;
+        }
+        stats = &routeStats[routeIndex(route)];
+        stats->requests++;
+        if (!passesAuth(route, request))
+        {
+            stats->authFailures++;
+            routeLog(request, "Auth: Failed");
+            request->requestAuthentication();
+            return;
+        }
+        routeLog(request, "%s", (route->auth == ROUTE_AUTH) ? "Auth: Success" : "");
+        route->handler(request);
+        bootMilestoneReached(BOOT_FIRST_HTTP);
+
+        elapsed = micros() - started;
+        stats->served++;
+        stats->totalUs += elapsed;
+        if (elapsed > stats->maxUs)
+        {
+            stats->maxUs = elapsed;
+        }
+    }
+
+    // unauthenticated upload data is dropped, handleRequest answers with the auth challenge
+    void handleUpload(AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len,
+                      bool final) override
+    {
+        const route_t *route = routeFind(request);
+
+        if ((route != NULL) && (route->upload != NULL) && passesAuth(route, request))
+        {
+            route->upload(request, filename, index, data, len, final);
+        }
+    }
+
+    // form posts need their parameters parsed, GET requests have no body to cost anything
+    bool isRequestHandlerTrivial() override
+    {
+        return false;
+    }
+};
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+
+// false when the table does not fit, routes past the limit are not served
+bool routeBegin(AsyncWebServer *webServer, const route_t *table, uint8_t count, routeAuthenticate_t authenticate)
+{
+    bool fits = (count <= ROUTE_MAX);
+
+    routes = table;
+    routeCount = fits ? count : ROUTE_MAX;
+    routeAuthenticate = authenticate;
+    memset(buckets, BUCKET_EMPTY, sizeof(buckets));
+    memset(routeStats, 0, sizeof(routeStats));
+    for (uint8_t i = 0; i < routeCount; i++)
+    {
+        uint32_t slot = table[i].hash & BUCKET_MASK;
+        while (buckets[slot] != BUCKET_EMPTY)
+        {
+            slot = (slot + 1) & BUCKET_MASK; // linear probing, same path with another method lands next door
+        }
+        buckets[slot] = i;
+    }
+    webServer->addHandler(new RouteDispatcher());
+    return fits;
+}
+
+const route_t *routeFind(AsyncWebServerRequest *request)
+{
+    const char *url = request->url().c_str();
+    uint32_t hash = routeHash(url);
+    uint32_t slot = hash & BUCKET_MASK;
+
+    if (routes == NULL)
+    {
+        return NULL;
+    }
+    while (buckets[slot] != BUCKET_EMPTY)
+    {
+        const route_t *route = &routes[buckets[slot]];
+        if ((route->hash == hash) && ((route->method & request->method()) != 0) && (strcmp(route->path, url) == 0))
+        {
+            return route;
+        }
+        slot = (slot + 1) & BUCKET_MASK;
+    }
+    return NULL;
+}
+
+// one log line per request, formatted on the stack instead of concatenated Strings
+void routeLog(AsyncWebServerRequest *request, const char *format, ...)
+{
+    char line[192];
+    IPAddress ip = request->client()->remoteIP();
+    int len = snprintf(line, sizeof(line), "Client:%u.%u.%u.%u %s ", ip[0], ip[1], ip[2], ip[3], request->url().c_str());
+    va_list args;
+
+    if ((len > 0) && ((size_t)len < sizeof(line)))
+    {
+        va_start(args, format);
+        vsnprintf(line + len, sizeof(line) - len, format, args);
+        va_end(args);
+    }
+    Serial.println(line);
+}
+
+size_t routeReport(char *out, size_t size)
+{
+    size_t len = 0;
+
+    for (uint8_t i = 0; (i < routeCount) && (len < size); i++)
+    {
+        int written = snprintf(out + len, size - len, "%-20s %-4s %6lu req %4lu denied %8lu us avg %8lu us max\n",
+                               routes[i].path, (routes[i].method == HTTP_POST) ? "POST" : "GET",
+                               (unsigned long)routeStats[i].requests, (unsigned long)routeStats[i].authFailures,
+                               (unsigned long)(routeStats[i].served > 0 ? routeStats[i].totalUs / routeStats[i].served : 0),
+                               (unsigned long)routeStats[i].maxUs);
+        if (written < 0)
+        {
+            break;
+        }
+        len += ((size_t)written < (size - len)) ? (size_t)written : (size - len - 1);
+    }
+    return len;
+}
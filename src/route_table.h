@@ -0,0 +1,68 @@
+// **************************************************************************************
+//    This header file handles route_table.cpp data
+//    Declarative web routes with hashed dispatch and uniform auth / logging / metrics
+// **************************************************************************************
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include "server_guard.h"
+
+#define ROUTE_BUCKETS 32 // power of two, keep well above the number of routes
+#define ROUTE_MAX 24
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum routeAuth
+{
+    ROUTE_PUBLIC = 0,
+    ROUTE_AUTH // basic auth against the admin credentials
+};
+
+typedef void (*routeHandler_t)(AsyncWebServerRequest *request);
+typedef void (*routeUpload_t)(AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data,
+                              size_t len, bool final);
+
+typedef struct
+{
+    const char *path;
+    uint32_t hash; // of path, filled in at compile time by ROUTE()
+    WebRequestMethodComposite method;
+    routeAuth auth;
+    guardClass routeClass;
+    routeHandler_t handler;
+    routeUpload_t upload; // NULL for routes without a multipart body
+} route_t;
+
+static constexpr uint32_t routeHashStep(const char *s, uint32_t h)
+{
+    return (*s == '\0') ? h : routeHashStep(s + 1, (h ^ (uint8_t)*s) * 16777619UL);
+}
+
+// FNV-1a, the same function hashes the table at compile time and the request url at run time
+static constexpr uint32_t routeHash(const char *s)
+{
+    return routeHashStep(s, 2166136261UL);
+}
+
+#define ROUTE(path, method, auth, routeClass, handler, upload) {path, routeHash(path), method, auth, routeClass, handler, upload}
+
+typedef bool (*routeAuthenticate_t)(AsyncWebServerRequest *request);
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+bool routeBegin(AsyncWebServer *webServer, const route_t *table, uint8_t count, routeAuthenticate_t authenticate);
+const route_t *routeFind(AsyncWebServerRequest *request);
+void routeLog(AsyncWebServerRequest *request, const char *format, ...) __attribute__((format(printf, 2, 3)));
+size_t routeReport(char *out, size_t size);
+
+#endif // ROUTE_TABLE_H
@@ -0,0 +1,138 @@
+// **************************************************************************************
+//   This file runs the distance acquisition task. Raw ADC samples are taken at a fixed
+//   period, every SENSOR_DECIMATION of them are reduced to one value by the outlier
+//   rejecting filter, and the result is stamped and pushed into a single-producer /
+//   single-consumer ring. The GSM state machine drains the ring into its publish batch,
+//   no lock is shared between the two tasks. Every value also goes into the on-device
+//   history (tsdb.cpp).
+//   Every wake from deep sleep starts the task again, and a full window is 60 s of raw
+//   samples, so the first window after a start is cut to SENSOR_FIRST_DECIMATION samples:
+//   the first publish of a wake has a reading by the time the modem is registered.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include "sensor.h"
+#include "sensor_filter.h"
+#include "tsdb.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define SENSOR_TASK_STACK 4096 // the history flush writes to the filesystem
+#define RING_MASK (SENSOR_RING_SIZE - 1)
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static sensorSample_t ring[SENSOR_RING_SIZE];
+static uint32_t ringHead = 0; // written by the sensor task only
+static uint32_t ringTail = 0; // written by the consumer only
+static uint32_t droppedSamples = 0;
+static volatile uint32_t samplePeriodMs = SENSOR_SAMPLE_MS;
+
+// **************************************************************************************
+//
+//      Local Functions declaration
+//
+//
+// **************************************************************************************
+static uint16_t readDistance();
+static void ringPush(const sensorSample_t *sample);
+static void sensorTask(void *parameter);
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static uint16_t readDistance()
+{
+    uint32_t milliVolts = analogReadMilliVolts(SENSOR_ADC_PIN);
+
+    if (milliVolts > SENSOR_FULL_SCALE_MV)
+    {
+        milliVolts = SENSOR_FULL_SCALE_MV;
+    }
+    return (uint16_t)((milliVolts * SENSOR_FULL_SCALE_MM) / SENSOR_FULL_SCALE_MV);
+}
+
+// a full ring keeps its backlog, the newest value is the one dropped
+static void ringPush(const sensorSample_t *sample)
+{
+    uint32_t head = ringHead;
+
+    if ((head - __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE)) >= SENSOR_RING_SIZE)
+    {
+        droppedSamples++;
+        return;
+    }
+    ring[head & RING_MASK] = *sample;
+    __atomic_store_n(&ringHead, head + 1, __ATOMIC_RELEASE);
+}
+
+static void sensorTask(void *parameter)
+{
+    uint16_t window[SENSOR_DECIMATION];
+    uint8_t count = 0;
+    uint8_t windowSize = SENSOR_FIRST_DECIMATION;
+    TickType_t lastWake = xTaskGetTickCount();
+    sensorSample_t sample;
+
+    (void)parameter;
+    for (;;)
+    {
+        window[count++] = readDistance();
+        if (count == windowSize)
+        {
+            sample.distanceInMM = filterWindow(window, count, &sample.kept);
+            sample.timeMs = millis();
+            ringPush(&sample);
+            tsdbAppend(sample.distanceInMM);
+            count = 0;
+            windowSize = SENSOR_DECIMATION;
+        }
+        vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(samplePeriodMs));
+    }
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+void sensorBegin(uint32_t periodMs)
+{
+    samplePeriodMs = periodMs;
+    analogSetPinAttenuation(SENSOR_ADC_PIN, ADC_11db); // full 0 - 3.3 V range
+    xTaskCreate(sensorTask, "sensor", SENSOR_TASK_STACK, NULL, 2, NULL);
+}
+
+// takes effect after the current sample
+void sensorSetPeriod(uint32_t periodMs)
+{
+    samplePeriodMs = periodMs;
+}
+
+// consumer side, only the GSM state machine calls it
+uint8_t sensorTake(sensorSample_t *out, uint8_t max)
+{
+    uint32_t tail = ringTail;
+    uint32_t available = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE) - tail;
+    uint8_t count = (available < max) ? (uint8_t)available : max;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        out[i] = ring[(tail + i) & RING_MASK];
+    }
+    __atomic_store_n(&ringTail, tail + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+uint32_t sensorDropped()
+{
+    return droppedSamples;
+}
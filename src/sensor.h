@@ -0,0 +1,42 @@
+// **************************************************************************************
+//    This header file handles sensor.cpp data
+//    Distance acquisition task: sampling, filtering, decimation and batching
+// **************************************************************************************
+#ifndef SENSOR_H
+#define SENSOR_H
+
+#include <Arduino.h>
+
+#define SENSOR_ADC_PIN 34
+#define SENSOR_FULL_SCALE_MV 3300 // analog output range of the distance sensor
+#define SENSOR_FULL_SCALE_MM 5000
+#define SENSOR_SAMPLE_MS 4000UL   // default raw sampling period
+#define SENSOR_DECIMATION 15      // raw samples per published value, <= FILTER_WINDOW_MAX
+#define SENSOR_FIRST_DECIMATION 5 // first window after boot or wake, a value is ready in 20 s
+#define SENSOR_RING_SIZE 32       // filtered values waiting for the publish path, power of two
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t timeMs; // millis() at the end of the window
+    uint16_t distanceInMM;
+    uint8_t kept; // raw samples that survived outlier rejection
+} sensorSample_t;
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void sensorBegin(uint32_t periodMs);
+void sensorSetPeriod(uint32_t periodMs);
+uint8_t sensorTake(sensorSample_t *out, uint8_t max);
+uint32_t sensorDropped();
+
+#endif // SENSOR_H
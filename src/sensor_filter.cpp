@@ -0,0 +1,101 @@
+// **************************************************************************************
+//   This file reduces one decimation window of raw samples to a single value. The median
+//   anchors the window, the median absolute deviation (MAD) sets how far a sample may
+//   stray before it is treated as an outlier (echo, spike, dropped reading), and the
+//   samples that survive are averaged. When spikes make up close to half the window the
+//   MAD itself blows up, such a window is reported as its plain median. No Arduino
+//   dependencies, so it can be exercised on the host (tools/sensor_bench).
+// **************************************************************************************
+
+#include "sensor_filter.h"
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+
+// windows are small, insertion sort beats anything fancier here
+static void sortSamples(uint16_t *values, uint8_t count)
+{
+    for (uint8_t i = 1; i < count; i++)
+    {
+        uint16_t value = values[i];
+        uint8_t j = i;
+        while ((j > 0) && (values[j - 1] > value))
+        {
+            values[j] = values[j - 1];
+            j--;
+        }
+        values[j] = value;
+    }
+}
+
+static uint16_t sortedMedian(const uint16_t *sorted, uint8_t count)
+{
+    if ((count & 1) != 0)
+    {
+        return sorted[count / 2];
+    }
+    return (uint16_t)(((uint32_t)sorted[(count / 2) - 1] + sorted[count / 2]) / 2);
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+uint16_t filterWindow(const uint16_t *samples, uint8_t count, uint8_t *kept)
+{
+    uint16_t sorted[FILTER_WINDOW_MAX];
+    uint16_t deviation[FILTER_WINDOW_MAX];
+    uint16_t median;
+    uint16_t mad;
+    uint16_t limit;
+    uint32_t sum = 0;
+    uint8_t used = 0;
+
+    if (count > FILTER_WINDOW_MAX)
+    {
+        count = FILTER_WINDOW_MAX;
+    }
+    if (count == 0)
+    {
+        *kept = 0;
+        return 0;
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        sorted[i] = samples[i];
+    }
+    sortSamples(sorted, count);
+    median = sortedMedian(sorted, count);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        deviation[i] = (sorted[i] > median) ? (sorted[i] - median) : (median - sorted[i]);
+    }
+    sortSamples(deviation, count);
+    mad = sortedMedian(deviation, count);
+    if (mad > FILTER_MAX_MAD)
+    {
+        *kept = 1;
+        return median;
+    }
+    // a flat window has MAD 0, allow one count of quantisation noise
+    limit = (uint16_t)(FILTER_OUTLIER_K * ((mad > 0) ? mad : 1));
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint16_t distance = (sorted[i] > median) ? (sorted[i] - median) : (median - sorted[i]);
+        if (distance <= limit)
+        {
+            sum += sorted[i];
+            used++;
+        }
+    }
+    *kept = used; // never 0, half the window lies within one MAD of the median
+    return (uint16_t)((sum + (used / 2)) / used);
+}
@@ -0,0 +1,22 @@
+// **************************************************************************************
+//    This header file handles sensor_filter.cpp data
+//    Median / outlier rejection over one decimation window, host compilable
+// **************************************************************************************
+#ifndef SENSOR_FILTER_H
+#define SENSOR_FILTER_H
+
+#include <stdint.h>
+
+#define FILTER_WINDOW_MAX 16
+#define FILTER_OUTLIER_K 3 // samples further than K * MAD from the median are dropped
+#define FILTER_MAX_MAD 50  // sensor units (mm), beyond this the window is too disturbed to average
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+uint16_t filterWindow(const uint16_t *samples, uint8_t count, uint8_t *kept);
+
+#endif // SENSOR_FILTER_H
@@ -0,0 +1,406 @@
+// **************************************************************************************
+//   This file puts a handler at the head of the web server chain. AsyncWebServer offers
+//   it every request once the headers are in, before any route, SPIFFS or String work
+//   runs, so a request can be turned away for the price of a short response:
+//   - 503 when free heap is below the watermark of the route class, when the global or
+//     per-class cap on live requests is reached, or when one client address holds more
+//     than its share of the connections;
+//   - 429 when the token bucket of that client address for the route class is empty.
+//   Admitted requests get an idle timeout and a slot that records free heap at admission.
+//   The drop at release is a global free-heap delta, not the request's own allocations:
+//   whatever the modem, sensor or other requests allocated or freed meanwhile is in it,
+//   so the report labels it as approximate. The slot also carries the request's scratch arena, so
+//   the pool of arenas is exactly as large as the number of live requests.
+//   All of it runs in the async_tcp task, no lock needed.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+#include <ESPAsyncWebServer.h>
+#include "server_guard.h"
+#include "route_table.h"
+
+#if (GUARD_MAX_PER_CLIENT < 1) || (GUARD_MAX_PER_CLIENT > GUARD_MAX_CONNECTIONS)
+#error "GUARD_MAX_PER_CLIENT must be between 1 and GUARD_MAX_CONNECTIONS"
+#endif
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint16_t burst;        // requests a client may fire back to back
+    uint16_t refillMs;     // one request worth of credit comes back every refillMs
+    uint32_t minFreeHeap;  // below this the class is refused for everybody
+    uint8_t maxLive;       // concurrent requests of this class
+} classPolicy_t;
+
+typedef struct
+{
+    AsyncWebServerRequest *request; // NULL when the slot is free
+    uint32_t ip;
+    uint32_t heapAtAdmit;
+    unsigned long admittedAt;
+    guardClass routeClass;
+    guardReleaseHook_t hooks[GUARD_MAX_RELEASE_HOOKS];
+    uint8_t hookCount;
+    reqArena_t arena;
+} guardSlot_t;
+
+// token buckets kept as milliseconds of credit, a request costs refillMs of it
+typedef struct
+{
+    uint32_t ip; // 0 when unused
+    unsigned long lastSeen;
+    uint32_t credit[GUARD_CLASS_COUNT];
+} guardClient_t;
+
+// decision taken in canHandle, answered later in handleRequest
+typedef struct
+{
+    AsyncWebServerRequest *request;
+    uint16_t status;
+    uint16_t retryAfter;
+} guardRejection_t;
+
+typedef struct
+{
+    uint32_t admitted;
+    uint32_t rejectedFull;
+    uint32_t rejectedClient;
+    uint32_t rejectedRate;
+    uint32_t rejectedHeap;
+    uint8_t live;
+    uint8_t peakLive;
+    int32_t heapMax; // largest free-heap drop across one request, global not per request
+    int64_t heapTotal;
+    uint32_t released;
+    uint32_t durationMaxMs;
+} guardStats_t;
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static const classPolicy_t classPolicy[GUARD_CLASS_COUNT] = {
+    {10, 500, 16384, GUARD_MAX_CONNECTIONS}, // static
+    {2, 5000, 40960, 1},                     // listing, one flash walk at a time
+    {4, 1000, 24576, 2},                     // file I/O, each download has its own handle
+    {1, 30000, 61440, 1},                    // upload, OTA needs room for its write buffers
+};
+
+static const char *classNames[GUARD_CLASS_COUNT] = {"static", "listing", "file", "upload"};
+
+static guardSlot_t slots[GUARD_MAX_CONNECTIONS];
+static guardClient_t clients[GUARD_MAX_CLIENTS];
+static guardRejection_t rejections[GUARD_MAX_CONNECTIONS];
+static uint8_t nextRejection = 0;
+static guardStats_t guardStats;
+static uint32_t classRejected[GUARD_CLASS_COUNT];
+static reqArena_t spareArena; // requests that bypassed admission, reset on every use
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+// the route table says which class a route belongs to, unknown urls count as static
+static guardClass classify(AsyncWebServerRequest *request)
+{
+    const route_t *route = routeFind(request);
+
+    return (route != NULL) ? route->routeClass : GUARD_CLASS_STATIC;
+}
+
+static guardSlot_t *findSlot(AsyncWebServerRequest *request)
+{
+    for (uint8_t i = 0; i < GUARD_MAX_CONNECTIONS; i++)
+    {
+        if (slots[i].request == request)
+        {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+// the bucket set of an address, a new address starts with full buckets
+static guardClient_t *findClient(uint32_t ip, unsigned long now)
+{
+    guardClient_t *oldest = &clients[0];
+
+    for (uint8_t i = 0; i < GUARD_MAX_CLIENTS; i++)
+    {
+        if (clients[i].ip == ip)
+        {
+            return &clients[i];
+        }
+        if ((clients[i].ip == 0) || ((oldest->ip != 0) && ((now - clients[i].lastSeen) > (now - oldest->lastSeen))))
+        {
+            oldest = &clients[i];
+        }
+    }
+    oldest->ip = ip;
+    oldest->lastSeen = now;
+    for (uint8_t c = 0; c < GUARD_CLASS_COUNT; c++)
+    {
+        oldest->credit[c] = (uint32_t)classPolicy[c].burst * classPolicy[c].refillMs;
+    }
+    return oldest;
+}
+
+// 0 when a request of the class may go ahead, otherwise the seconds until it could
+static uint16_t takeToken(guardClient_t *client, guardClass routeClass, unsigned long now)
+{
+    unsigned long elapsed = now - client->lastSeen;
+    const classPolicy_t *policy = &classPolicy[routeClass];
+
+    client->lastSeen = now;
+    for (uint8_t c = 0; c < GUARD_CLASS_COUNT; c++)
+    {
+        uint32_t full = (uint32_t)classPolicy[c].burst * classPolicy[c].refillMs;
+        client->credit[c] = ((full - client->credit[c]) > elapsed) ? (client->credit[c] + elapsed) : full;
+    }
+    if (client->credit[routeClass] < policy->refillMs)
+    {
+        return (uint16_t)((policy->refillMs - client->credit[routeClass] + 999UL) / 1000UL);
+    }
+    client->credit[routeClass] -= policy->refillMs;
+    return 0;
+}
+
+static void reject(AsyncWebServerRequest *request, guardClass routeClass, uint16_t status, uint16_t retryAfter)
+{
+    guardRejection_t *rejection = &rejections[nextRejection];
+
+    nextRejection = (nextRejection + 1) % GUARD_MAX_CONNECTIONS;
+    rejection->request = request;
+    rejection->status = status;
+    rejection->retryAfter = retryAfter;
+    classRejected[routeClass]++;
+}
+
+static void releaseSlot(AsyncWebServerRequest *request)
+{
+    guardSlot_t *slot = findSlot(request);
+    int32_t heapUsed;
+    unsigned long duration;
+
+    if (slot == NULL)
+    {
+        return;
+    }
+    // the request object and its buffers are still alive here
+    heapUsed = (int32_t)slot->heapAtAdmit - (int32_t)ESP.getFreeHeap();
+    duration = millis() - slot->admittedAt;
+    if (heapUsed > guardStats.heapMax)
+    {
+        guardStats.heapMax = heapUsed;
+    }
+    if (duration > guardStats.durationMaxMs)
+    {
+        guardStats.durationMaxMs = duration;
+    }
+    guardStats.heapTotal += heapUsed;
+    guardStats.released++;
+    guardStats.live--;
+
+    for (uint8_t i = 0; i < slot->hookCount; i++)
+    {
+        slot->hooks[i]();
+    }
+    slot->request = NULL;
+    slot->hookCount = 0;
+    arenaReset(&slot->arena);
+}
+
+// false when the request has to be turned away, the answer is queued in rejections
+static bool admit(AsyncWebServerRequest *request)
+{
+    uint32_t ip = request->client()->remoteIP();
+    unsigned long now = millis();
+    guardClass routeClass = classify(request);
+    guardSlot_t *freeSlot = NULL;
+    uint8_t fromClient = 0;
+    uint8_t ofClass = 0;
+    uint16_t retryAfter;
+
+    if (ESP.getFreeHeap() < classPolicy[routeClass].minFreeHeap)
+    {
+        guardStats.rejectedHeap++;
+        reject(request, routeClass, 503, GUARD_HEAP_RETRY_S);
+        return false;
+    }
+    for (uint8_t i = 0; i < GUARD_MAX_CONNECTIONS; i++)
+    {
+        if (slots[i].request == NULL)
+        {
+            if (freeSlot == NULL)
+            {
+                freeSlot = &slots[i];
+            }
+            continue;
+        }
+        if (slots[i].ip == ip)
+        {
+            fromClient++;
+        }
+        if (slots[i].routeClass == routeClass)
+        {
+            ofClass++;
+        }
+    }
+    if ((freeSlot == NULL) || (ofClass >= classPolicy[routeClass].maxLive))
+    {
+        guardStats.rejectedFull++;
+        reject(request, routeClass, 503, GUARD_RETRY_AFTER_S);
+        return false;
+    }
+    if (fromClient >= GUARD_MAX_PER_CLIENT)
+    {
+        guardStats.rejectedClient++; // leaves room for the next client
+        reject(request, routeClass, 503, GUARD_RETRY_AFTER_S);
+        return false;
+    }
+    retryAfter = takeToken(findClient(ip, now), routeClass, now);
+    if (retryAfter != 0)
+    {
+        guardStats.rejectedRate++;
+        reject(request, routeClass, 429, retryAfter);
+        return false;
+    }
+
+    freeSlot->request = request;
+    freeSlot->ip = ip;
+    freeSlot->heapAtAdmit = ESP.getFreeHeap();
+    freeSlot->admittedAt = now;
+    freeSlot->routeClass = routeClass;
+    freeSlot->hookCount = 0;
+    arenaReset(&freeSlot->arena);
+    guardStats.admitted++;
+    guardStats.live++;
+    if (guardStats.live > guardStats.peakLive)
+    {
+        guardStats.peakLive = guardStats.live;
+    }
+    request->client()->setRxTimeout(GUARD_IDLE_TIMEOUT_S);
+    request->onDisconnect([request]() { releaseSlot(request); });
+    return true;
+}
+
+class GuardHandler : public AsyncWebHandler
+{
+public:
+    // admitted requests fall through to the routes behind
+    bool canHandle(AsyncWebServerRequest *request) override
+    {
+        return !admit(request);
+    }
+
+    void handleRequest(AsyncWebServerRequest *request) override
+    {
+        uint16_t status = 503;
+        uint16_t retryAfter = GUARD_RETRY_AFTER_S;
+        AsyncWebServerResponse *response;
+
+        for (uint8_t i = 0; i < GUARD_MAX_CONNECTIONS; i++)
+        {
+            if (rejections[i].request == request)
+            {
+                status = rejections[i].status;
+                retryAfter = rejections[i].retryAfter;
+                rejections[i].request = NULL;
+                break;
+            }
+        }
+        response = request->beginResponse(status, "text/plain", (status == 429) ? "Too many requests" : "Busy, retry shortly");
+        response->addHeader("Retry-After", String(retryAfter));
+        request->send(response);
+    }
+
+    // a rejected request does not need its body
+    bool isRequestHandlerTrivial() override
+    {
+        return true;
+    }
+};
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+
+// has to run before the routes are registered, handlers are tried in order
+void guardBegin(AsyncWebServer *webServer)
+{
+    memset(slots, 0, sizeof(slots));
+    memset(clients, 0, sizeof(clients));
+    memset(rejections, 0, sizeof(rejections));
+    webServer->addHandler(new GuardHandler());
+}
+
+// for work that must be undone however the request ends (upload aborted, client gone)
+void guardOnRelease(AsyncWebServerRequest *request, guardReleaseHook_t hook)
+{
+    guardSlot_t *slot = findSlot(request);
+
+    if (slot == NULL)
+    {
+        hook(); // not tracked, nothing would ever call it
+        return;
+    }
+    if (slot->hookCount < GUARD_MAX_RELEASE_HOOKS)
+    {
+        slot->hooks[slot->hookCount++] = hook;
+    }
+}
+
+reqArena_t *guardArena(AsyncWebServerRequest *request)
+{
+    guardSlot_t *slot = findSlot(request);
+
+    if (slot == NULL)
+    {
+        arenaReset(&spareArena);
+        return &spareArena;
+    }
+    return &slot->arena;
+}
+
+size_t guardReport(char *out, size_t size)
+{
+    size_t arenaHighWater = 0;
+
+    for (uint8_t i = 0; i < GUARD_MAX_CONNECTIONS; i++)
+    {
+        if (slots[i].arena.highWater > arenaHighWater)
+        {
+            arenaHighWater = slots[i].arena.highWater;
+        }
+    }
+    int written = snprintf(out, size,
+                           "connections live %u, peak %u, admitted %lu\n"
+                           "rejected %lu full, %lu per client, %lu rate, %lu heap (%s %lu, %s %lu, %s %lu, %s %lu)\n"
+                           "free heap delta per request (global, approx) max %ld, avg %ld, longest %lu ms, arena high water %u of %u\n",
+                           guardStats.live, guardStats.peakLive, (unsigned long)guardStats.admitted,
+                           (unsigned long)guardStats.rejectedFull, (unsigned long)guardStats.rejectedClient,
+                           (unsigned long)guardStats.rejectedRate, (unsigned long)guardStats.rejectedHeap,
+                           classNames[0], (unsigned long)classRejected[0], classNames[1], (unsigned long)classRejected[1],
+                           classNames[2], (unsigned long)classRejected[2], classNames[3], (unsigned long)classRejected[3],
+                           (long)guardStats.heapMax,
+                           (long)(guardStats.released > 0 ? guardStats.heapTotal / guardStats.released : 0),
+                           (unsigned long)guardStats.durationMaxMs, (unsigned)arenaHighWater, (unsigned)ARENA_SIZE);
+    if (written < 0)
+    {
+        return 0;
+    }
+    return ((size_t)written < size) ? (size_t)written : size - 1;
+}
@@ -0,0 +1,50 @@
+// **************************************************************************************
+//    This header file handles server_guard.cpp data
+//    Admission, rate limiting and accounting of web server connections
+// **************************************************************************************
+#ifndef SERVER_GUARD_H
+#define SERVER_GUARD_H
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+#include "req_arena.h"
+
+#define GUARD_MAX_CONNECTIONS 6 // live requests across all clients
+#ifndef GUARD_MAX_PER_CLIENT
+#define GUARD_MAX_PER_CLIENT 3  // no single address may hold more than this, -D to override
+#endif
+#define GUARD_IDLE_TIMEOUT_S 10 // a client that stops sending is dropped
+#define GUARD_RETRY_AFTER_S 1
+#define GUARD_HEAP_RETRY_S 5    // Retry-After when the heap is below a class watermark
+#define GUARD_MAX_CLIENTS 8     // addresses with rate limit buckets, least recently seen is evicted
+#define GUARD_MAX_RELEASE_HOOKS 4
+
+typedef void (*guardReleaseHook_t)();
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum guardClass
+{
+    GUARD_CLASS_STATIC = 0, // pages, style sheet, settings form
+    GUARD_CLASS_LISTING,    // flash walks and reports: /directory, /diag
+    GUARD_CLASS_FILE_IO,    // single file download / delete
+    GUARD_CLASS_UPLOAD,     // multipart POST, firmware (OTA) or file, known only from the filename
+    GUARD_CLASS_COUNT
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void guardBegin(AsyncWebServer *webServer);
+void guardOnRelease(AsyncWebServerRequest *request, guardReleaseHook_t hook);
+reqArena_t *guardArena(AsyncWebServerRequest *request);
+size_t guardReport(char *out, size_t size);
+
+#endif // SERVER_GUARD_H
@@ -0,0 +1,246 @@
+// **************************************************************************************
+//   This file hides which filesystem backs the "spiffs" data partition. The default
+//   build keeps SPIFFS; the esp32dev_littlefs environment defines APP_FS_LITTLEFS and
+//   mounts LittleFS on the same partition instead (upload the data folder again after
+//   switching, the two on-flash formats are not compatible).
+//   LittleFS keeps metadata in small copy-on-write pairs, so opening, listing and
+//   rewriting files stay flat as the partition fills, where SPIFFS scans the whole
+//   object lookup table and has to garbage collect before it can reuse deleted pages.
+//   Everything else in the firmware goes through these calls, never SPIFFS or LittleFS.
+//   With SPIFFS a low priority task garbage collects while the system is idle, so the
+//   erasing happens between jobs instead of inside an upload write or a firmware update:
+//   no stream (upload, download, restore, backup, patch apply, web OTA) holds a file or
+//   the flash across calls, no storage call ran for STORAGE_IDLE_MS, no job keeps the
+//   unit awake (dutyIsBusy: uploads, OTA of any kind) and the modem is asleep, which it
+//   only is between AT transactions. Write latency is measured in storageWrite() to show
+//   whether that is enough.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include "storage.h"
+
+#ifdef APP_FS_LITTLEFS
+#include <LittleFS.h>
+#define STORAGE_FS LittleFS
+#define STORAGE_NAME "LittleFS"
+#else
+#include <SPIFFS.h>
+#include "esp_spiffs.h"
+#define STORAGE_FS SPIFFS
+#define STORAGE_NAME "SPIFFS"
+#endif
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "duty_cycle.h"
+#include "gsm_power.h"
+
+#define STORAGE_GC_TASK_STACK 3072
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t runs;
+    uint32_t incomplete; // partition too full to free the whole reserve
+    uint32_t totalMs;
+    uint32_t longestMs;
+} gcStats_t;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t slow;
+    uint32_t longestMs;
+} writeStats_t;
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static gcStats_t gcStats = {0};
+static writeStats_t writeStats = {0};
+static portMUX_TYPE streamMux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t openStreams = 0;
+static volatile uint32_t lastActivityMs = 0;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static void touch()
+{
+    lastActivityMs = millis();
+}
+
+#ifndef APP_FS_LITTLEFS
+// SPIFFS only reuses a deleted page after its whole block has been moved and erased;
+// esp_spiffs_gc returns at once while the reserve is already erased
+static void maintenanceTask(void *parameter)
+{
+    (void)parameter;
+    for (;;)
+    {
+        vTaskDelay(pdMS_TO_TICKS(STORAGE_GC_PERIOD_MS));
+        if (!storageIsIdle() || dutyIsBusy() || (gsmPowerGetState() != GSM_POWER_SLEEP))
+        {
+            continue;
+        }
+        unsigned long start = millis();
+        esp_err_t err = esp_spiffs_gc(NULL, STORAGE_GC_RESERVE);
+        uint32_t elapsed = millis() - start;
+
+        gcStats.runs++;
+        gcStats.totalMs += elapsed;
+        if (elapsed > gcStats.longestMs)
+        {
+            gcStats.longestMs = elapsed;
+        }
+        if (err != ESP_OK)
+        {
+            gcStats.incomplete++;
+        }
+    }
+}
+#endif
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+bool storageBegin(bool formatOnFail)
+{
+    Serial.printf("Mounting %s ...\r\n", STORAGE_NAME);
+    if (!STORAGE_FS.begin(formatOnFail))
+    {
+        Serial.printf("ERROR: Cannot mount %s\r\n", STORAGE_NAME);
+        return false;
+    }
+    return true;
+}
+
+fs::FS &storageFS()
+{
+    return STORAGE_FS;
+}
+
+const char *storageName()
+{
+    return STORAGE_NAME;
+}
+
+size_t storageTotalBytes()
+{
+    return STORAGE_FS.totalBytes();
+}
+
+size_t storageUsedBytes()
+{
+    return STORAGE_FS.usedBytes();
+}
+
+File storageOpen(const char *path, const char *mode)
+{
+    touch();
+    return STORAGE_FS.open(path, mode);
+}
+
+bool storageExists(const char *path)
+{
+    touch();
+    return STORAGE_FS.exists(path);
+}
+
+bool storageRemove(const char *path)
+{
+    touch();
+    return STORAGE_FS.remove(path);
+}
+
+bool storageRename(const char *from, const char *to)
+{
+    touch();
+    return STORAGE_FS.rename(from, to);
+}
+
+// File::write with its latency accounted, for the writers that matter (uploads)
+size_t storageWrite(File &file, const uint8_t *data, size_t len)
+{
+    unsigned long start = millis();
+    size_t written = file.write(data, len);
+    uint32_t elapsed = millis() - start;
+
+    touch();
+    writeStats.count++;
+    if (elapsed > writeStats.longestMs)
+    {
+        writeStats.longestMs = elapsed;
+    }
+    if (elapsed > STORAGE_WRITE_SLOW_MS)
+    {
+        writeStats.slow++;
+    }
+    return written;
+}
+
+// a file kept open across calls (web upload, download, restore, backup, patch apply) or a
+// web OTA writing flash; pairs with storageStreamEnd, web requests release it through
+// guardOnRelease
+void storageStreamBegin()
+{
+    portENTER_CRITICAL(&streamMux);
+    openStreams++;
+    portEXIT_CRITICAL(&streamMux);
+    touch();
+}
+
+void storageStreamEnd()
+{
+    portENTER_CRITICAL(&streamMux);
+    if (openStreams > 0)
+    {
+        openStreams--;
+    }
+    portEXIT_CRITICAL(&streamMux);
+    touch();
+}
+
+bool storageIsIdle()
+{
+    return (openStreams == 0) && ((millis() - lastActivityMs) >= STORAGE_IDLE_MS);
+}
+
+// LittleFS needs no background work
+void storageMaintenanceBegin()
+{
+#ifndef APP_FS_LITTLEFS
+    xTaskCreate(maintenanceTask, "fsgc", STORAGE_GC_TASK_STACK, NULL, 0, NULL);
+#endif
+}
+
+size_t storageReport(char *out, size_t size)
+{
+    int written = snprintf(out, size,
+                           "%s used %u of %u, gc runs %lu (%lu incomplete), total %lu ms, longest %lu ms\n"
+                           "writes %lu, longest %lu ms, %lu over %u ms, open streams %u, %s\n",
+                           STORAGE_NAME, (unsigned)storageUsedBytes(), (unsigned)storageTotalBytes(),
+                           (unsigned long)gcStats.runs, (unsigned long)gcStats.incomplete,
+                           (unsigned long)gcStats.totalMs, (unsigned long)gcStats.longestMs,
+                           (unsigned long)writeStats.count, (unsigned long)writeStats.longestMs,
+                           (unsigned long)writeStats.slow, (unsigned)STORAGE_WRITE_SLOW_MS, (unsigned)openStreams,
+                           storageIsIdle() ? "idle" : "busy");
+    if (written < 0)
+    {
+        return 0;
+    }
+    return ((size_t)written < size) ? (size_t)written : size - 1;
+}
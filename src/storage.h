@@ -0,0 +1,38 @@
+// **************************************************************************************
+//    This header file handles storage.cpp data
+//    Filesystem selection: SPIFFS by default, LittleFS when built with APP_FS_LITTLEFS
+// **************************************************************************************
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <Arduino.h>
+#include <FS.h>
+
+#define STORAGE_GC_PERIOD_MS 2000      // idle check interval of the maintenance task
+#define STORAGE_GC_RESERVE (16 * 1024) // erased space kept ready, a few upload bursts
+#define STORAGE_WRITE_SLOW_MS 50       // writes above this count as stalls
+#define STORAGE_IDLE_MS 5000           // no filesystem call for this long before the GC runs
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+bool storageBegin(bool formatOnFail);
+fs::FS &storageFS();
+const char *storageName();
+size_t storageTotalBytes();
+size_t storageUsedBytes();
+File storageOpen(const char *path, const char *mode);
+bool storageExists(const char *path);
+bool storageRemove(const char *path);
+bool storageRename(const char *from, const char *to);
+size_t storageWrite(File &file, const uint8_t *data, size_t len);
+void storageStreamBegin();
+void storageStreamEnd();
+bool storageIsIdle();
+void storageMaintenanceBegin();
+size_t storageReport(char *out, size_t size);
+
+#endif // STORAGE_H
@@ -0,0 +1,734 @@
+// **************************************************************************************
+//   This file keeps a history of the filtered distance readings on the data partition,
+//   so the data of a network outage is still on the device afterwards.
+//   The readings go into TSDB_BLOCK_SIZE blocks in one ring file (TSDB_FILE). A block
+//   starts with a header (first / last time, first / last value, sample count) and
+//   stores every further sample as two zigzag varints: the delta of its time delta
+//   (0 for a steady sampling period) and the change of its value, 2-3 bytes instead of 6.
+//   The block being filled lives in RTC memory, so a deep sleep loses nothing; it is
+//   written back every TSDB_FLUSH_SAMPLES samples, when it is full and on esp_restart().
+//   The ring overwrites its oldest block when it wraps, and blocks older than
+//   TSDB_RETENTION_S are ignored before that. A small index of all blocks is kept in
+//   RAM, a range query uses it to skip blocks and decodes one block at a time.
+//   Time is the system clock in seconds, which runs on across deep sleep. Without a
+//   backup battery it restarts at 0 on power up; tsdbBegin() then moves it past the
+//   newest stored sample, so the history always goes forward. Once the modem has the
+//   network time, tsdbSetClock() sets the clock to UTC and moves the blocks recorded
+//   since the power up by the same step; blocks of earlier power cycles that never saw
+//   the network time keep their uptime stamps and age out.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <sys/time.h>
+#include "esp_system.h"
+#include "tsdb.h"
+#include "storage.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#define TSDB_MAGIC 0x5354 // "TS"
+#define TSDB_PAYLOAD (TSDB_BLOCK_SIZE - sizeof(tsdbHeader_t))
+#define TSDB_SAMPLE_MAX 10 // two 5 byte varints
+#define QUERY_ROW_MAX 64
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint16_t magic;
+    uint16_t count;
+    uint32_t seq; // position in the ring, slot = seq % TSDB_BLOCKS
+    uint32_t firstTime;
+    uint32_t lastTime;
+    int32_t lastDelta;
+    uint16_t firstValue;
+    uint16_t lastValue;
+    uint16_t used;  // payload bytes
+    uint16_t check; // CRC-16 of the header up to here and the used payload
+} tsdbHeader_t;
+
+typedef struct
+{
+    uint32_t seq; // 0: slot free
+    uint32_t firstTime;
+    uint32_t lastTime;
+    uint16_t count;
+    uint16_t used;
+} tsdbIndex_t;
+
+enum queryStage
+{
+    QUERY_HEAD = 0,
+    QUERY_SAMPLES,
+    QUERY_TAIL,
+    QUERY_DONE
+};
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+RTC_DATA_ATTR static uint8_t openBlock[TSDB_BLOCK_SIZE]; // header.seq 0: nothing open
+RTC_DATA_ATTR static uint8_t openUnflushed = 0;
+RTC_DATA_ATTR static bool clockSet = false;      // the clock is UTC since this power up
+RTC_DATA_ATTR static uint32_t unsyncedSeq = 0;   // first block stamped before clockSet
+
+static tsdbIndex_t blockIndex[TSDB_BLOCKS];
+static uint32_t newestSeq = 0;
+static uint32_t fileBlocks = 0;
+static uint32_t flushes = 0;
+static uint32_t flushFailures = 0;
+static uint32_t droppedSamples = 0; // a full block could not be written back
+static SemaphoreHandle_t tsdbMutex = NULL;
+
+// query, one at a time: the route is in the listing class
+static uint8_t queryBlock[TSDB_BLOCK_SIZE];
+static queryStage qStage = QUERY_DONE;
+static tsdbFormat qFormat = TSDB_CSV;
+static uint32_t qFrom = 0;
+static uint32_t qTo = 0;
+static uint32_t qSeq = 0; // next block to load
+static uint32_t qLastSeq = 0;
+static uint16_t qPos = 0;
+static uint16_t qLeft = 0; // samples left in queryBlock
+static uint16_t qCount = 0;
+static uint16_t qUsed = 0;
+static uint32_t qTime = 0;
+static int32_t qDelta = 0;
+static uint16_t qValue = 0;
+static bool qFirstRow = true;
+static char qRow[QUERY_ROW_MAX];
+static size_t qRowLen = 0;
+static size_t qRowSent = 0;
+
+// **************************************************************************************
+//
+//                      Local Functions declaration
+//
+//
+// **************************************************************************************
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len);
+static uint16_t blockCheck(const uint8_t *block, const tsdbHeader_t *header);
+static void headerGet(const uint8_t *block, tsdbHeader_t *header);
+static void headerPut(uint8_t *block, const tsdbHeader_t *header);
+static uint8_t putVarint(uint8_t *out, uint32_t value);
+static uint8_t getVarint(const uint8_t *in, const uint8_t *end, uint32_t *value);
+static uint32_t zigzag(int32_t value);
+static int32_t unzigzag(uint32_t value);
+static bool blockValid(const uint8_t *block, tsdbHeader_t *header);
+static bool readSlot(uint32_t slot, uint8_t *block);
+static bool writeSlot(uint32_t slot, const uint8_t *block);
+static void indexSet(const tsdbHeader_t *header);
+static bool expired(const tsdbIndex_t *entry, uint32_t now);
+static void loadIndex();
+static void flushOpen();
+static void shutdownFlush();
+static void restampBlocks(int32_t offset);
+static bool queryLoadBlock();
+static bool queryNextSample(uint32_t *time, uint16_t *value);
+static void queryNextRow();
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+// CRC-16/CCITT-FALSE
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+    while (len-- > 0)
+    {
+        crc ^= (uint16_t)(*data++) << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static uint16_t blockCheck(const uint8_t *block, const tsdbHeader_t *header)
+{
+    uint16_t crc = crc16(0xFFFF, block, offsetof(tsdbHeader_t, check));
+
+    return crc16(crc, &block[sizeof(tsdbHeader_t)], header->used);
+}
+
+// the block buffers are byte arrays, the header is copied in and out
+static void headerGet(const uint8_t *block, tsdbHeader_t *header)
+{
+    memcpy(header, block, sizeof(*header));
+}
+
+static void headerPut(uint8_t *block, const tsdbHeader_t *header)
+{
+    memcpy(block, header, sizeof(*header));
+}
+
+static uint8_t putVarint(uint8_t *out, uint32_t value)
+{
+    uint8_t len = 0;
+
+    while (value >= 0x80)
+    {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+// bytes consumed, 0 when the varint runs past end
+static uint8_t getVarint(const uint8_t *in, const uint8_t *end, uint32_t *value)
+{
+    *value = 0;
+    for (uint8_t i = 0; (i < 5) && (&in[i] < end); i++)
+    {
+        *value |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+        if ((in[i] & 0x80) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static bool blockValid(const uint8_t *block, tsdbHeader_t *header)
+{
+    headerGet(block, header);
+    return (header->magic == TSDB_MAGIC) && (header->seq != 0) && (header->count != 0) &&
+           (header->used <= TSDB_PAYLOAD) && (blockCheck(block, header) == header->check);
+}
+
+static bool readSlot(uint32_t slot, uint8_t *block)
+{
+    File file = storageOpen(TSDB_FILE, "r");
+    bool ok = file && file.seek(slot * TSDB_BLOCK_SIZE) && (file.read(block, TSDB_BLOCK_SIZE) == TSDB_BLOCK_SIZE);
+
+    file.close();
+    return ok;
+}
+
+// the file grows block by block until the ring wraps, then slots are rewritten in place
+static bool writeSlot(uint32_t slot, const uint8_t *block)
+{
+    static const uint8_t blank[TSDB_BLOCK_SIZE] = {0};
+    File file = storageOpen(TSDB_FILE, storageExists(TSDB_FILE) ? "r+" : "w");
+    bool ok = (bool)file;
+
+    // a file cut short by a failed write: fill up to the slot with blocks that do not validate
+    while (ok && (fileBlocks < slot))
+    {
+        ok = file.seek(fileBlocks * TSDB_BLOCK_SIZE) && (storageWrite(file, blank, TSDB_BLOCK_SIZE) == TSDB_BLOCK_SIZE);
+        fileBlocks += ok ? 1 : 0;
+    }
+    ok = ok && file.seek(slot * TSDB_BLOCK_SIZE) && (storageWrite(file, block, TSDB_BLOCK_SIZE) == TSDB_BLOCK_SIZE);
+    file.close();
+    if (ok && (slot >= fileBlocks))
+    {
+        fileBlocks = slot + 1;
+    }
+    return ok;
+}
+
+static void indexSet(const tsdbHeader_t *header)
+{
+    tsdbIndex_t *entry = &blockIndex[header->seq % TSDB_BLOCKS];
+
+    entry->seq = header->seq;
+    entry->firstTime = header->firstTime;
+    entry->lastTime = header->lastTime;
+    entry->count = header->count;
+    entry->used = header->used;
+    if (header->seq > newestSeq)
+    {
+        newestSeq = header->seq;
+    }
+}
+
+static bool expired(const tsdbIndex_t *entry, uint32_t now)
+{
+    return (now > TSDB_RETENTION_S) && (entry->lastTime < now - TSDB_RETENTION_S);
+}
+
+static void loadIndex()
+{
+    File file = storageOpen(TSDB_FILE, "r");
+    tsdbHeader_t header;
+
+    memset(blockIndex, 0, sizeof(blockIndex));
+    newestSeq = 0;
+    fileBlocks = file ? min((uint32_t)(file.size() / TSDB_BLOCK_SIZE), (uint32_t)TSDB_BLOCKS) : 0;
+    for (uint32_t slot = 0; slot < fileBlocks; slot++)
+    {
+        if ((file.read(queryBlock, TSDB_BLOCK_SIZE) == TSDB_BLOCK_SIZE) && blockValid(queryBlock, &header) &&
+            ((header.seq % TSDB_BLOCKS) == slot))
+        {
+            indexSet(&header);
+        }
+    }
+    file.close();
+}
+
+// caller holds tsdbMutex
+static void flushOpen()
+{
+    tsdbHeader_t header;
+
+    headerGet(openBlock, &header);
+    if ((header.seq == 0) || (openUnflushed == 0))
+    {
+        return;
+    }
+    header.check = blockCheck(openBlock, &header);
+    headerPut(openBlock, &header);
+    if (writeSlot(header.seq % TSDB_BLOCKS, openBlock))
+    {
+        openUnflushed = 0;
+        flushes++;
+    }
+    else
+    {
+        flushFailures++; // kept in RTC memory, the next flush tries again
+    }
+}
+
+// esp_restart() does not keep RTC memory, what is still open goes to the file first
+static void shutdownFlush()
+{
+    if ((tsdbMutex != NULL) && (xSemaphoreTake(tsdbMutex, pdMS_TO_TICKS(200)) == pdTRUE))
+    {
+        flushOpen();
+        xSemaphoreGive(tsdbMutex);
+    }
+}
+
+// caller holds tsdbMutex; moves the blocks stamped before the clock was set by offset seconds
+static void restampBlocks(int32_t offset)
+{
+    static uint8_t block[TSDB_BLOCK_SIZE];
+    tsdbHeader_t header;
+    tsdbHeader_t open;
+    uint32_t seq = (newestSeq >= TSDB_BLOCKS) ? (newestSeq - TSDB_BLOCKS + 1) : 1;
+
+    if (unsyncedSeq == 0)
+    {
+        return; // nothing recorded since the power up
+    }
+    headerGet(openBlock, &open);
+    for (seq = max(seq, unsyncedSeq); seq <= newestSeq; seq++)
+    {
+        if (seq == open.seq)
+        {
+            open.firstTime += offset;
+            open.lastTime += offset;
+            headerPut(openBlock, &open);
+            indexSet(&open);
+            openUnflushed += (openUnflushed == 0) ? 1 : 0; // written back with the new stamps
+            flushOpen();
+            continue;
+        }
+        if (!readSlot(seq % TSDB_BLOCKS, block) || !blockValid(block, &header) || (header.seq != seq))
+        {
+            continue;
+        }
+        header.firstTime += offset;
+        header.lastTime += offset;
+        headerPut(block, &header);
+        header.check = blockCheck(block, &header);
+        headerPut(block, &header);
+        if (writeSlot(seq % TSDB_BLOCKS, block))
+        {
+            indexSet(&header);
+        }
+    }
+}
+
+// next block of the range into queryBlock, false when there is none left
+static bool queryLoadBlock()
+{
+    tsdbHeader_t header;
+    uint32_t now = tsdbNow();
+
+    while (qSeq <= qLastSeq)
+    {
+        uint32_t seq = qSeq++;
+        const tsdbIndex_t *entry = &blockIndex[seq % TSDB_BLOCKS];
+        bool loaded;
+
+        if ((entry->seq != seq) || (entry->count == 0) || expired(entry, now) || (entry->lastTime < qFrom) ||
+            (entry->firstTime > qTo))
+        {
+            continue;
+        }
+        xSemaphoreTake(tsdbMutex, portMAX_DELAY);
+        headerGet(openBlock, &header);
+        if (header.seq == seq)
+        {
+            header.check = blockCheck(openBlock, &header); // not written back yet
+            headerPut(openBlock, &header);
+            memcpy(queryBlock, openBlock, TSDB_BLOCK_SIZE);
+            loaded = true;
+        }
+        else
+        {
+            loaded = readSlot(seq % TSDB_BLOCKS, queryBlock);
+        }
+        xSemaphoreGive(tsdbMutex);
+        if (!loaded || !blockValid(queryBlock, &header) || (header.seq != seq))
+        {
+            continue;
+        }
+        qPos = 0;
+        qUsed = header.used;
+        qLeft = header.count;
+        qCount = header.count;
+        qTime = header.firstTime;
+        qValue = header.firstValue;
+        qDelta = 0;
+        return true;
+    }
+    return false;
+}
+
+static bool queryNextSample(uint32_t *time, uint16_t *value)
+{
+    const uint8_t *payload = &queryBlock[sizeof(tsdbHeader_t)];
+    uint32_t dod;
+    uint32_t dv;
+    uint8_t n1;
+    uint8_t n2 = 0;
+
+    while ((qLeft == 0) && queryLoadBlock())
+    {
+    }
+    if (qLeft == 0)
+    {
+        return false;
+    }
+    if (qLeft != qCount) // the first sample is in the header
+    {
+        n1 = getVarint(&payload[qPos], &payload[qUsed], &dod);
+        if (n1 != 0)
+        {
+            n2 = getVarint(&payload[qPos + n1], &payload[qUsed], &dv);
+        }
+        if ((n1 == 0) || (n2 == 0))
+        {
+            qLeft = 0; // CRC passed but the payload ends early, go on with the next block
+            return queryNextSample(time, value);
+        }
+        qPos += n1 + n2;
+        qDelta += unzigzag(dod);
+        qTime += qDelta;
+        qValue += (uint16_t)unzigzag(dv);
+    }
+    qLeft--;
+    *time = qTime;
+    *value = qValue;
+    return true;
+}
+
+static void queryNextRow()
+{
+    uint32_t time;
+    uint16_t value;
+
+    qRowSent = 0;
+    qRowLen = 0;
+    if (qStage == QUERY_HEAD)
+    {
+        if (qFormat == TSDB_JSON)
+        {
+            qRowLen = snprintf(qRow, sizeof(qRow), "{\"from\":%lu,\"to\":%lu,\"now\":%lu,\"samples\":[",
+                               (unsigned long)qFrom, (unsigned long)qTo, (unsigned long)tsdbNow());
+        }
+        else
+        {
+            qRowLen = snprintf(qRow, sizeof(qRow), "time,distance_mm\n");
+        }
+        qStage = QUERY_SAMPLES;
+    }
+    else if (qStage == QUERY_SAMPLES)
+    {
+        while (queryNextSample(&time, &value))
+        {
+            if ((time < qFrom) || (time > qTo))
+            {
+                continue;
+            }
+            if (qFormat == TSDB_JSON)
+            {
+                qRowLen = snprintf(qRow, sizeof(qRow), "%s[%lu,%u]", qFirstRow ? "" : ",", (unsigned long)time, value);
+            }
+            else
+            {
+                qRowLen = snprintf(qRow, sizeof(qRow), "%lu,%u\n", (unsigned long)time, value);
+            }
+            qFirstRow = false;
+            return;
+        }
+        qStage = QUERY_TAIL;
+        queryNextRow();
+    }
+    else if (qStage == QUERY_TAIL)
+    {
+        qRowLen = (qFormat == TSDB_JSON) ? snprintf(qRow, sizeof(qRow), "]}\n") : 0;
+        qStage = QUERY_DONE;
+    }
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+// data partition mounted; false when the history file cannot be read
+bool tsdbBegin()
+{
+    tsdbHeader_t header;
+    uint32_t newestTime = 0;
+    struct timeval now;
+
+    if (tsdbMutex == NULL)
+    {
+        tsdbMutex = xSemaphoreCreateMutex();
+    }
+    xSemaphoreTake(tsdbMutex, portMAX_DELAY);
+    loadIndex();
+    headerGet(openBlock, &header);
+    if ((esp_reset_reason() == ESP_RST_DEEPSLEEP) && (header.magic == TSDB_MAGIC) && (header.seq >= newestSeq) &&
+        (header.count != 0))
+    {
+        indexSet(&header); // carries on with the block open before the sleep
+    }
+    else
+    {
+        memset(openBlock, 0, sizeof(openBlock));
+        openUnflushed = 0;
+    }
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP)
+    {
+        clockSet = false; // RTC memory is only kept across deep sleep
+        unsyncedSeq = 0;
+    }
+    for (uint32_t i = 0; i < TSDB_BLOCKS; i++)
+    {
+        newestTime = max(newestTime, blockIndex[i].lastTime);
+    }
+    if (tsdbNow() <= newestTime)
+    {
+        // power up without a set clock, continue after the stored history
+        now.tv_sec = newestTime + 1;
+        now.tv_usec = 0;
+        settimeofday(&now, NULL);
+        Serial.printf("History: clock moved to %lu s, after the newest stored sample\r\n", (unsigned long)newestTime + 1);
+    }
+    xSemaphoreGive(tsdbMutex);
+    esp_register_shutdown_handler(shutdownFlush);
+    Serial.printf("History: %lu blocks in %s\r\n", (unsigned long)fileBlocks, TSDB_FILE);
+    return true;
+}
+
+// sensor task, one filtered reading
+void tsdbAppend(uint16_t value)
+{
+    tsdbHeader_t header;
+    uint8_t sample[TSDB_SAMPLE_MAX];
+    uint8_t len;
+    uint32_t time = tsdbNow();
+    int32_t delta;
+
+    if (tsdbMutex == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(tsdbMutex, portMAX_DELAY);
+    headerGet(openBlock, &header);
+    if (header.seq != 0)
+    {
+        delta = (int32_t)(time - header.lastTime);
+        len = putVarint(sample, zigzag(delta - header.lastDelta));
+        len += putVarint(&sample[len], zigzag((int32_t)value - (int32_t)header.lastValue));
+        if (header.used + len <= TSDB_PAYLOAD)
+        {
+            memcpy(&openBlock[sizeof(tsdbHeader_t) + header.used], sample, len);
+            header.used += len;
+            header.count++;
+            header.lastTime = time;
+            header.lastDelta = delta;
+            header.lastValue = value;
+        }
+        else
+        {
+            flushOpen(); // full, the sample starts the next block
+            if (openUnflushed != 0)
+            {
+                // not written, the full block stays open and the next append tries again
+                droppedSamples++;
+                xSemaphoreGive(tsdbMutex);
+                return;
+            }
+            header.seq = 0;
+        }
+    }
+    if (header.seq == 0)
+    {
+        memset(openBlock, 0, sizeof(openBlock));
+        header.magic = TSDB_MAGIC;
+        header.count = 1;
+        header.seq = newestSeq + 1;
+        header.firstTime = time;
+        header.lastTime = time;
+        header.lastDelta = 0;
+        header.firstValue = value;
+        header.lastValue = value;
+        header.used = 0;
+        if (!clockSet && (unsyncedSeq == 0))
+        {
+            unsyncedSeq = header.seq; // moved by tsdbSetClock()
+        }
+    }
+    headerPut(openBlock, &header);
+    indexSet(&header);
+    if (++openUnflushed >= TSDB_FLUSH_SAMPLES)
+    {
+        flushOpen();
+    }
+    xSemaphoreGive(tsdbMutex);
+}
+
+// seconds, the clock of the stored history
+uint32_t tsdbNow()
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (uint32_t)now.tv_sec;
+}
+
+// GSM task, UTC seconds from the modem; the first call after power up moves the history with it
+void tsdbSetClock(uint32_t epoch)
+{
+    struct timeval now;
+    int32_t offset;
+
+    if (tsdbMutex == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(tsdbMutex, portMAX_DELAY);
+    offset = (int32_t)(epoch - tsdbNow());
+    if (!clockSet || (abs(offset) > TSDB_CLOCK_SLACK_S))
+    {
+        now.tv_sec = epoch;
+        now.tv_usec = 0;
+        settimeofday(&now, NULL);
+        if (!clockSet)
+        {
+            restampBlocks(offset);
+            Serial.printf("History: clock set to %lu s UTC, %ld s from the uptime stamps\r\n", (unsigned long)epoch,
+                          (long)offset);
+        }
+        clockSet = true;
+        unsyncedSeq = 0;
+    }
+    xSemaphoreGive(tsdbMutex);
+}
+
+// the listing guard class keeps this to one query at a time
+void tsdbQueryBegin(uint32_t from, uint32_t to, tsdbFormat format)
+{
+    qFrom = from;
+    qTo = to;
+    qFormat = format;
+    qStage = QUERY_HEAD;
+    qFirstRow = true;
+    qLeft = 0;
+    qRowLen = 0;
+    qRowSent = 0;
+    xSemaphoreTake(tsdbMutex, portMAX_DELAY);
+    qLastSeq = newestSeq;
+    xSemaphoreGive(tsdbMutex);
+    qSeq = (qLastSeq >= TSDB_BLOCKS) ? (qLastSeq - TSDB_BLOCKS + 1) : 1;
+}
+
+// chunked response filler, 0 at the end
+size_t tsdbQueryRead(uint8_t *buffer, size_t maxLen)
+{
+    size_t written = 0;
+
+    while (written < maxLen)
+    {
+        if (qRowSent < qRowLen)
+        {
+            size_t part = min(qRowLen - qRowSent, maxLen - written);
+            memcpy(buffer + written, qRow + qRowSent, part);
+            qRowSent += part;
+            written += part;
+            continue;
+        }
+        if (qStage == QUERY_DONE)
+        {
+            break;
+        }
+        queryNextRow();
+    }
+    return written;
+}
+
+size_t tsdbReport(char *out, size_t size)
+{
+    uint32_t now = tsdbNow();
+    uint32_t samples = 0;
+    uint32_t bytes = 0;
+    uint32_t blocks = 0;
+    uint32_t oldest = 0;
+    int written;
+
+    xSemaphoreTake(tsdbMutex, portMAX_DELAY);
+    for (uint32_t i = 0; i < TSDB_BLOCKS; i++)
+    {
+        const tsdbIndex_t *entry = &blockIndex[i];
+        if ((entry->seq == 0) || expired(entry, now))
+        {
+            continue;
+        }
+        blocks++;
+        samples += entry->count;
+        bytes += sizeof(tsdbHeader_t) + entry->used;
+        oldest = ((oldest == 0) || (entry->firstTime < oldest)) ? entry->firstTime : oldest;
+    }
+    xSemaphoreGive(tsdbMutex);
+    written = snprintf(out, size,
+                       "history %lu samples in %lu of %u blocks, %lu.%lu bytes/sample, oldest %lu s, now %lu s%s, "
+                       "%lu flushes (%lu failed), %lu samples dropped\n",
+                       (unsigned long)samples, (unsigned long)blocks, (unsigned)TSDB_BLOCKS,
+                       (unsigned long)(samples ? bytes / samples : 0),
+                       (unsigned long)(samples ? (bytes * 10 / samples) % 10 : 0), (unsigned long)oldest,
+                       (unsigned long)now, clockSet ? " UTC" : " uptime", (unsigned long)flushes,
+                       (unsigned long)flushFailures, (unsigned long)droppedSamples);
+    if (written < 0)
+    {
+        return 0;
+    }
+    return ((size_t)written < size) ? (size_t)written : size - 1;
+}
@@ -0,0 +1,43 @@
+// **************************************************************************************
+//    This header file handles tsdb.cpp data
+//    On-device history of the sensor readings in compressed fixed-size blocks
+// **************************************************************************************
+#ifndef TSDB_H
+#define TSDB_H
+
+#include <Arduino.h>
+
+#define TSDB_FILE "/tsdb.dat"
+#define TSDB_BLOCK_SIZE 512                      // header + compressed samples, two SPIFFS pages
+#define TSDB_BLOCKS 96                           // ring of 48 KB, about 16 days of one value a minute
+#define TSDB_RETENTION_S (14UL * 24UL * 3600UL)  // older blocks are dropped even if there is room
+#define TSDB_FLUSH_SAMPLES 16                    // the open block is written back every N samples
+#define TSDB_CLOCK_SLACK_S 2                     // drift tolerated before the network time is set again
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum tsdbFormat
+{
+    TSDB_CSV = 0,
+    TSDB_JSON
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+bool tsdbBegin();
+void tsdbAppend(uint16_t value);
+uint32_t tsdbNow();
+void tsdbSetClock(uint32_t epoch);
+void tsdbQueryBegin(uint32_t from, uint32_t to, tsdbFormat format);
+size_t tsdbQueryRead(uint8_t *buffer, size_t maxLen);
+size_t tsdbReport(char *out, size_t size);
+
+#endif // TSDB_H
@@ -0,0 +1,315 @@
+// **************************************************************************************
+//   This file brings the WiFi link up without blocking setup(). In station mode the
+//   channel and BSSID of the last good connection are kept in RTC memory (deep sleep
+//   wakes) and NVS (power on). With them the station joins without a channel scan, the
+//   address still comes from DHCP: a cached lease may have expired or been handed to
+//   another client meanwhile, and reusing it as a static address would collide. If the
+//   cached join fails within WIFI_LINK_FAST_TIMEOUT_MS the cache is dropped and a normal
+//   scan follows; if that fails too the unit opens its own access point so the web
+//   UI stays reachable, while the station keeps retrying in the background.
+//   The link state follows the WiFi events, the connect itself runs in a short lived
+//   task that only waits for them. An mDNS failure is logged and otherwise ignored.
+// **************************************************************************************
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <ESPmDNS.h>
+#include <Preferences.h>
+#include "wifi_link.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+#define WIFI_CACHE_MAGIC 0x57464332UL // "WFC2", caches with an IP configuration are ignored
+#define WIFI_CACHE_NAMESPACE "wifi"
+#define WIFI_CACHE_KEY "link"
+#define WIFI_LINK_TASK_STACK 3072
+#define WIFI_LINK_UP_BIT (1 << 0)
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t magic;
+    uint32_t ssidHash; // a cache made for another network is ignored
+    uint8_t channel;
+    uint8_t bssid[6];
+} wifiCache_t;
+
+typedef struct
+{
+    uint32_t connects;
+    uint32_t fastConnects;
+    uint32_t fastMisses; // cached attempt timed out, fell back to a scan
+    uint32_t disconnects;
+    uint32_t fallbacks;
+    uint32_t lastConnectMs;
+    uint32_t bootToLinkMs;
+} wifiStats_t;
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+RTC_DATA_ATTR static wifiCache_t rtcCache;
+static wifiCache_t nvsCache; // what NVS holds, so it is only rewritten on a change
+static wifiStats_t linkStats = {0};
+static volatile wifiLinkState linkState = WIFI_LINK_DOWN;
+static EventGroupHandle_t linkEvents = NULL;
+static unsigned long connectStart = 0;
+static bool fastAttempt = false;
+static bool mdnsStarted = false;
+static char staSsid[33];
+static char staPassword[65];
+static char apName[33];
+static char mdnsName[33];
+
+static const char *stateNames[WIFI_LINK_STATES] = {"down", "connecting", "up", "access point"};
+
+// **************************************************************************************
+//
+//                      Local Functions declaration
+//
+//
+// **************************************************************************************
+static uint32_t ssidHash(const char *ssid);
+static bool cacheLoad(uint32_t hash);
+static void cacheSave();
+static void startMdns();
+static void startAccessPoint();
+static void linkEvent(WiFiEvent_t event, WiFiEventInfo_t info);
+static bool waitForLink(uint32_t timeoutMs);
+static void linkTask(void *parameter);
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+// FNV-1a
+static uint32_t ssidHash(const char *ssid)
+{
+    uint32_t hash = 2166136261UL;
+
+    while (*ssid != '\0')
+    {
+        hash = (hash ^ (uint8_t)*ssid++) * 16777619UL;
+    }
+    return hash;
+}
+
+// RTC memory survives deep sleep, NVS covers a power cycle
+static bool cacheLoad(uint32_t hash)
+{
+    Preferences prefs;
+
+    memset(&nvsCache, 0, sizeof(nvsCache));
+    if (prefs.begin(WIFI_CACHE_NAMESPACE, true))
+    {
+        if (prefs.getBytesLength(WIFI_CACHE_KEY) == sizeof(nvsCache))
+        {
+            prefs.getBytes(WIFI_CACHE_KEY, &nvsCache, sizeof(nvsCache));
+        }
+        prefs.end();
+    }
+    if ((rtcCache.magic != WIFI_CACHE_MAGIC) || (rtcCache.ssidHash != hash))
+    {
+        rtcCache = nvsCache;
+    }
+    return (rtcCache.magic == WIFI_CACHE_MAGIC) && (rtcCache.ssidHash == hash) && (rtcCache.channel != 0);
+}
+
+static void cacheSave()
+{
+    wifiCache_t cache;
+    Preferences prefs;
+
+    memset(&cache, 0, sizeof(cache));
+    cache.magic = WIFI_CACHE_MAGIC;
+    cache.ssidHash = ssidHash(staSsid);
+    cache.channel = WiFi.channel();
+    if (WiFi.BSSID() != NULL)
+    {
+        memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+    }
+    rtcCache = cache;
+    if (memcmp(&cache, &nvsCache, sizeof(cache)) == 0)
+    {
+        return;
+    }
+    if (prefs.begin(WIFI_CACHE_NAMESPACE, false))
+    {
+        prefs.putBytes(WIFI_CACHE_KEY, &cache, sizeof(cache));
+        prefs.end();
+        nvsCache = cache;
+    }
+}
+
+static void startMdns()
+{
+    if (mdnsStarted)
+    {
+        return;
+    }
+    if (!MDNS.begin(mdnsName)) // http://esp32.local for the web server page
+    {
+        Serial.println("Error setting up MDNS responder, continuing without it");
+        return;
+    }
+    mdnsStarted = true;
+    Serial.println("mDNS responder started");
+}
+
+static void startAccessPoint()
+{
+    bool result = WiFi.softAP(apName, WIFI_LINK_AP_PASSWORD);
+
+    Serial.println(result == true ? "AP setup OK" : "AP setup failed");
+    Serial.print("Access Point IP address: ");
+    Serial.println(WiFi.softAPIP());
+    linkState = WIFI_LINK_AP;
+    startMdns();
+}
+
+// runs in the Arduino event task
+static void linkEvent(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+    (void)info;
+    if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP)
+    {
+        linkStats.connects++;
+        linkStats.lastConnectMs = millis() - connectStart;
+        if (linkStats.bootToLinkMs == 0)
+        {
+            linkStats.bootToLinkMs = millis();
+        }
+        if (fastAttempt)
+        {
+            linkStats.fastConnects++;
+        }
+        linkState = WIFI_LINK_UP;
+        xEventGroupSetBits(linkEvents, WIFI_LINK_UP_BIT);
+        Serial.printf("WiFi up in %lu ms (%s), %s, channel %d, %d dBm\r\n", (unsigned long)linkStats.lastConnectMs,
+                      fastAttempt ? "cached" : "scan", WiFi.localIP().toString().c_str(), (int)WiFi.channel(),
+                      (int)WiFi.RSSI());
+        cacheSave();
+        startMdns();
+    }
+    else if ((event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) || (event == ARDUINO_EVENT_WIFI_STA_LOST_IP))
+    {
+        xEventGroupClearBits(linkEvents, WIFI_LINK_UP_BIT);
+        if (linkState == WIFI_LINK_UP)
+        {
+            linkStats.disconnects++;
+            linkState = WIFI_LINK_DOWN;
+            connectStart = millis(); // auto reconnect is timed from here
+            fastAttempt = false;
+        }
+    }
+}
+
+static bool waitForLink(uint32_t timeoutMs)
+{
+    return (xEventGroupWaitBits(linkEvents, WIFI_LINK_UP_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeoutMs)) &
+            WIFI_LINK_UP_BIT) != 0;
+}
+
+static void linkTask(void *parameter)
+{
+    bool up = false;
+
+    (void)parameter;
+    connectStart = millis();
+    fastAttempt = cacheLoad(ssidHash(staSsid));
+    if (fastAttempt)
+    {
+        WiFi.begin(staSsid, staPassword, rtcCache.channel, rtcCache.bssid);
+        up = waitForLink(WIFI_LINK_FAST_TIMEOUT_MS);
+        if (!up)
+        {
+            // moved access point or changed channel, forget it and do it the slow way
+            linkStats.fastMisses++;
+            rtcCache.magic = 0;
+            fastAttempt = false;
+            WiFi.disconnect();
+            connectStart = millis();
+        }
+    }
+    if (!up)
+    {
+        WiFi.begin(staSsid, staPassword);
+        up = waitForLink(WIFI_LINK_TIMEOUT_MS);
+    }
+    if (!up)
+    {
+        Serial.printf("WiFi station %s not reachable, starting access point\r\n", staSsid);
+        linkStats.fallbacks++;
+        WiFi.mode(WIFI_AP_STA);
+        startAccessPoint();
+    }
+    vTaskDelete(NULL);
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+// stand-alone access point
+void wifiLinkStartAP(const char *apSsid, const char *hostName)
+{
+    strlcpy(apName, apSsid, sizeof(apName));
+    strlcpy(mdnsName, hostName, sizeof(mdnsName));
+    WiFi.mode(WIFI_AP);
+    WiFi.setTxPower(WIFI_POWER_MINUS_1dBm);
+    startAccessPoint();
+}
+
+// returns at once, the link comes up in the background (wifiLinkGetState)
+void wifiLinkStartStation(const char *ssid, const char *password, const char *apSsid, const char *hostName)
+{
+    strlcpy(staSsid, ssid, sizeof(staSsid));
+    strlcpy(staPassword, password, sizeof(staPassword));
+    strlcpy(apName, apSsid, sizeof(apName));
+    strlcpy(mdnsName, hostName, sizeof(mdnsName));
+    if (linkEvents == NULL)
+    {
+        linkEvents = xEventGroupCreate();
+        WiFi.onEvent(linkEvent);
+    }
+    WiFi.persistent(false); // the cache above replaces the SDK's own flash copy
+    WiFi.mode(WIFI_STA);
+    WiFi.setTxPower(WIFI_POWER_MINUS_1dBm);
+    WiFi.setAutoReconnect(true);
+    linkState = WIFI_LINK_CONNECTING;
+    xTaskCreate(linkTask, "wifi", WIFI_LINK_TASK_STACK, NULL, 1, NULL);
+}
+
+wifiLinkState wifiLinkGetState()
+{
+    return linkState;
+}
+
+size_t wifiLinkReport(char *out, size_t size)
+{
+    int written = snprintf(out, size,
+                           "wifi %s, connects %lu (%lu cached, %lu cache misses), last %lu ms, boot to link %lu ms, "
+                           "disconnects %lu, ap fallbacks %lu\n",
+                           stateNames[linkState], (unsigned long)linkStats.connects,
+                           (unsigned long)linkStats.fastConnects, (unsigned long)linkStats.fastMisses,
+                           (unsigned long)linkStats.lastConnectMs, (unsigned long)linkStats.bootToLinkMs,
+                           (unsigned long)linkStats.disconnects, (unsigned long)linkStats.fallbacks);
+    if (written < 0)
+    {
+        return 0;
+    }
+    return ((size_t)written < size) ? (size_t)written : size - 1;
+}
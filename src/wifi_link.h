@@ -0,0 +1,40 @@
+// **************************************************************************************
+//    This header file handles wifi_link.cpp data
+//    WiFi station / access point bring-up with cached fast reconnect
+// **************************************************************************************
+#ifndef WIFI_LINK_H
+#define WIFI_LINK_H
+
+#include <Arduino.h>
+
+#define WIFI_LINK_FAST_TIMEOUT_MS 3000 // cached channel / BSSID join plus DHCP, then a full scan
+#define WIFI_LINK_TIMEOUT_MS 10000     // full scan and DHCP, then the access point fallback
+#define WIFI_LINK_AP_PASSWORD ""       // "" => no password
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+enum wifiLinkState
+{
+    WIFI_LINK_DOWN = 0,
+    WIFI_LINK_CONNECTING,
+    WIFI_LINK_UP,  // station associated and addressed
+    WIFI_LINK_AP,  // own access point, station still retrying when it was a fallback
+    WIFI_LINK_STATES
+};
+
+// **************************************************************************************
+//
+//                      Global functions definition
+//
+//
+// **************************************************************************************
+void wifiLinkStartAP(const char *apSsid, const char *hostName);
+void wifiLinkStartStation(const char *ssid, const char *password, const char *apSsid, const char *hostName);
+wifiLinkState wifiLinkGetState();
+size_t wifiLinkReport(char *out, size_t size);
+
+#endif // WIFI_LINK_H
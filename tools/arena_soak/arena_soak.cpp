@@ -0,0 +1,346 @@
+// **************************************************************************************
+//   Host soak test for the web request allocation pattern. A first-fit heap model the
+//   size of the free ESP32 heap replays a million simulated requests, up to four in
+//   flight at once, next to long-lived allocations from the rest of the firmware, and
+//   tracks the largest free block. It runs the pattern twice:
+//   - string: the old handlers, a log String grown by concatenation, remoteIP()
+//     toString(), parameter copies and a String reply body per request;
+//   - arena:  the current handlers, formatting in the fixed per-request arena
+//     (src/req_arena.cpp), only the library's own request / response objects on the heap.
+//   It models the allocation pattern, not the ESP-IDF allocator itself.
+//
+//   g++ -O2 -std=c++17 -Isrc tools/arena_soak/arena_soak.cpp src/req_arena.cpp -o arena_soak
+//   ./arena_soak [requests] [seed]
+// **************************************************************************************
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "req_arena.h"
+
+#define HEAP_SIZE (96 * 1024)
+#define BLOCK_HEADER 8
+#define BLOCK_ALIGN 8
+#define IN_FLIGHT 4
+#define LARGE_PROBE (16 * 1024) // TLS record buffer / OTA write buffer
+#define PROBE_EVERY 1000
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t offset;
+    uint32_t size; // header included
+    bool used;
+} block_t;
+
+class HeapModel
+{
+public:
+    HeapModel() : blocks{{0, HEAP_SIZE, false}} {}
+
+    // offset of the payload, -1 when no free block is big enough
+    long alloc(uint32_t size)
+    {
+        uint32_t need = ((size + BLOCK_HEADER + BLOCK_ALIGN - 1) / BLOCK_ALIGN) * BLOCK_ALIGN;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (!blocks[i].used && (blocks[i].size >= need))
+            {
+                if (blocks[i].size - need >= 2 * BLOCK_HEADER)
+                {
+                    blocks.insert(blocks.begin() + i + 1, block_t{blocks[i].offset + need, blocks[i].size - need, false});
+                    blocks[i].size = need;
+                }
+                blocks[i].used = true;
+                return blocks[i].offset;
+            }
+        }
+        return -1;
+    }
+
+    void release(long offset)
+    {
+        size_t lo = 0, hi = blocks.size();
+        while (lo < hi) // blocks stay sorted by offset
+        {
+            size_t mid = (lo + hi) / 2;
+            if (blocks[mid].offset < (uint32_t)offset)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        blocks[lo].used = false;
+        if ((lo + 1 < blocks.size()) && !blocks[lo + 1].used)
+        {
+            blocks[lo].size += blocks[lo + 1].size;
+            blocks.erase(blocks.begin() + lo + 1);
+        }
+        if ((lo > 0) && !blocks[lo - 1].used)
+        {
+            blocks[lo - 1].size += blocks[lo].size;
+            blocks.erase(blocks.begin() + lo);
+        }
+    }
+
+    uint32_t largestFree() const
+    {
+        uint32_t largest = 0;
+        for (const block_t &block : blocks)
+        {
+            if (!block.used && (block.size - BLOCK_HEADER > largest))
+            {
+                largest = block.size - BLOCK_HEADER;
+            }
+        }
+        return largest;
+    }
+
+    uint32_t freeFragments() const
+    {
+        uint32_t fragments = 0;
+        for (const block_t &block : blocks)
+        {
+            fragments += block.used ? 0 : 1;
+        }
+        return fragments;
+    }
+
+    uint32_t freeBytes() const
+    {
+        uint32_t total = 0;
+        for (const block_t &block : blocks)
+        {
+            total += block.used ? 0 : block.size;
+        }
+        return total;
+    }
+
+private:
+    std::vector<block_t> blocks;
+};
+
+typedef struct
+{
+    std::vector<long> held; // allocations the request keeps until it completes
+    int stepsLeft;
+} request_t;
+
+typedef struct
+{
+    uint32_t minLargest;
+    double avgLargest;
+    uint32_t maxFragments;
+    uint32_t endLargest;
+    uint32_t endFree;
+    unsigned long probeFailures;
+    unsigned long probes;
+    unsigned long allocFailures;
+    size_t arenaHighWater;
+} soakResult_t;
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+
+// a String growing by +=: a new buffer for the longer text, then the old one goes
+static long grow(HeapModel &heap, long current, uint32_t newSize, unsigned long &failures)
+{
+    long grown = heap.alloc(newSize);
+    if (grown < 0)
+    {
+        failures++;
+        return current;
+    }
+    if (current >= 0)
+    {
+        heap.release(current);
+    }
+    return grown;
+}
+
+static void keep(HeapModel &heap, request_t &request, uint32_t size, unsigned long &failures)
+{
+    long block = heap.alloc(size);
+    if (block < 0)
+    {
+        failures++;
+        return;
+    }
+    request.held.push_back(block);
+}
+
+// one step of a request's life, returns false once it has completed
+static bool stepRequest(HeapModel &heap, request_t &request, bool useArena, reqArena_t &arena, std::mt19937 &rng,
+                        unsigned long &failures)
+{
+    std::uniform_int_distribution<uint32_t> urlLen(1, 40);
+    std::uniform_int_distribution<uint32_t> bodyLen(16, 600);
+
+    if (request.stepsLeft == 3)
+    {
+        keep(heap, request, 220 + urlLen(rng), failures); // AsyncWebServerRequest, headers, url
+        if (useArena)
+        {
+            arenaReset(&arena);
+            (void)arenaPrintf(&arena, "/%s", "config.json");
+            (void)arenaPrintf(&arena, "Deleted File: %s", "/config.json");
+        }
+        else
+        {
+            long log = -1;
+            keep(heap, request, 16, failures); // remoteIP().toString()
+            log = grow(heap, log, 24, failures);
+            log = grow(heap, log, 24 + urlLen(rng), failures);
+            log = grow(heap, log, 48 + urlLen(rng), failures);
+            log = grow(heap, log, 72 + urlLen(rng), failures);
+            heap.release(log);
+            keep(heap, request, urlLen(rng), failures); // getParam()->value() copies
+            keep(heap, request, urlLen(rng), failures);
+        }
+    }
+    else if (request.stepsLeft == 2)
+    {
+        keep(heap, request, 96, failures); // AsyncWebServerResponse
+        if (!useArena)
+        {
+            keep(heap, request, bodyLen(rng), failures); // String reply body
+        }
+    }
+    else if (request.stepsLeft == 1)
+    {
+        for (long block : request.held)
+        {
+            heap.release(block);
+        }
+        request.held.clear();
+    }
+    return --request.stepsLeft > 0;
+}
+
+static soakResult_t soak(unsigned long requests, bool useArena, unsigned seed)
+{
+    HeapModel heap;
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> pick(0, IN_FLIGHT - 1);
+    std::uniform_int_distribution<uint32_t> backgroundSize(64, 2048);
+    std::uniform_int_distribution<int> backgroundLife(100, 4000);
+    std::vector<request_t> inFlight(IN_FLIGHT);
+    std::vector<std::pair<long, unsigned long>> background; // block, request count when it goes
+    reqArena_t arena = {};
+    soakResult_t result = {};
+    unsigned long started = 0;
+    unsigned long steps = 0;
+    double largestSum = 0;
+
+    result.minLargest = heap.largestFree();
+    for (long block = heap.alloc(20 * 1024); block >= 0; block = -1)
+    {
+        background.push_back({block, ~0UL}); // WiFi / lwIP / task stacks, never freed
+    }
+    while (started < requests)
+    {
+        request_t &request = inFlight[pick(rng)];
+        if (request.stepsLeft == 0)
+        {
+            request.stepsLeft = 3;
+            started++;
+            // the GSM task, config store and friends allocate now and then
+            if ((started % 100) == 0)
+            {
+                long block = heap.alloc(backgroundSize(rng));
+                if (block >= 0)
+                {
+                    background.push_back({block, started + backgroundLife(rng)});
+                }
+            }
+            for (size_t i = 0; i < background.size();)
+            {
+                if (background[i].second <= started)
+                {
+                    heap.release(background[i].first);
+                    background[i] = background.back();
+                    background.pop_back();
+                }
+                else
+                {
+                    i++;
+                }
+            }
+            if ((started % PROBE_EVERY) == 0)
+            {
+                long probe = heap.alloc(LARGE_PROBE);
+                result.probes++;
+                if (probe < 0)
+                {
+                    result.probeFailures++;
+                }
+                else
+                {
+                    heap.release(probe);
+                }
+            }
+        }
+        (void)stepRequest(heap, request, useArena, arena, rng, result.allocFailures);
+        uint32_t largest = heap.largestFree();
+        uint32_t fragments = heap.freeFragments();
+        if (largest < result.minLargest)
+        {
+            result.minLargest = largest;
+        }
+        if (fragments > result.maxFragments)
+        {
+            result.maxFragments = fragments;
+        }
+        largestSum += largest;
+        steps++;
+    }
+    result.avgLargest = largestSum / steps;
+    result.endLargest = heap.largestFree();
+    result.endFree = heap.freeBytes();
+    result.arenaHighWater = arena.highWater;
+    return result;
+}
+
+static void printResult(const char *name, const soakResult_t &result)
+{
+    printf("%-7s largest free block min %6lu, avg %8.0f, end %6lu of %6lu free, up to %lu free fragments\n",
+           name, (unsigned long)result.minLargest, result.avgLargest, (unsigned long)result.endLargest,
+           (unsigned long)result.endFree, (unsigned long)result.maxFragments);
+    printf("        %lu of %lu %u KB probes failed, %lu small allocs failed", result.probeFailures, result.probes,
+           LARGE_PROBE / 1024, result.allocFailures);
+    if (result.arenaHighWater > 0)
+    {
+        printf(", arena high water %u of %u", (unsigned)result.arenaHighWater, (unsigned)ARENA_SIZE);
+    }
+    printf("\n");
+}
+
+// **************************************************************************************
+//
+//                      Main
+//
+//
+// **************************************************************************************
+int main(int argc, char **argv)
+{
+    unsigned long requests = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000UL;
+    unsigned seed = (argc > 2) ? (unsigned)atoi(argv[2]) : 1;
+
+    printf("%lu requests, %u in flight, %u KB heap model\n", requests, IN_FLIGHT, HEAP_SIZE / 1024);
+    printResult("string", soak(requests, false, seed));
+    printResult("arena", soak(requests, true, seed));
+    return 0;
+}
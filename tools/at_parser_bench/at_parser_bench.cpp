@@ -0,0 +1,380 @@
+// **************************************************************************************
+//   Host benchmark and fuzz driver for src/at_parser.cpp. Loads the M95 transcript
+//   corpus (m95_transcripts.txt), then
+//     bench: parses every response with atParse() and with the strstr / strtok / atoi
+//            scan the state machine used before, and compares the cost per response,
+//     fuzz:  parses mutated corpus responses and random bytes from exactly sized heap
+//            buffers and checks the records against an independent line count; build
+//            with the sanitizers so an over-read stops the run.
+//
+//   g++ -O2 -std=c++17 -Isrc tools/at_parser_bench/at_parser_bench.cpp src/at_parser.cpp -o at_parser_bench
+//   g++ -O1 -g -std=c++17 -fsanitize=address,undefined -Isrc tools/at_parser_bench/at_parser_bench.cpp
+//       src/at_parser.cpp -o at_parser_fuzz
+//   ./at_parser_bench bench [corpus] [rounds]
+//   ./at_parser_fuzz fuzz [corpus] [iterations] [seed]
+// **************************************************************************************
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include "at_parser.h"
+
+#define DEFAULT_CORPUS "tools/at_parser_bench/m95_transcripts.txt"
+#define BENCH_ROUNDS 20000
+#define FUZZ_ITERATIONS 1000000
+#define LEGACY_BUF 256 // rx_buf of the old state machine
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    std::string name;
+    std::string bytes;
+} corpusEntry_t;
+
+typedef struct
+{
+    const char *entry;
+    atRecordType type;
+    int32_t arg0;
+    const char *text; // NULL: not checked
+    uint8_t dropped;
+} expectation_t;
+
+// responses the state machine depends on, checked before every run
+static const expectation_t expectations[] = {
+    {"ccid", AT_REC_CCID, -1, "89923001234567890123", 0},
+    {"ccid_no_sim_verbose", AT_REC_CME_ERROR, -1, "SIM not inserted", 0},
+    {"ccid_no_sim_numeric", AT_REC_CME_ERROR, 10, NULL, 0},
+    {"csq", AT_REC_CSQ, 18, NULL, 0},
+    {"creg_roaming", AT_REC_CREG, 0, NULL, 0},
+    {"cops_numeric", AT_REC_COPS, 0, "41006", 0},
+    {"qsecread", AT_REC_QSECREAD, 1, NULL, 0},
+    {"qsecread_missing", AT_REC_CME_ERROR, 4010, NULL, 0},
+    {"qilocip", AT_REC_OTHER, -1, "10.23.45.67", 0},
+    {"batch_status", AT_REC_CGATT, 1, NULL, 0},
+    {"qmtopen_already", AT_REC_QMTOPEN, 0, NULL, 0},
+    {"qmtconn_query", AT_REC_QMTCONN, 0, NULL, 0},
+    {"qmtpub_prompt", AT_REC_PROMPT, -1, NULL, 0},
+    {"qmtpub_done", AT_REC_QMTPUB, 0, NULL, 0},
+    {"qlts", AT_REC_QLTS, -1, "24/08/12,06:23:51+08,0", 0},
+    {"cclk_unset", AT_REC_CCLK, -1, "04/01/01,00:00:12+00", 0},
+    {"urc_burst", AT_REC_QMTSTAT, 0, NULL, 2},
+    {"cms_error", AT_REC_CME_ERROR, 500, NULL, 0},
+};
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static std::vector<corpusEntry_t> loadCorpus(const char *path)
+{
+    std::vector<corpusEntry_t> corpus;
+    std::ifstream file(path);
+    std::string line;
+
+    if (!file)
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(1);
+    }
+    while (std::getline(file, line))
+    {
+        if ((line.compare(0, 3, "## ") == 0))
+        {
+            corpus.push_back({line.substr(3), ""});
+        }
+        else if (corpus.empty() || line.empty() || (line[0] == '#'))
+        {
+            continue;
+        }
+        else if (line[0] == '<')
+        {
+            corpus.back().bytes += line.substr(1) + "\r";
+        }
+        else
+        {
+            corpus.back().bytes += "\r\n" + line + "\r\n";
+        }
+    }
+    return corpus;
+}
+
+static const corpusEntry_t *findEntry(const std::vector<corpusEntry_t> &corpus, const char *name)
+{
+    for (const corpusEntry_t &entry : corpus)
+    {
+        if (entry.name == name)
+        {
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+static bool selfCheck(const std::vector<corpusEntry_t> &corpus)
+{
+    bool ok = true;
+    atResponse_t response;
+
+    for (const expectation_t &expect : expectations)
+    {
+        const corpusEntry_t *entry = findEntry(corpus, expect.entry);
+        const atRecord_t *record;
+        if (entry == NULL)
+        {
+            printf("check %-22s missing from the corpus\n", expect.entry);
+            ok = false;
+            continue;
+        }
+        (void)atParse(entry->bytes.data(), entry->bytes.size(), &response);
+        record = atFind(&response, expect.type);
+        if (expect.type == AT_REC_OTHER)
+        {
+            record = NULL; // the echo is OTHER too, look for the text
+            for (uint8_t i = 0; i < response.count; i++)
+            {
+                const atRecord_t *r = &response.records[i];
+                if ((r->type == AT_REC_OTHER) && (r->textLen == strlen(expect.text)) &&
+                    (memcmp(r->text, expect.text, r->textLen) == 0))
+                {
+                    record = r;
+                }
+            }
+        }
+        bool pass = (record != NULL) && ((expect.arg0 < 0) || (atArg(record, 0, -1) == expect.arg0)) &&
+                    ((expect.text == NULL) || ((record->text != NULL) && (record->textLen == strlen(expect.text)) &&
+                                               (memcmp(record->text, expect.text, record->textLen) == 0))) &&
+                    (response.dropped == expect.dropped);
+        if (!pass)
+        {
+            printf("check %-22s FAILED (%u records, %u dropped)\n", expect.entry, response.count, response.dropped);
+            ok = false;
+        }
+    }
+    printf("self check: %u expectations %s\n", (unsigned)(sizeof(expectations) / sizeof(expectations[0])),
+           ok ? "passed" : "FAILED");
+    return ok;
+}
+
+// the pre-parser pattern: strstr for the final result and each prefix the state machine
+// looked for, then strtok / atoi on a copy of the matched line
+static int legacyScan(const char *buf)
+{
+    static const char *prefixes[] = {"+CCID", "+CSQ:", "+CREG:", "+CGATT:", "+COPS:", "+QMTOPEN:",
+                                     "+QMTCONN:", "+QMTPUB:", "+QMTSTAT:", "+QSECREAD:"};
+    char copy[LEGACY_BUF];
+    int sum = 0;
+
+    sum += (strstr(buf, "OK") != NULL) + (strstr(buf, "ERROR") != NULL) + (strstr(buf, "+CME ERROR:") != NULL);
+    for (const char *prefix : prefixes)
+    {
+        const char *found = strstr(buf, prefix);
+        if (found == NULL)
+        {
+            continue;
+        }
+        strncpy(copy, found + strlen(prefix), sizeof(copy) - 1);
+        copy[sizeof(copy) - 1] = '\0';
+        for (char *token = strtok(copy, ",\r\n"); token != NULL; token = strtok(NULL, ",\r\n"))
+        {
+            sum += atoi(token);
+        }
+    }
+    return sum;
+}
+
+static void bench(const std::vector<corpusEntry_t> &corpus, unsigned rounds)
+{
+    std::vector<std::string> terminated; // the legacy scan needs NUL terminated copies
+    atResponse_t response;
+    size_t bytes = 0;
+    unsigned long sink = 0;
+
+    for (const corpusEntry_t &entry : corpus)
+    {
+        terminated.push_back(entry.bytes);
+        bytes += entry.bytes.size();
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        for (const corpusEntry_t &entry : corpus)
+        {
+            sink += atParse(entry.bytes.data(), entry.bytes.size(), &response);
+            sink += atArg(atFind(&response, AT_REC_QMTPUB), 0, 0);
+        }
+    }
+    double parseNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    start = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        for (const std::string &buf : terminated)
+        {
+            sink += legacyScan(buf.c_str());
+        }
+    }
+    double legacyNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    double responses = (double)rounds * corpus.size();
+
+    printf("%zu responses, %zu bytes, %u rounds (sink %lu)\n", corpus.size(), bytes, rounds, sink & 0xff);
+    printf("method          ns/response      MB/s\n");
+    printf("atParse        %12.1f %9.1f\n", parseNs / responses, (bytes * (double)rounds) / (parseNs / 1e3));
+    printf("strstr/strtok  %12.1f %9.1f\n", legacyNs / responses, (bytes * (double)rounds) / (legacyNs / 1e3));
+}
+
+// non-empty lines up to the first NUL, the parser must account for every one of them
+static unsigned countLines(const char *buf, size_t len)
+{
+    unsigned lines = 0;
+    bool inLine = false;
+
+    for (size_t i = 0; (i < len) && (buf[i] != '\0'); i++)
+    {
+        bool separator = (buf[i] == '\r') || (buf[i] == '\n');
+        lines += (!separator && !inLine) ? 1 : 0;
+        inLine = !separator;
+    }
+    return lines;
+}
+
+static void mutate(std::string &data, std::mt19937 &rng)
+{
+    static const char alphabet[] = "\r\n,:\" +-0123456789>OKERRORQMTCSQ\x1a\xff";
+    unsigned edits = 1 + rng() % 8;
+
+    for (unsigned e = 0; e < edits; e++)
+    {
+        size_t at = data.empty() ? 0 : rng() % data.size();
+        switch (rng() % 6)
+        {
+        case 0: // flip a byte
+            if (!data.empty())
+            {
+                data[at] ^= (char)(1u << (rng() % 8));
+            }
+            break;
+        case 1: // insert a token character
+            data.insert(at, 1, alphabet[rng() % (sizeof(alphabet) - 1)]);
+            break;
+        case 2: // delete a run
+            data.erase(at, rng() % 4);
+            break;
+        case 3: // cut the response short, as a UART read that stopped early
+            data.resize(at);
+            break;
+        case 4: // repeat a slice, URC bursts and long digit runs
+            data.insert(at, data.substr(at, rng() % 40));
+            break;
+        default: // long run of one character
+            data.insert(at, rng() % 300, alphabet[rng() % (sizeof(alphabet) - 1)]);
+            break;
+        }
+    }
+}
+
+static bool checkResponse(const char *buf, size_t len, const atResponse_t *response)
+{
+    unsigned lines = countLines(buf, len);
+
+    if ((response->count > AT_MAX_RECORDS) || (response->count + response->dropped != (lines > 255 + AT_MAX_RECORDS ?
+                                                                                        255 + AT_MAX_RECORDS : lines)))
+    {
+        return false;
+    }
+    for (uint8_t i = 0; i < response->count; i++)
+    {
+        const atRecord_t *record = &response->records[i];
+        if ((record->argc > AT_MAX_ARGS) || (record->type > AT_REC_CCLK))
+        {
+            return false;
+        }
+        if ((record->text != NULL) && ((record->text < buf) || (record->text + record->textLen > buf + len)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool fuzz(const std::vector<corpusEntry_t> &corpus, unsigned iterations, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    atResponse_t response;
+    unsigned long records = 0;
+    unsigned long dropped = 0;
+
+    for (unsigned i = 0; i < iterations; i++)
+    {
+        std::string data;
+        if (rng() % 20 == 0)
+        {
+            data.resize(rng() % 512);
+            for (char &c : data)
+            {
+                c = (char)(rng() & 0xff);
+            }
+        }
+        else
+        {
+            data = corpus[rng() % corpus.size()].bytes;
+            mutate(data, rng);
+        }
+        // exactly sized, not terminated: a read past len is a sanitizer error
+        char *buf = new char[data.size() ? data.size() : 1];
+        memcpy(buf, data.data(), data.size());
+        (void)atParse(buf, data.size(), &response);
+        if (!checkResponse(buf, data.size(), &response))
+        {
+            printf("iteration %u: inconsistent records for %zu bytes:\n", i, data.size());
+            for (unsigned char c : data)
+            {
+                printf("%02x", c);
+            }
+            printf("\n");
+            delete[] buf;
+            return false;
+        }
+        records += response.count;
+        dropped += response.dropped;
+        delete[] buf;
+    }
+    printf("fuzz: %u inputs, seed %u, %lu records, %lu lines over the record limit, no inconsistency\n", iterations,
+           seed, records, dropped);
+    return true;
+}
+
+// **************************************************************************************
+//
+//                      Definition of Main Function
+//
+//
+// **************************************************************************************
+int main(int argc, char **argv)
+{
+    const char *mode = (argc > 1) ? argv[1] : "bench";
+    const char *path = (argc > 2) ? argv[2] : DEFAULT_CORPUS;
+    std::vector<corpusEntry_t> corpus = loadCorpus(path);
+
+    if (corpus.empty() || !selfCheck(corpus))
+    {
+        return 1;
+    }
+    if (strcmp(mode, "fuzz") == 0)
+    {
+        return fuzz(corpus, (argc > 3) ? atoi(argv[3]) : FUZZ_ITERATIONS, (argc > 4) ? atoi(argv[4]) : 1) ? 0 : 1;
+    }
+    bench(corpus, (argc > 3) ? atoi(argv[3]) : BENCH_ROUNDS);
+    return 0;
+}
@@ -0,0 +1,261 @@
+#!/usr/bin/env python3
+"""Binary patch tool for delta firmware updates (src/delta_ota.cpp).
+
+  make_patch.py diff old.bin new.bin out.patch   build a patch from two builds
+  make_patch.py apply old.bin in.patch out.bin   rebuild new.bin the way the device does
+
+old.bin must be the image the device is running (.pio/build/<env>/firmware.bin
+of that release); the device refuses a patch whose source MD5 does not match.
+Upload the .patch from the web UI like a .bin, it is applied into the inactive
+app slot and boots on the next reboot.
+
+Patch layout, little endian:
+  header  "EDP1", u32 target size, u32 source size, target MD5, source MD5
+  COPY    0x01, u32 source offset, u32 length
+  ADD     0x02, u32 length, literal bytes
+  DIFF    0x03, u32 source offset, u32 length, then until length is covered:
+          varint bytes taken from the source, varint count, count new bytes
+
+The diff indexes the old image every INDEX_STEP bytes on WINDOW byte windows and
+greedily extends matches, trying the spot right after the previous copy first:
+between two builds most code only moves by the size of what was inserted before it.
+Like bsdiff, a match keeps growing over scattered changed bytes (shifted addresses,
+call offsets) while more than half of the bytes still match, and becomes a DIFF.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"EDP1"
+HEADER = struct.Struct("<4sII16s16s")
+OP_COPY = 0x01
+OP_ADD = 0x02
+OP_DIFF = 0x03
+COPY_COST = 9   # op + offset + length, DIFF too
+ADD_COST = 5    # op + length
+WINDOW = 16
+INDEX_STEP = 4  # app images are mostly 32 bit words
+CANDIDATES = 8  # old positions kept per window
+CHUNK = 256
+GIVE_UP = 64    # approximate match ends this long after its best point
+
+
+def build_index(old):
+    index = {}
+    for pos in range(0, len(old) - WINDOW + 1, INDEX_STEP):
+        positions = index.setdefault(old[pos:pos + WINDOW], [])
+        if len(positions) < CANDIDATES:
+            positions.append(pos)
+    return index
+
+
+def match_length(old, new, o, n):
+    """Length of the common run at old[o:] and new[n:]."""
+    length = 0
+    limit = min(len(old) - o, len(new) - n)
+    while length + CHUNK <= limit and old[o + length:o + length + CHUNK] == new[n + length:n + length + CHUNK]:
+        length += CHUNK
+    while length < limit and old[o + length] == new[n + length]:
+        length += 1
+    return length
+
+
+def approx_length(old, new, o, n):
+    """Length of the stretch at old[o:] / new[n:] in which more than half the bytes match."""
+    limit = min(len(old) - o, len(new) - n)
+    matches = best = best_score = i = 0
+    while i < limit and i - best <= GIVE_UP:
+        if i + CHUNK <= limit and old[o + i:o + i + CHUNK] == new[n + i:n + i + CHUNK]:
+            matches += CHUNK
+            i += CHUNK
+        else:
+            matches += old[o + i] == new[n + i]
+            i += 1
+        score = 2 * matches - i
+        if score > best_score:
+            best, best_score = i, score
+    return best
+
+
+def diff_runs(old, new, o, n, length):
+    """(skip, literal bytes) runs of new[n:n + length] against old[o:]."""
+    runs = []
+    i = 0
+    while i < length:
+        skip = 0
+        while i + skip < length and old[o + i + skip] == new[n + i + skip]:
+            skip += 1
+        i += skip
+        start = i
+        # a short equal gap costs more as two runs than as literal bytes
+        while i < length and (old[o + i] != new[n + i] or old[o + i:o + i + 3] != new[n + i:n + i + 3]):
+            i += 1
+        runs.append((skip, bytes(new[n + start:n + i])))
+    return runs
+
+
+def varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7f
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def read_varint(data, pos):
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+def diff(old, new):
+    """Returns the list of ("copy", offset, length) / ("diff", offset, length, runs) / ("add", bytes) operations."""
+    index = build_index(old)
+    ops = []
+    literal = bytearray()
+    expected = -1  # old offset that would continue the previous copy
+    n = 0
+
+    while n < len(new):
+        best_o, best_len = -1, 0
+        if 0 <= expected < len(old):
+            best_len = approx_length(old, new, expected, n)
+            best_o = expected
+        if best_len < WINDOW:
+            for o in index.get(bytes(new[n:n + WINDOW]), ()):
+                if match_length(old, new, o, n) < WINDOW:
+                    continue
+                length = approx_length(old, new, o, n)
+                if length > best_len:
+                    best_o, best_len = o, length
+        if best_len < max(WINDOW, COPY_COST + ADD_COST):
+            literal.append(new[n])
+            n += 1
+            if expected >= 0:
+                expected += 1
+            continue
+        # grow the match backwards into the pending literal bytes
+        back = 0
+        while back < len(literal) and best_o - back > 0 and old[best_o - back - 1] == literal[-back - 1]:
+            back += 1
+        if back:
+            del literal[-back:]
+            best_o -= back
+            best_len += back
+        if literal:
+            ops.append(("add", bytes(literal)))
+            literal.clear()
+        if old[best_o:best_o + best_len] == new[n - back:n - back + best_len]:
+            ops.append(("copy", best_o, best_len))
+        else:
+            ops.append(("diff", best_o, best_len, diff_runs(old, new, best_o, n - back, best_len)))
+        n += best_len - back
+        expected = best_o + best_len
+    if literal:
+        ops.append(("add", bytes(literal)))
+    return ops
+
+
+def encode(old, new, ops):
+    out = bytearray(HEADER.pack(MAGIC, len(new), len(old), hashlib.md5(new).digest(), hashlib.md5(old).digest()))
+    for op in ops:
+        if op[0] == "copy":
+            out += struct.pack("<BII", OP_COPY, op[1], op[2])
+        elif op[0] == "diff":
+            out += struct.pack("<BII", OP_DIFF, op[1], op[2])
+            for skip, literal in op[3]:
+                out += varint(skip) + varint(len(literal)) + literal
+        else:
+            out += struct.pack("<BI", OP_ADD, len(op[1]))
+            out += op[1]
+    return bytes(out)
+
+
+def apply(old, patch):
+    magic, target_size, source_size, target_md5, source_md5 = HEADER.unpack_from(patch, 0)
+    if magic != MAGIC:
+        raise ValueError("not a patch file")
+    if hashlib.md5(old[:source_size]).digest() != source_md5:
+        raise ValueError("patch was made for another firmware")
+    out = bytearray()
+    pos = HEADER.size
+    while len(out) < target_size:
+        op = patch[pos]
+        if op == OP_COPY:
+            offset, length = struct.unpack_from("<II", patch, pos + 1)
+            if offset + length > source_size:
+                raise ValueError("copy outside the base image")
+            out += old[offset:offset + length]
+            pos += COPY_COST
+        elif op == OP_DIFF:
+            offset, length = struct.unpack_from("<II", patch, pos + 1)
+            if offset + length > source_size:
+                raise ValueError("diff outside the base image")
+            pos += COPY_COST
+            end = len(out) + length
+            while len(out) < end:
+                skip, pos = read_varint(patch, pos)
+                count, pos = read_varint(patch, pos)
+                out += old[offset:offset + skip]
+                out += patch[pos:pos + count]
+                offset += skip + count
+                pos += count
+        elif op == OP_ADD:
+            (length,) = struct.unpack_from("<I", patch, pos + 1)
+            out += patch[pos + ADD_COST:pos + ADD_COST + length]
+            pos += ADD_COST + length
+        else:
+            raise ValueError("unknown patch operation 0x%02x" % op)
+    if len(out) != target_size or hashlib.md5(out).digest() != target_md5:
+        raise ValueError("rebuilt image does not match the target MD5")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("mode", choices=("diff", "apply"))
+    parser.add_argument("old")
+    parser.add_argument("input", help="new image (diff) or patch (apply)")
+    parser.add_argument("output")
+    args = parser.parse_args()
+
+    with open(args.old, "rb") as f:
+        old = f.read()
+    with open(args.input, "rb") as f:
+        data = f.read()
+
+    if args.mode == "diff":
+        ops = diff(old, data)
+        patch = encode(old, data, ops)
+        if apply(old, patch) != data:
+            sys.exit("internal error: patch does not rebuild the new image")
+        copied = sum(op[2] for op in ops if op[0] != "add")
+        print("%s: %d bytes for a %d byte image (%.1f %%), %d copy / %d diff / %d add ops, %d bytes from the old image"
+              % (args.output, len(patch), len(data), 100.0 * len(patch) / max(len(data), 1),
+                 sum(1 for op in ops if op[0] == "copy"), sum(1 for op in ops if op[0] == "diff"),
+                 sum(1 for op in ops if op[0] == "add"), copied))
+        with open(args.output, "wb") as f:
+            f.write(patch)
+    else:
+        try:
+            image = apply(old, data)
+        except ValueError as error:
+            sys.exit(str(error))
+        with open(args.output, "wb") as f:
+            f.write(image)
+        print("%s: %d bytes, MD5 %s" % (args.output, len(image), hashlib.md5(image).hexdigest()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,584 @@
+// **************************************************************************************
+//   Host benchmark for the data partition filesystems. LittleFS and SPIFFS run from
+//   their upstream C sources (the same libraries the ESP32 core wraps) on a RAM copy
+//   of the flash partition, configured the way the ESP32 core mounts them. For each
+//   fill level the partition is formatted, filled with 1..8 KB files, aged by deleting
+//   and rewriting half of them, and then the web server operations are timed:
+//   - open:   open an existing file and close it (/file exists, cert load)
+//   - read:   open, read and close a 4 KB file (download, static page)
+//   - write:  create a 4 KB file in 512 byte chunks (upload)
+//   - list:   walk the root directory (/directory)
+//   - delete: remove that file again (/file?action=delete)
+//   Latency comes from the flash traffic each operation causes, priced with typical
+//   timings of the 4 MB NOR parts on ESP32 modules; CPU time is left out. Write
+//   amplification is flash bytes programmed per byte of file data written.
+//
+//   git clone https://github.com/littlefs-project/littlefs
+//   git clone https://github.com/pellepl/spiffs
+//   gcc -O2 -c -Itools/fs_bench -Ilittlefs -Ispiffs/src littlefs/lfs.c littlefs/lfs_util.c spiffs/src/spiffs_*.c
+//   g++ -O2 -std=c++17 -Itools/fs_bench -Ilittlefs -Ispiffs/src tools/fs_bench/fs_bench.cpp *.o -o fs_bench
+//   ./fs_bench [partition_bytes] [seed]
+// **************************************************************************************
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "lfs.h"
+#include "spiffs.h"
+#include "spiffs_nucleus.h"
+}
+
+#define PARTITION_SIZE 0x30000 // "spiffs" in min_spiffs.csv
+#define BLOCK_SIZE 4096
+#define PAGE_SIZE 256
+#define BENCH_FILE_SIZE 4096
+#define BENCH_CHUNK 512
+#define BENCH_ROUNDS 40
+#define FILL_MIN 1024
+#define FILL_MAX 8192
+#define MAX_FILES 8
+
+// typical figures for the 32 Mbit SPI NOR flash on ESP32 modules, 40 MHz DIO
+#define READ_CALL_US 3.0   // command, address and driver overhead
+#define READ_BYTES_US 4.0  // bytes per us
+#define PROG_PAGE_US 600.0 // page program, per 256 byte page touched
+#define ERASE_US 45000.0   // 4 KB sector erase
+
+// **************************************************************************************
+//
+//                      Data structures
+//
+//
+// **************************************************************************************
+typedef struct
+{
+    uint32_t reads;
+    uint64_t readBytes;
+    uint32_t progPages;
+    uint64_t progBytes;
+    uint32_t erases;
+} flashCount_t;
+
+typedef struct
+{
+    double sumMs;
+    double maxMs;
+    uint32_t count;
+} opStat_t;
+
+enum benchOp
+{
+    OP_OPEN = 0,
+    OP_READ,
+    OP_WRITE,
+    OP_LIST,
+    OP_DELETE,
+    OP_COUNT
+};
+
+typedef struct
+{
+    const char *name;
+    bool (*mount)(uint32_t size);
+    void (*unmount)();
+    bool (*write)(const char *path, const uint8_t *data, uint32_t len);
+    bool (*read)(const char *path, uint8_t *buffer, uint32_t len);
+    bool (*open)(const char *path);
+    int (*list)();
+    bool (*remove)(const char *path);
+    double (*usedRatio)();
+} fsDriver_t;
+
+// **************************************************************************************
+//
+//      Variables
+//
+//
+// **************************************************************************************
+static std::vector<uint8_t> flash;
+static flashCount_t counts;
+
+static const char *opNames[OP_COUNT] = {"open", "read", "write", "list", "delete"};
+
+static lfs_t lfs;
+static struct lfs_config lfsConfig;
+
+static spiffs spifs;
+static spiffs_config spiffsConfig;
+static uint8_t spiffsWork[PAGE_SIZE * 2];
+static uint8_t spiffsFds[MAX_FILES * sizeof(spiffs_fd)];
+static uint8_t spiffsCache[sizeof(spiffs_cache) + MAX_FILES * (sizeof(spiffs_cache_page) + PAGE_SIZE)];
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+// the partition as NOR flash: reads are free of side effects, programming can only
+// clear bits, erasing sets a whole sector back to 0xff
+static void flashRead(uint32_t addr, uint32_t size, uint8_t *dst)
+{
+    counts.reads++;
+    counts.readBytes += size;
+    memcpy(dst, &flash[addr], size);
+}
+
+static void flashProg(uint32_t addr, uint32_t size, const uint8_t *src)
+{
+    if (size == 0)
+    {
+        return;
+    }
+    counts.progPages += (addr + size - 1) / PAGE_SIZE - addr / PAGE_SIZE + 1;
+    counts.progBytes += size;
+    for (uint32_t i = 0; i < size; i++)
+    {
+        flash[addr + i] &= src[i];
+    }
+}
+
+static void flashErase(uint32_t addr, uint32_t size)
+{
+    counts.erases += size / BLOCK_SIZE;
+    memset(&flash[addr], 0xff, size);
+}
+
+static double flashMs(const flashCount_t &c)
+{
+    double us = c.reads * READ_CALL_US + c.readBytes / READ_BYTES_US + c.progPages * PROG_PAGE_US +
+                c.progBytes / READ_BYTES_US + c.erases * ERASE_US;
+    return us / 1000.0;
+}
+
+// ---------------------------------------------------------------------- LittleFS
+static int lfsRead(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    flashRead(block * c->block_size + off, size, (uint8_t *)buffer);
+    return 0;
+}
+
+static int lfsProg(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    flashProg(block * c->block_size + off, size, (const uint8_t *)buffer);
+    return 0;
+}
+
+static int lfsErase(const struct lfs_config *c, lfs_block_t block)
+{
+    flashErase(block * c->block_size, c->block_size);
+    return 0;
+}
+
+static int lfsSync(const struct lfs_config *c)
+{
+    (void)c;
+    return 0;
+}
+
+// esp_littlefs defaults: 128 byte read / prog units, 512 byte cache, 128 byte lookahead
+static bool lfsMount(uint32_t size)
+{
+    memset(&lfsConfig, 0, sizeof(lfsConfig));
+    lfsConfig.read = lfsRead;
+    lfsConfig.prog = lfsProg;
+    lfsConfig.erase = lfsErase;
+    lfsConfig.sync = lfsSync;
+    lfsConfig.read_size = 128;
+    lfsConfig.prog_size = 128;
+    lfsConfig.block_size = BLOCK_SIZE;
+    lfsConfig.block_count = size / BLOCK_SIZE;
+    lfsConfig.cache_size = 512;
+    lfsConfig.lookahead_size = 128;
+    lfsConfig.block_cycles = 512;
+    if (lfs_format(&lfs, &lfsConfig) != 0)
+    {
+        return false;
+    }
+    return lfs_mount(&lfs, &lfsConfig) == 0;
+}
+
+static void lfsUnmount()
+{
+    lfs_unmount(&lfs);
+}
+
+static bool lfsWrite(const char *path, const uint8_t *data, uint32_t len)
+{
+    lfs_file_t file;
+    bool ok = true;
+
+    if (lfs_file_open(&lfs, &file, path, LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0)
+    {
+        return false;
+    }
+    for (uint32_t done = 0; ok && (done < len); done += BENCH_CHUNK)
+    {
+        lfs_size_t part = (len - done < BENCH_CHUNK) ? (len - done) : BENCH_CHUNK;
+        ok = lfs_file_write(&lfs, &file, data + done, part) == (lfs_ssize_t)part;
+    }
+    return (lfs_file_close(&lfs, &file) == 0) && ok;
+}
+
+static bool lfsReadFile(const char *path, uint8_t *buffer, uint32_t len)
+{
+    lfs_file_t file;
+    lfs_ssize_t got;
+
+    if (lfs_file_open(&lfs, &file, path, LFS_O_RDONLY) < 0)
+    {
+        return false;
+    }
+    got = lfs_file_read(&lfs, &file, buffer, len);
+    lfs_file_close(&lfs, &file);
+    return got == (lfs_ssize_t)len;
+}
+
+static bool lfsOpen(const char *path)
+{
+    lfs_file_t file;
+
+    if (lfs_file_open(&lfs, &file, path, LFS_O_RDONLY) < 0)
+    {
+        return false;
+    }
+    return lfs_file_close(&lfs, &file) == 0;
+}
+
+static int lfsList()
+{
+    lfs_dir_t dir;
+    struct lfs_info info;
+    int files = 0;
+
+    if (lfs_dir_open(&lfs, &dir, "/") < 0)
+    {
+        return -1;
+    }
+    while (lfs_dir_read(&lfs, &dir, &info) > 0)
+    {
+        if (info.type == LFS_TYPE_REG)
+        {
+            files++;
+        }
+    }
+    lfs_dir_close(&lfs, &dir);
+    return files;
+}
+
+static bool lfsRemove(const char *path)
+{
+    return lfs_remove(&lfs, path) == 0;
+}
+
+static double lfsUsedRatio()
+{
+    lfs_ssize_t blocks = lfs_fs_size(&lfs);
+
+    return (blocks < 0) ? 1.0 : (double)blocks / lfsConfig.block_count;
+}
+
+// ---------------------------------------------------------------------- SPIFFS
+static s32_t spiffsRead(u32_t addr, u32_t size, u8_t *dst)
+{
+    flashRead(addr, size, dst);
+    return SPIFFS_OK;
+}
+
+static s32_t spiffsWrite(u32_t addr, u32_t size, u8_t *src)
+{
+    flashProg(addr, size, src);
+    return SPIFFS_OK;
+}
+
+static s32_t spiffsErase(u32_t addr, u32_t size)
+{
+    flashErase(addr, size);
+    return SPIFFS_OK;
+}
+
+// the esp_spiffs mount sequence: mount, format when that fails, mount again
+static bool spiffsMount(uint32_t size)
+{
+    memset(&spiffsConfig, 0, sizeof(spiffsConfig));
+    spiffsConfig.hal_read_f = spiffsRead;
+    spiffsConfig.hal_write_f = spiffsWrite;
+    spiffsConfig.hal_erase_f = spiffsErase;
+    spiffsConfig.phys_size = size;
+    spiffsConfig.phys_addr = 0;
+    spiffsConfig.phys_erase_block = BLOCK_SIZE;
+    spiffsConfig.log_block_size = BLOCK_SIZE;
+    spiffsConfig.log_page_size = PAGE_SIZE;
+    if (SPIFFS_mount(&spifs, &spiffsConfig, spiffsWork, spiffsFds, sizeof(spiffsFds), spiffsCache,
+                     sizeof(spiffsCache), NULL) == SPIFFS_OK)
+    {
+        return true;
+    }
+    SPIFFS_clearerr(&spifs);
+    if (SPIFFS_format(&spifs) != SPIFFS_OK)
+    {
+        return false;
+    }
+    return SPIFFS_mount(&spifs, &spiffsConfig, spiffsWork, spiffsFds, sizeof(spiffsFds), spiffsCache,
+                        sizeof(spiffsCache), NULL) == SPIFFS_OK;
+}
+
+static void spiffsUnmount()
+{
+    SPIFFS_unmount(&spifs);
+}
+
+static bool spiffsWriteFile(const char *path, const uint8_t *data, uint32_t len)
+{
+    spiffs_file fd = SPIFFS_open(&spifs, path, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_WRONLY, 0);
+    bool ok = true;
+
+    if (fd < 0)
+    {
+        return false;
+    }
+    for (uint32_t done = 0; ok && (done < len); done += BENCH_CHUNK)
+    {
+        s32_t part = (len - done < BENCH_CHUNK) ? (len - done) : BENCH_CHUNK;
+        ok = SPIFFS_write(&spifs, fd, (void *)(data + done), part) == part;
+    }
+    return (SPIFFS_close(&spifs, fd) == SPIFFS_OK) && ok;
+}
+
+static bool spiffsReadFile(const char *path, uint8_t *buffer, uint32_t len)
+{
+    spiffs_file fd = SPIFFS_open(&spifs, path, SPIFFS_RDONLY, 0);
+    s32_t got;
+
+    if (fd < 0)
+    {
+        return false;
+    }
+    got = SPIFFS_read(&spifs, fd, buffer, len);
+    SPIFFS_close(&spifs, fd);
+    return got == (s32_t)len;
+}
+
+static bool spiffsOpen(const char *path)
+{
+    spiffs_file fd = SPIFFS_open(&spifs, path, SPIFFS_RDONLY, 0);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+    return SPIFFS_close(&spifs, fd) == SPIFFS_OK;
+}
+
+static int spiffsList()
+{
+    spiffs_DIR dir;
+    struct spiffs_dirent entry;
+    int files = 0;
+
+    if (SPIFFS_opendir(&spifs, "/", &dir) == NULL)
+    {
+        return -1;
+    }
+    while (SPIFFS_readdir(&dir, &entry) != NULL)
+    {
+        files++;
+    }
+    SPIFFS_closedir(&dir);
+    return files;
+}
+
+static bool spiffsRemove(const char *path)
+{
+    return SPIFFS_remove(&spifs, path) == SPIFFS_OK;
+}
+
+static double spiffsUsedRatio()
+{
+    u32_t total = 0;
+    u32_t used = 0;
+
+    if ((SPIFFS_info(&spifs, &total, &used) != SPIFFS_OK) || (total == 0))
+    {
+        return 1.0;
+    }
+    return (double)used / total;
+}
+
+static const fsDriver_t drivers[] = {
+    {"LittleFS", lfsMount, lfsUnmount, lfsWrite, lfsReadFile, lfsOpen, lfsList, lfsRemove, lfsUsedRatio},
+    {"SPIFFS", spiffsMount, spiffsUnmount, spiffsWriteFile, spiffsReadFile, spiffsOpen, spiffsList, spiffsRemove,
+     spiffsUsedRatio},
+};
+
+// ---------------------------------------------------------------------- benchmark
+static void fillData(std::mt19937 &rng, std::vector<uint8_t> &data, uint32_t len)
+{
+    data.resize(len);
+    for (uint32_t i = 0; i < len; i++)
+    {
+        data[i] = (uint8_t)rng();
+    }
+}
+
+static void record(opStat_t *stat, const flashCount_t &before)
+{
+    flashCount_t delta;
+    double ms;
+
+    delta.reads = counts.reads - before.reads;
+    delta.readBytes = counts.readBytes - before.readBytes;
+    delta.progPages = counts.progPages - before.progPages;
+    delta.progBytes = counts.progBytes - before.progBytes;
+    delta.erases = counts.erases - before.erases;
+    ms = flashMs(delta);
+    stat->sumMs += ms;
+    stat->maxMs = (ms > stat->maxMs) ? ms : stat->maxMs;
+    stat->count++;
+}
+
+// fills up to the target, ages the files, then times each operation; false when the
+// target could not be reached
+static bool benchRun(const fsDriver_t *fs, uint32_t size, double fill, uint32_t seed, opStat_t *stats,
+                     double *amplification, double *reached)
+{
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<uint32_t> fileSize(FILL_MIN, FILL_MAX);
+    std::vector<std::string> files;
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> buffer(BENCH_FILE_SIZE);
+    uint64_t progBefore;
+    bool ok = true;
+    char path[32];
+
+    flash.assign(size, 0xff);
+    memset(&counts, 0, sizeof(counts));
+    memset(stats, 0, OP_COUNT * sizeof(opStat_t));
+    if (!fs->mount(size))
+    {
+        printf("%s: mount failed\n", fs->name);
+        return false;
+    }
+
+    while (fs->usedRatio() < fill)
+    {
+        snprintf(path, sizeof(path), "/fill_%u", (unsigned)files.size());
+        fillData(rng, data, fileSize(rng));
+        if (!fs->write(path, data.data(), data.size()))
+        {
+            ok = false;
+            break;
+        }
+        files.push_back(path);
+    }
+    for (size_t i = 0; ok && (i < files.size() / 2); i++)
+    {
+        const std::string &victim = files[rng() % files.size()];
+
+        fs->remove(victim.c_str());
+        fillData(rng, data, fileSize(rng));
+        while (!fs->write(victim.c_str(), data.data(), data.size()) && (data.size() > FILL_MIN))
+        {
+            data.resize(data.size() / 2); // aging must not push the partition over the edge
+        }
+    }
+    *reached = fs->usedRatio();
+
+    progBefore = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        flashCount_t before;
+        const char *existing = files.empty() ? NULL : files[rng() % files.size()].c_str();
+
+        fillData(rng, data, BENCH_FILE_SIZE);
+        snprintf(path, sizeof(path), "/bench_%d", round);
+
+        before = counts;
+        if (!fs->write(path, data.data(), data.size()))
+        {
+            printf("%s: no room for the bench file at %.0f %% fill\n", fs->name, fill * 100);
+            fs->unmount();
+            return false;
+        }
+        record(&stats[OP_WRITE], before);
+        progBefore += counts.progBytes - before.progBytes;
+
+        if (existing != NULL)
+        {
+            before = counts;
+            fs->open(existing);
+            record(&stats[OP_OPEN], before);
+        }
+
+        before = counts;
+        if (!fs->read(path, buffer.data(), buffer.size()) || (memcmp(buffer.data(), data.data(), data.size()) != 0))
+        {
+            printf("%s: read back mismatch\n", fs->name);
+        }
+        record(&stats[OP_READ], before);
+
+        before = counts;
+        fs->list();
+        record(&stats[OP_LIST], before);
+
+        before = counts;
+        fs->remove(path);
+        record(&stats[OP_DELETE], before);
+    }
+    *amplification = (double)progBefore / ((double)BENCH_ROUNDS * BENCH_FILE_SIZE);
+    fs->unmount();
+    return true;
+}
+
+// **************************************************************************************
+//
+//                      Definition of Global Functions
+//
+//
+// **************************************************************************************
+int main(int argc, char **argv)
+{
+    static const double fills[] = {0.0, 0.25, 0.50, 0.75, 0.90};
+    uint32_t size = (argc > 1) ? strtoul(argv[1], NULL, 0) : PARTITION_SIZE;
+    uint32_t seed = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1;
+    opStat_t stats[OP_COUNT];
+
+    size -= size % BLOCK_SIZE;
+    printf("partition %u KB, %d rounds of a %d byte file per fill level, seed %u\n", (unsigned)(size / 1024),
+           BENCH_ROUNDS, BENCH_FILE_SIZE, (unsigned)seed);
+    printf("latency in ms as mean/max, modelled from flash traffic\n\n");
+    printf("%-9s %5s %5s", "fs", "fill", "real");
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        printf(" %15s", opNames[op]);
+    }
+    printf(" %6s\n", "w.amp");
+
+    for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++)
+    {
+        for (size_t d = 0; d < sizeof(drivers) / sizeof(drivers[0]); d++)
+        {
+            double amplification = 0;
+            double reached = 0;
+
+            if (!benchRun(&drivers[d], size, fills[f], seed, stats, &amplification, &reached))
+            {
+                continue;
+            }
+            printf("%-9s %4.0f%% %4.0f%%", drivers[d].name, fills[f] * 100, reached * 100);
+            for (int op = 0; op < OP_COUNT; op++)
+            {
+                double mean = stats[op].count ? stats[op].sumMs / stats[op].count : 0;
+                printf(" %7.2f/%7.2f", mean, stats[op].maxMs);
+            }
+            printf(" %6.2f\n", amplification);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,549 @@
+#!/usr/bin/env python3
+"""Quectel M95 modem simulator for bench-testing the GSM state machine.
+
+Implements the AT subset used by src/Gsm.cpp on a pseudo terminal (default) or
+a real serial port (--port, needs pyserial), so the firmware's modem UART can
+be wired to a USB-UART adapter instead of an M95. Per-command latency, dropped
+bytes, +CME ERROR injection, slow registration and broker outages are scripted
+in a JSON scenario; with the same seed a run is deterministic.
+
+The HTTP client (AT+QHTTPURL / QHTTPGET / QHTTPREAD) fetches for real from the
+URL it is given, so the cellular OTA path can run against tools/ota_server.
+
+AT+IPR switches the simulated port after its OK, like the module: a pyserial
+port is reconfigured, on a pty the rate the firmware side set (termios) is
+compared and bytes sent at a different rate arrive as garbage both ways, so a
+host and modem that disagree about the rate stop talking.
+
+At exit (Ctrl-C or --duration) a report is printed: bring-up time (first AT to
+first successful QMTPUB), per-command counts/errors and publish throughput.
+"""
+
+import argparse
+import heapq
+import json
+import os
+import random
+import re
+import select
+import sys
+import termios
+import time
+import tty
+import urllib.error
+import urllib.request
+
+DEFAULT_SCENARIO = {
+    "seed": 1,
+    "baud": 9600,
+    "default_latency_ms": [20, 60],
+    "latency_ms": {
+        "AT+QMTOPEN": [800, 2500],
+        "AT+QMTCONN": [300, 900],
+        "AT+QMTPUB": [200, 600],
+        "AT+QIACT": [500, 1500],
+        "AT+QHTTPGET": [300, 1200],
+    },
+    "register_after_s": 5,
+    "rssi": 20,
+    "operator": "41006",
+    "operator_name": "Telenor PK",
+    "sim_present": True,
+    "drop_byte_probability": 0.0,
+    "cme_errors": {},
+    "broker_outages": [],
+    "http_fail_probability": 0.0,  # AT+QHTTPGET answers +CME ERROR: 3822
+    "http_cut_probability": 0.0,  # AT+QHTTPREAD stops half way, no final result
+}
+
+
+class Stats:
+    def __init__(self):
+        self.start = time.monotonic()
+        self.first_at = None
+        self.first_publish = None
+        self.commands = {}
+        self.errors = {}
+        self.published = 0
+        self.publish_bytes = 0
+        self.bytes_in = 0
+        self.bytes_out = 0
+        self.dropped = 0
+        self.garbled = 0
+        self.baud_switches = 0
+        self.http_gets = 0
+        self.http_bytes = 0
+        self.http_failed = 0
+        self.http_cut = 0
+
+    def count(self, key, errored):
+        self.commands[key] = self.commands.get(key, 0) + 1
+        if errored:
+            self.errors[key] = self.errors.get(key, 0) + 1
+
+    def report(self):
+        now = time.monotonic()
+        print("\n==== M95 simulator report ====")
+        if self.first_at is not None and self.first_publish is not None:
+            print("bring-up (first AT -> first publish): %.2f s" % (self.first_publish - self.first_at))
+        else:
+            print("bring-up: no successful publish")
+        elapsed = now - (self.first_publish or now)
+        print("publishes: %d, payload bytes: %d" % (self.published, self.publish_bytes))
+        if self.published > 1 and elapsed > 0:
+            print("publish rate after bring-up: %.3f msg/min" % ((self.published - 1) * 60.0 / elapsed))
+        print("uart bytes in/out: %d/%d, dropped: %d, garbled (rate mismatch): %d, baud switches: %d"
+              % (self.bytes_in, self.bytes_out, self.dropped, self.garbled, self.baud_switches))
+        if self.http_gets:
+            print("http gets: %d, body bytes: %d, failed: %d, cut: %d" % (self.http_gets, self.http_bytes, self.http_failed, self.http_cut))
+        print("%-14s %6s %6s" % ("command", "count", "error"))
+        for key in sorted(self.commands):
+            print("%-14s %6d %6d" % (key, self.commands[key], self.errors.get(key, 0)))
+
+
+class Modem:
+    def __init__(self, scenario, write_fn, set_baud_fn=None, host_baud_fn=None):
+        self.sc = scenario
+        self.rng = random.Random(scenario["seed"])
+        self.write_fn = write_fn
+        self.set_baud_fn = set_baud_fn  # reconfigures a real port
+        self.host_baud_fn = host_baud_fn  # rate the other end of a pty uses, None if unknown
+        self.saved_ipr = scenario["baud"]  # AT&W
+        self.stats = Stats()
+        self.pending = []  # (due, seq, bytes) heap of delayed output
+        self.seq = 0
+        self.rx = b""
+        self.skip_lf = False  # LF of the CR LF that ended a command line
+        self.raw_left = 0  # bytes still expected in CONNECT data mode
+        self.raw_done = None
+        self.pub_mode = False
+        self.pub_buf = b""
+        self.busy_until = 0.0
+        self.after = []  # URCs that follow the final result of the current command
+        self.cme_budget = {k: v.get("count", 0) for k, v in scenario["cme_errors"].items()}
+        self.power_on()
+
+    def power_on(self):
+        self.boot_time = time.monotonic()
+        self.echo = True
+        self.ipr = self.saved_ipr
+        self.apply_baud(self.ipr)
+        self.cops_numeric = False
+        self.pdp = False
+        self.mqtt_open = False
+        self.mqtt_conn = False
+        self.certs = {}
+        self.http_url = None
+        self.http_body = None
+
+    # ---- output scheduling -------------------------------------------------
+    def now(self):
+        return time.monotonic() - self.stats.start
+
+    def emit(self, data, delay=0.0):
+        due = max(time.monotonic() + delay, self.busy_until)
+        # wire time of the reply at the current baud rate, 10 bits per byte
+        self.busy_until = due + len(data) * 10.0 / self.ipr
+        heapq.heappush(self.pending, (due, self.seq, data))
+        self.seq += 1
+
+    # runs once everything emitted before it is on the wire
+    def emit_action(self, fn, delay=0.0):
+        due = max(time.monotonic() + delay, self.busy_until)
+        heapq.heappush(self.pending, (due, self.seq, fn))
+        self.seq += 1
+
+    def apply_baud(self, baud):
+        self.ipr = baud
+        if self.set_baud_fn is not None:
+            self.set_baud_fn(baud)
+
+    def rate_matches(self):
+        host = self.host_baud_fn() if self.host_baud_fn is not None else None
+        return host is None or host == self.ipr
+
+    def garble(self, data):
+        self.stats.garbled += len(data)
+        return bytes(self.rng.randrange(0x80, 0x100) for _ in data)
+
+    def flush_due(self):
+        now = time.monotonic()
+        while self.pending and self.pending[0][0] <= now:
+            _, _, data = heapq.heappop(self.pending)
+            if callable(data):
+                data()
+                continue
+            if not self.rate_matches():
+                data = self.garble(data)
+            p = self.sc["drop_byte_probability"]
+            if p > 0:
+                kept = bytes(b for b in data if self.rng.random() >= p)
+                self.stats.dropped += len(data) - len(kept)
+                data = kept
+            self.stats.bytes_out += len(data)
+            self.write_fn(data)
+
+    def next_due(self):
+        return self.pending[0][0] if self.pending else None
+
+    def latency(self, key):
+        lo, hi = self.sc["latency_ms"].get(key, self.sc["default_latency_ms"])
+        return self.rng.uniform(lo, hi) / 1000.0
+
+    def line(self, text, delay):
+        self.emit(("\r\n%s\r\n" % text).encode(), delay)
+
+    # ---- world state -------------------------------------------------------
+    def registered(self):
+        return time.monotonic() - self.boot_time >= self.sc["register_after_s"]
+
+    def broker_down(self):
+        t = self.now()
+        return any(start <= t < end for start, end in self.sc["broker_outages"])
+
+    def inject_error(self, key):
+        rule = self.sc["cme_errors"].get(key)
+        if not rule:
+            return False
+        if self.cme_budget.get(key, 0) > 0:
+            self.cme_budget[key] -= 1
+            return True
+        return self.rng.random() < rule.get("probability", 0.0)
+
+    def switch_baud(self, baud):
+        if baud != self.ipr:
+            self.stats.baud_switches += 1
+            print("[%.2f] baud %d -> %d" % (self.now(), self.ipr, baud))
+            sys.stdout.flush()
+        self.apply_baud(baud)
+
+    def tick(self):
+        # broker drop while connected is reported with an unsolicited +QMTSTAT
+        if self.mqtt_open and self.broker_down():
+            self.mqtt_open = False
+            self.mqtt_conn = False
+            self.line("+QMTSTAT: 0,1", 0)
+
+    # ---- input -------------------------------------------------------------
+    def feed(self, data):
+        self.stats.bytes_in += len(data)
+        if not self.rate_matches():
+            # sent at another rate: framing garbage, never a valid command
+            self.garble(data)
+            return
+        for byte in data:
+            b = bytes([byte])
+            if self.skip_lf:
+                self.skip_lf = False
+                if byte == 0x0A:
+                    continue  # LF of the terminator of the command line before
+            # data mode counts every byte, the CR LF line ends of a PEM body included
+            if self.raw_left > 0:
+                self.raw_left -= 1
+                self.raw_buf += b
+                if self.raw_left == 0:
+                    self.raw_done(self.raw_buf)
+                continue
+            if self.pub_mode:
+                if byte == 0x1A:
+                    self.pub_mode = False
+                    self.finish_publish(self.pub_buf)
+                else:
+                    self.pub_buf += b
+                continue
+            if byte == 0x1A:
+                continue  # stray Ctrl-Z after a publish
+            self.rx += b
+            if byte in (0x0D, 0x0A):
+                text = self.rx.strip().decode(errors="replace")
+                self.rx = b""
+                self.skip_lf = byte == 0x0D
+                if text:
+                    self.command(text)
+
+    def command(self, text):
+        if self.echo:
+            self.emit((text + "\r").encode())
+        if self.stats.first_at is None and text.upper().startswith("AT"):
+            self.stats.first_at = time.monotonic()
+        # basic + extended commands chained with ';' are executed in order, one final result
+        body = text[2:] if text.upper().startswith("AT") else text
+        parts = body.split(";") if body else [""]
+        results = []
+        self.after = []
+        self.new_ipr = None
+        delay = 0.0
+        for part in parts:
+            cmd = "AT" + part.strip()
+            key = re.split(r"[=?]", cmd, maxsplit=1)[0].upper()
+            delay += self.latency(key)
+            ok, lines = self.execute(cmd, key, delay)
+            self.stats.count(key, not ok)
+            if lines is None:
+                return  # command switched to a data mode, it sends its own result
+            results.extend(lines)
+            if not ok:
+                break
+        for line in results:
+            self.line(line, delay)
+        if ok:
+            self.line("OK", delay)
+            if self.new_ipr is not None:
+                # the OK still goes out at the old rate, the module switches after it
+                self.emit_action(lambda baud=self.new_ipr: self.switch_baud(baud), delay)
+        for text, extra in self.after:
+            self.line(text, delay + extra)
+
+    # returns (ok, intermediate lines); error lines are part of the list,
+    # a None list means the command entered a data mode and reports its own result
+    def execute(self, cmd, key, delay):
+        u = cmd.upper()
+        if self.inject_error(key):
+            return False, ["+CME ERROR: 100"]
+        if u == "AT&W":
+            self.saved_ipr = self.ipr
+            return True, []
+        if u in ("AT", "AT+QSCLK=1", "AT+QIMODE=0", "AT+QIREGAPP") or u.startswith(("AT+QMTCFG", "AT+QSSLCFG", "AT+QICSGP=")):
+            return True, []
+        if u == "ATE0":
+            self.echo = False
+            return True, []
+        if u == "ATI":
+            return True, ["Quectel_Ltd", "Quectel_M95", "Revision: M95FAR02A08 (sim)"]
+        if u == "AT+GSN":
+            return True, ["861234567890123"]
+        if u.startswith("AT+CFUN"):
+            if u in ("AT+CFUN=1,1", "AT+CFUN=0"):
+                self.power_on()
+            return True, []
+        if u.startswith("AT+IPR="):
+            baud = int(u.split("=")[1])
+            if baud not in (0, 2400, 4800, 9600, 14400, 19200, 28800, 38400, 57600, 115200):
+                return False, ["ERROR"]
+            self.new_ipr = baud if baud != 0 else None  # 0 (autobaud) is not modelled
+            return True, []
+        if u == "AT+IPR?":
+            return True, ["+IPR: %d" % self.ipr]
+        if u == "AT+CCID":
+            if not self.sc["sim_present"]:
+                return False, ["+CME ERROR: SIM not inserted"]
+            return True, ['+CCID: "89923001234567890123"']
+        if u == "AT+CPIN?":
+            return True, ["+CPIN: READY"]
+        if u == "AT+CSQ":
+            return True, ["+CSQ: %d,0" % self.sc["rssi"]]
+        if u == "AT+CREG?":
+            return True, ["+CREG: 0,%d" % (1 if self.registered() else 2)]
+        if u in ("AT+QNITZ=1", "AT+CTZU=3"):
+            return True, []
+        if u in ("AT+QLTS", "AT+CCLK?"):
+            # network time after registration (the host clock as UTC), the RTC default before
+            stamp = time.strftime("%y/%m/%d,%H:%M:%S+00", time.gmtime()) if self.registered() else None
+            if u == "AT+QLTS":
+                return True, ['+QLTS: "%s"' % (stamp + ",0" if stamp else "")]
+            return True, ['+CCLK: "%s"' % (stamp or "04/01/01,00:00:00+00")]
+        if u == "AT+CGATT?":
+            return True, ["+CGATT: %d" % (1 if self.registered() else 0)]
+        if u == "AT+COPS=3,2":
+            self.cops_numeric = True
+            return True, []
+        if u == "AT+COPS?":
+            if not self.registered():
+                return True, ["+COPS: 0"]
+            if self.cops_numeric:
+                return True, ['+COPS: 0,2,"%s"' % self.sc["operator"]]
+            return True, ['+COPS: 0,0,"%s"' % self.sc["operator_name"]]
+        if u == "AT+QICSGP?":
+            return True, ["+QICSGP: 1"]
+        if u == "AT+QIACT":
+            if not self.registered():
+                return False, ["ERROR"]
+            self.pdp = True
+            return True, []
+        if u == "AT+QIDEACT":
+            self.pdp = self.mqtt_open = self.mqtt_conn = False
+            return True, ["DEACT OK"]
+        if u == "AT+QILOCIP":
+            return (True, ["10.23.45.67"]) if self.pdp else (False, ["ERROR"])
+        if u.startswith("AT+QSECWRITE="):
+            m = re.match(r'AT\+QSECWRITE="([^"]+)",(\d+)', cmd, re.I)
+            name, size = m.group(1), int(m.group(2))
+            self.raw_left, self.raw_buf = size, b""
+
+            def done(data, name=name):
+                self.certs[name] = data
+                self.line("+QSECWRITE: %d,%04x" % (len(data), sum(data) & 0xFFFF), self.latency(key))
+                self.line("OK", 0)
+
+            self.raw_done = done
+            self.emit(b"\r\nCONNECT\r\n", delay)
+            return True, None  # final result comes after the data
+        if u.startswith("AT+QSECREAD="):
+            name = cmd.split('"')[1]
+            data = self.certs.get(name)
+            if data is None:
+                return False, ["+CME ERROR: 4010"]
+            return True, ["+QSECREAD: 1,%04x" % (sum(data) & 0xFFFF)]
+        if u.startswith("AT+QHTTPURL="):
+            size = int(u.split("=")[1].split(",")[0])
+            self.raw_left, self.raw_buf = size, b""
+
+            def done(data):
+                self.http_url = data.decode(errors="replace")
+                self.line("OK", 0)
+
+            self.raw_done = done
+            self.emit(b"\r\nCONNECT\r\n", delay)
+            return True, None
+        if u.startswith("AT+QHTTPGET"):
+            return self.http_get()
+        if u.startswith("AT+QHTTPREAD"):
+            return self.http_read(delay)
+        if u.startswith("AT+QMTOPEN="):
+            if self.mqtt_open:
+                self.after.append(("+QMTOPEN: 0,2", 0))
+            elif not self.pdp or self.broker_down():
+                self.after.append(("+QMTOPEN: 0,3", 1.0))
+            else:
+                self.mqtt_open = True
+                self.after.append(("+QMTOPEN: 0,0", self.latency(key)))
+            return True, []
+        if u == "AT+QMTOPEN?":
+            return True, ['+QMTOPEN: 0,"iot.thingsty.com",8883'] if self.mqtt_open else []
+        if u.startswith("AT+QMTCONN="):
+            if self.mqtt_open and not self.broker_down():
+                self.mqtt_conn = True
+                self.after.append(("+QMTCONN: 0,0,0", self.latency(key)))
+            else:
+                self.after.append(("+QMTCONN: 0,1", 0))
+            return True, []
+        if u == "AT+QMTCONN?":
+            return True, ["+QMTCONN: 0,%d" % (3 if self.mqtt_conn else 1)]
+        if u.startswith("AT+QMTDISC"):
+            self.mqtt_conn = self.mqtt_open = False
+            self.after.append(("+QMTDISC: 0,0", 0))
+            return True, []
+        if u.startswith("AT+QMTPUB="):
+            self.pub_mode, self.pub_buf = True, b""
+            self.emit(b"\r\n> ", delay)
+            return True, None
+        return False, ["ERROR"]
+
+    def http_get(self):
+        self.http_body = None
+        if not self.pdp or self.http_url is None:
+            return False, ["+CME ERROR: 3813"]
+        self.stats.http_gets += 1
+        if self.rng.random() < self.sc["http_fail_probability"]:
+            self.stats.http_failed += 1
+            return False, ["+CME ERROR: 3822"]
+        try:
+            with urllib.request.urlopen(self.http_url, timeout=10) as reply:
+                self.http_body = reply.read()
+        except (urllib.error.URLError, OSError):
+            return False, ["+CME ERROR: 3822"]
+        return True, []
+
+    def http_read(self, delay):
+        if self.http_body is None:
+            return False, ["+CME ERROR: 3822"]
+        body = self.http_body
+        if self.rng.random() < self.sc["http_cut_probability"]:
+            self.stats.http_cut += 1
+            self.emit(b"\r\nCONNECT\r\n" + body[: len(body) // 2], delay)
+            return True, None
+        self.stats.http_bytes += len(body)
+        self.emit(b"\r\nCONNECT\r\n" + body + b"\r\nOK\r\n", delay)
+        return True, None
+
+    def finish_publish(self, payload):
+        delay = self.latency("AT+QMTPUB")
+        if self.mqtt_conn and not self.broker_down():
+            self.stats.published += 1
+            self.stats.publish_bytes += len(payload)
+            if self.stats.first_publish is None:
+                self.stats.first_publish = time.monotonic()
+            self.line("OK", delay)
+            self.line("+QMTPUB: 0,0,0", delay)
+        else:
+            self.line("OK", delay)
+            self.line("+QMTPUB: 0,0,2", delay)
+
+
+def load_scenario(path):
+    scenario = json.loads(json.dumps(DEFAULT_SCENARIO))
+    if path:
+        with open(path) as f:
+            user = json.load(f)
+        for key, value in user.items():
+            if isinstance(value, dict) and isinstance(scenario.get(key), dict):
+                scenario[key].update(value)
+            else:
+                scenario[key] = value
+    return scenario
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("scenario", nargs="?", help="JSON scenario file")
+    ap.add_argument("--port", help="serial port to attach to instead of a pty")
+    ap.add_argument("--duration", type=float, default=0, help="stop after N seconds")
+    ap.add_argument("--seed", type=int, help="override scenario seed")
+    args = ap.parse_args()
+
+    scenario = load_scenario(args.scenario)
+    if args.seed is not None:
+        scenario["seed"] = args.seed
+
+    if args.port:
+        import serial  # pyserial
+
+        ser = serial.Serial(args.port, scenario["baud"], timeout=0)
+        rfd, write_fn = ser.fileno(), ser.write
+
+        def set_baud_fn(baud):
+            ser.baudrate = baud
+
+        host_baud_fn = None  # one physical port, a mismatch is real
+        print("attached to %s at %d baud" % (args.port, scenario["baud"]))
+    else:
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        attrs = termios.tcgetattr(slave)
+        attrs[4] = attrs[5] = getattr(termios, "B%d" % scenario["baud"])
+        termios.tcsetattr(slave, termios.TCSANOW, attrs)  # a client that never sets a rate matches
+        rfd = master
+
+        def write_fn(data):
+            os.write(master, data)
+
+        set_baud_fn = None
+        speeds = {getattr(termios, "B%d" % b): b for b in (2400, 4800, 9600, 19200, 38400, 57600, 115200)}
+
+        def host_baud_fn():
+            # the speed the firmware side configured on its end of the pty
+            return speeds.get(termios.tcgetattr(slave)[5])
+
+        print("modem pty: %s" % os.ttyname(slave))
+    sys.stdout.flush()
+
+    modem = Modem(scenario, write_fn, set_baud_fn, host_baud_fn)
+    end = time.monotonic() + args.duration if args.duration else None
+    try:
+        while end is None or time.monotonic() < end:
+            due = modem.next_due()
+            timeout = 0.05 if due is None else max(0.0, min(0.05, due - time.monotonic()))
+            ready, _, _ = select.select([rfd], [], [], timeout)
+            if ready:
+                data = os.read(rfd, 1024)
+                if data:
+                    modem.feed(data)
+            modem.tick()
+            modem.flush_due()
+    except KeyboardInterrupt:
+        pass
+    modem.stats.report()
+
+
+if __name__ == "__main__":
+    main()
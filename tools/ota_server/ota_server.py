@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Local update server for the cellular OTA path (src/gsm_ota.cpp).
+
+  ota_server.py .pio/build/esp32dev/firmware.bin [--port 8080] [--base-url URL]
+
+Serves
+  /manifest.txt                            "<size> <md5> <base-url>/firmware.bin"
+  /firmware.bin?offset=<n>&length=<m>      m bytes of the image from n, what the
+                                           device asks for, one chunk per request
+  /firmware.bin (Range: bytes=a-b)         the same for ordinary HTTP clients
+
+Build the firmware with -DGSM_OTA_MANIFEST_URL pointing at /manifest.txt. With
+the modem simulator (tools/m95_sim) the base URL can stay on 127.0.0.1, the
+simulator does the HTTP requests; a real M95 needs an address it can reach.
+The image is re-read on every manifest request, so a new build is picked up
+without a restart. At exit the requests and bytes served are printed.
+"""
+
+import argparse
+import hashlib
+import http.server
+import re
+import signal
+import sys
+import urllib.parse
+
+
+class Stats:
+    def __init__(self):
+        self.manifests = 0
+        self.chunks = 0
+        self.bytes = 0
+        self.bad = 0
+
+    def report(self):
+        print("\n==== OTA server report ====")
+        print("manifest requests: %d, chunk requests: %d, bytes served: %d, bad requests: %d"
+              % (self.manifests, self.chunks, self.bytes, self.bad))
+
+
+def make_handler(image_path, base_url, stats):
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def image(self):
+            with open(image_path, "rb") as f:
+                return f.read()
+
+        def reply(self, code, body, extra=None):
+            self.send_response(code)
+            self.send_header("Content-Type", "application/octet-stream")
+            self.send_header("Content-Length", str(len(body)))
+            for key, value in (extra or {}).items():
+                self.send_header(key, value)
+            self.end_headers()
+            self.wfile.write(body)
+
+        def do_GET(self):
+            url = urllib.parse.urlsplit(self.path)
+            if url.path == "/manifest.txt":
+                data = self.image()
+                stats.manifests += 1
+                line = "%d %s %s/firmware.bin\n" % (len(data), hashlib.md5(data).hexdigest(), base_url)
+                self.reply(200, line.encode())
+                return
+            if url.path != "/firmware.bin":
+                stats.bad += 1
+                self.reply(404, b"not found\n")
+                return
+            data = self.image()
+            query = urllib.parse.parse_qs(url.query)
+            start, end, partial = 0, len(data), False
+            if "offset" in query:
+                start = int(query["offset"][0])
+                end = start + int(query.get("length", [len(data)])[0])  # plain 200, the M95 expects that
+            else:
+                m = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range", ""))
+                if m:
+                    start = int(m.group(1))
+                    end = int(m.group(2)) + 1 if m.group(2) else len(data)
+                    partial = True
+            if start >= len(data) or end <= start:
+                stats.bad += 1
+                self.reply(416, b"", {"Content-Range": "bytes */%d" % len(data)})
+                return
+            end = min(end, len(data))
+            stats.chunks += 1
+            stats.bytes += end - start
+            if partial:
+                self.reply(206, data[start:end], {"Content-Range": "bytes %d-%d/%d" % (start, end - 1, len(data))})
+            else:
+                self.reply(200, data[start:end])
+
+        def log_message(self, fmt, *args):
+            sys.stderr.write("%s\n" % (fmt % args))
+
+    return Handler
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("image", help="firmware.bin to serve")
+    ap.add_argument("--port", type=int, default=8080)
+    ap.add_argument("--base-url", help="URL the manifest points at, default http://127.0.0.1:<port>")
+    args = ap.parse_args()
+
+    base_url = (args.base_url or "http://127.0.0.1:%d" % args.port).rstrip("/")
+    stats = Stats()
+    server = http.server.ThreadingHTTPServer(("", args.port), make_handler(args.image, base_url, stats))
+    print("serving %s, manifest at %s/manifest.txt" % (args.image, base_url))
+    sys.stdout.flush()
+    # SIGTERM too, background jobs of a script do not get SIGINT
+    signal.signal(signal.SIGTERM, signal.default_int_handler)
+    signal.signal(signal.SIGINT, signal.default_int_handler)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    stats.report()
+
+
+if __name__ == "__main__":
+    main()
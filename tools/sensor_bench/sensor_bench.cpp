@@ -0,0 +1,117 @@
+// **************************************************************************************
+//   Host benchmark for src/sensor_filter.cpp. Feeds synthetic distance readings (slow
+//   level changes, gaussian noise, random spikes and dropouts) through filterWindow() and
+//   compares its error and cost with a plain mean and a plain median of the same window.
+//
+//   g++ -O2 -std=c++17 -Isrc tools/sensor_bench/sensor_bench.cpp src/sensor_filter.cpp -o sensor_bench
+//   ./sensor_bench [window] [noise_mm] [spike_percent] [seed]
+// **************************************************************************************
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "sensor_filter.h"
+
+#define WINDOWS 200000
+#define FULL_SCALE_MM 5000
+
+// **************************************************************************************
+//
+//                      Definition of Local Functions
+//
+//
+// **************************************************************************************
+static uint16_t meanOf(const uint16_t *samples, uint8_t count)
+{
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        sum += samples[i];
+    }
+    return (uint16_t)((sum + (count / 2)) / count);
+}
+
+static uint16_t medianOf(const uint16_t *samples, uint8_t count)
+{
+    uint16_t sorted[FILTER_WINDOW_MAX];
+    std::copy(samples, samples + count, sorted);
+    std::sort(sorted, sorted + count);
+    return ((count & 1) != 0) ? sorted[count / 2] : (uint16_t)((sorted[(count / 2) - 1] + sorted[count / 2]) / 2);
+}
+
+static double rms(double sumSquares)
+{
+    return std::sqrt(sumSquares / WINDOWS);
+}
+
+// **************************************************************************************
+//
+//                      Main
+//
+//
+// **************************************************************************************
+int main(int argc, char **argv)
+{
+    int window = (argc > 1) ? atoi(argv[1]) : 15;
+    double noise = (argc > 2) ? atof(argv[2]) : 8.0;
+    double spikes = (argc > 3) ? atof(argv[3]) / 100.0 : 0.05;
+    unsigned seed = (argc > 4) ? (unsigned)atoi(argv[4]) : 1;
+
+    if ((window < 1) || (window > FILTER_WINDOW_MAX))
+    {
+        fprintf(stderr, "window must be 1..%d\n", FILTER_WINDOW_MAX);
+        return 1;
+    }
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<double> gauss(0.0, noise);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<uint16_t> raw((size_t)WINDOWS * window);
+    std::vector<double> truth(WINDOWS);
+
+    // a level that drifts slowly, as a tank or river would
+    for (int w = 0; w < WINDOWS; w++)
+    {
+        truth[w] = 2500.0 + 1500.0 * std::sin(w / 500.0);
+        for (int i = 0; i < window; i++)
+        {
+            double value = truth[w] + gauss(rng);
+            if (unit(rng) < spikes)
+            {
+                value = (unit(rng) < 0.5) ? 0.0 : FULL_SCALE_MM; // dropout or multipath echo
+            }
+            raw[(size_t)w * window + i] = (uint16_t)std::min(std::max(value, 0.0), (double)FULL_SCALE_MM);
+        }
+    }
+
+    double errMean = 0, errMedian = 0, errFilter = 0;
+    unsigned long keptTotal = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int w = 0; w < WINDOWS; w++)
+    {
+        uint8_t kept;
+        double e = filterWindow(&raw[(size_t)w * window], (uint8_t)window, &kept) - truth[w];
+        errFilter += e * e;
+        keptTotal += kept;
+    }
+    double filterNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / WINDOWS;
+
+    for (int w = 0; w < WINDOWS; w++)
+    {
+        double e = meanOf(&raw[(size_t)w * window], (uint8_t)window) - truth[w];
+        errMean += e * e;
+        e = medianOf(&raw[(size_t)w * window], (uint8_t)window) - truth[w];
+        errMedian += e * e;
+    }
+
+    printf("window %d, noise %.1f mm, spikes %.1f %%, %d windows\n", window, noise, spikes * 100.0, WINDOWS);
+    printf("mean    rms error %8.2f mm\n", rms(errMean));
+    printf("median  rms error %8.2f mm\n", rms(errMedian));
+    printf("filter  rms error %8.2f mm, %.1f of %d samples kept, %.0f ns per window\n", rms(errFilter),
+           (double)keptTotal / WINDOWS, window, filterNs);
+    return 0;
+}